@@ -0,0 +1,169 @@
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "arena.hpp"
+#include "transport.hpp"
+
+namespace {
+
+const size_t chunk_size = 16 << 10;
+const size_t large = size_t(-1);
+
+// In front of every block, keeps payloads 16-byte aligned
+struct alignas(16) header {
+  // size class, or large
+  size_t cls;
+  // usable bytes
+  size_t size;
+};
+
+// Chunks released by arenas destroyed on this thread, for the next ones
+struct chunk_cache {
+  static const size_t max = 256;
+  std::vector<void*> chunks;
+  ~chunk_cache();
+};
+thread_local chunk_cache cache;
+// Sessions may still be freed once the thread's cache is gone, from
+// static destructors on the main thread
+thread_local bool cache_gone = false;
+
+chunk_cache::~chunk_cache() {
+  cache_gone = true;
+  for (void* c : chunks)
+    free(c);
+}
+
+header* header_of(void* p) {
+  return static_cast<header*>(p) - 1;
+}
+
+}
+
+session_arena::~session_arena() {
+  if (destroyed)
+    *destroyed = true;
+  if (transport)
+    transport->close();
+  for (void* c : chunks) {
+    if (!cache_gone && cache.chunks.size() < chunk_cache::max)
+      cache.chunks.push_back(c);
+    else
+      free(c);
+  }
+}
+
+void* session_arena::allocate(size_t n) {
+  size_t cls = 0;
+  while (cls < classes && (size_t(32) << cls) - sizeof(header) < n)
+    ++cls;
+  if (cls == classes) {
+    auto h = static_cast<header*>(malloc(sizeof(header) + n));
+    if (!h)
+      return nullptr;
+    *h = header{ large, n };
+    return h + 1;
+  }
+  header* h;
+  size_t block = size_t(32) << cls;
+  if (free_lists[cls]) {
+    h = static_cast<header*>(free_lists[cls]);
+    free_lists[cls] = *reinterpret_cast<void**>(h + 1);
+  } else {
+    if (left < block) {
+      // The tail of the previous chunk is lost until the arena goes
+      void* c;
+      if (!cache_gone && !cache.chunks.empty()) {
+        c = cache.chunks.back();
+        cache.chunks.pop_back();
+      } else if (!(c = malloc(chunk_size))) {
+        return nullptr;
+      }
+      // Called from libssh2: no exception may escape
+      try {
+        chunks.push_back(c);
+      } catch (const std::bad_alloc&) {
+        free(c);
+        return nullptr;
+      }
+      next = static_cast<char*>(c);
+      left = chunk_size;
+    }
+    h = reinterpret_cast<header*>(next);
+    next += block;
+    left -= block;
+  }
+  *h = header{ cls, block - sizeof(header) };
+  return h + 1;
+}
+
+void session_arena::deallocate(void* p) {
+  if (!p)
+    return;
+  header* h = header_of(p);
+  if (h->cls == large)
+    return free(h);
+  *static_cast<void**>(p) = free_lists[h->cls];
+  free_lists[h->cls] = h;
+}
+
+void* session_arena::reallocate(void* p, size_t n) {
+  if (!p)
+    return allocate(n);
+  header* h = header_of(p);
+  if (n <= h->size)
+    return p;
+  if (h->cls == large) {
+    h = static_cast<header*>(realloc(h, sizeof(header) + n));
+    if (!h)
+      return nullptr;
+    h->size = n;
+    return h + 1;
+  }
+  void* res = allocate(n);
+  if (!res)
+    return nullptr;
+  memcpy(res, p, h->size);
+  deallocate(p);
+  return res;
+}
+
+size_t session_arena::reserved() const {
+  return chunks.size() * chunk_size;
+}
+
+void* session_arena::ssh2_alloc(size_t n, void** abstract) {
+  auto a = static_cast<session_arena*>(*abstract);
+  void* p = a->allocate(n);
+  if (!a->session)
+    a->session = p;
+  return p;
+}
+
+void session_arena::ssh2_free(void* p, void** abstract) {
+  auto a = static_cast<session_arena*>(*abstract);
+  a->deallocate(p);
+  // Freeing the session is the last thing libssh2_session_free does
+  if (p && p == a->session)
+    delete a;
+}
+
+void* session_arena::ssh2_realloc(void* p, size_t n, void** abstract) {
+  return static_cast<session_arena*>(*abstract)->reallocate(p, n);
+}
+
+LIBSSH2_SESSION* session_arena::init_session() {
+  auto a = new session_arena;
+  // A failing libssh2_session_init_ex may have freed the session, and
+  // the arena with it
+  bool gone = false;
+  a->destroyed = &gone;
+  LIBSSH2_SESSION* session =
+    libssh2_session_init_ex(ssh2_alloc, ssh2_free, ssh2_realloc, a);
+  if (session)
+    a->destroyed = nullptr;
+  else if (!gone)
+    delete a;
+  return session;
+}
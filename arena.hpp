@@ -0,0 +1,58 @@
+#if !defined TEST_ARENA_HPP_INCLUDED
+#define TEST_ARENA_HPP_INCLUDED
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include <libssh2.h>
+
+class ssh2_transport;
+
+// Allocator of one libssh2 session. Small blocks come from size-class
+// free lists, carved out of chunks taken from a per-thread cache; the
+// chunks go back there in bulk when the arena is destroyed, whatever was
+// left allocated. Large blocks go to malloc. A session is used by one
+// thread at a time, so there is no locking.
+class session_arena {
+public:
+  session_arena() = default;
+  session_arena(const session_arena&) = delete;
+  ~session_arena();
+
+  void* allocate(size_t n);
+  void deallocate(void* p);
+  void* reallocate(void* p, size_t n);
+  // Bytes held in chunks
+  size_t reserved() const;
+
+  // New session whose allocations all go to an arena of its own, which
+  // is destroyed by libssh2_session_free; nullptr on failure
+  static LIBSSH2_SESSION* init_session();
+  // Arena of a session made by init_session
+  static session_arena& of(LIBSSH2_SESSION* session) {
+    return **reinterpret_cast<session_arena**>(
+      libssh2_session_abstract(session));
+  }
+
+  // Socket I/O of the session (see transport.hpp), closed with the arena:
+  // libssh2 callbacks reach it through the session abstract pointer
+  std::shared_ptr<ssh2_transport> transport;
+
+private:
+  // Blocks of 32 << i bytes, header included
+  static const size_t classes = 8;
+  void* free_lists[classes] = {};
+  std::vector<void*> chunks;
+  char* next = nullptr;
+  size_t left = 0;
+  // The session itself: libssh2 frees it last
+  void* session = nullptr;
+  // Set when destroyed, while init_session waits for libssh2
+  bool* destroyed = nullptr;
+
+  static void* ssh2_alloc(size_t n, void** abstract);
+  static void ssh2_free(void* p, void** abstract);
+  static void* ssh2_realloc(void* p, size_t n, void** abstract);
+};
+
+#endif// TEST_ARENA_HPP_INCLUDED
@@ -0,0 +1,151 @@
+#include <algorithm>
+#include <cstring>
+
+#include "auth.hpp"
+#include "ssh_async.hpp"
+#include "test.hpp"
+
+#include "log.hpp"
+
+namespace {
+
+std::string remote_key(const remote_t& r) {
+  return r.username + '@' + r.host + ':' + r.port;
+}
+
+key_id pub_id(const identity& id) {
+  return key_digest({ id.key.pub() });
+}
+
+// The connection is gone: no point in trying other keys
+bool fatal(int rc) {
+  switch (rc) {
+    case LIBSSH2_ERROR_SOCKET_NONE:
+    case LIBSSH2_ERROR_SOCKET_SEND:
+    case LIBSSH2_ERROR_SOCKET_RECV:
+    case LIBSSH2_ERROR_SOCKET_DISCONNECT:
+    case LIBSSH2_ERROR_SOCKET_TIMEOUT:
+    case LIBSSH2_ERROR_TIMEOUT:
+      return true;
+    default:
+      break;
+  }
+  return false;
+}
+
+// Whether the comma-separated list has method
+bool has_method(const char* list, const char* method) {
+  size_t n = strlen(method);
+  for (const char* p = list; p && *p;) {
+    const char* end = strchr(p, ',');
+    size_t len = end ? size_t(end - p) : strlen(p);
+    if (len == n && !strncmp(p, method, n))
+      return true;
+    p = end ? end + 1 : nullptr;
+  }
+  return false;
+}
+
+}
+
+identity_memory::identity_memory() : identity_memory(options{}) {}
+
+identity_memory::identity_memory(const options& o)
+  : opts(o), entries(o.capacity) {}
+
+std::vector<size_t> identity_memory::order(const remote_t& r,
+                                           const std::vector<identity>& ids) {
+  std::vector<size_t> res(ids.size());
+  for (size_t i = 0; i < ids.size(); ++i)
+    res[i] = i;
+  std::string key = remote_key(r);
+  key_id pub;
+  {
+    std::lock_guard _lock(m);
+    const key_id* p = entries.get(key);
+    if (!p)
+      return res;
+    pub = *p;
+  }
+  auto winner = std::find_if(res.begin(), res.end(), [&](size_t i) {
+    return pub_id(ids[i]) == pub; });
+  if (winner != res.end())
+    std::rotate(res.begin(), winner, winner + 1);
+  return res;
+}
+
+void identity_memory::remember(const remote_t& r, const identity& id) {
+  std::string key = remote_key(r);
+  key_id pub = pub_id(id);
+  std::lock_guard _lock(m);
+  entries.put(key, pub);
+}
+
+void identity_memory::forget(const remote_t& r) {
+  std::string key = remote_key(r);
+  std::lock_guard _lock(m);
+  entries.erase(key);
+}
+
+void identity_memory::clear() {
+  std::lock_guard _lock(m);
+  entries.clear();
+}
+
+size_t identity_memory::size() const {
+  std::lock_guard _lock(m);
+  return entries.size();
+}
+
+identity_memory& identity_memory::global() {
+  static identity_memory mem;
+  return mem;
+}
+
+auth_outcome auth_identities(LIBSSH2_SESSION *session,
+                             boost::asio::ip::tcp::socket& s,
+                             const remote_t& r,
+                             const std::vector<identity>& ids,
+                             identity_memory& mem) {
+  auth_outcome res{ LIBSSH2_ERROR_AUTHENTICATION_FAILED, ids.size(), 0 };
+  // All the attempts share the authentication time limit
+  session_deadline d(r.timeouts);
+  auto _timer = d.arm(s, r.timeouts.auth);
+  // Sends a "none" request: the server answers with the methods it takes
+  char* methods;
+  while (!(methods = libssh2_userauth_list(session, r.username.data(),
+                                           unsigned(r.username.size()))) &&
+         libssh2_session_last_errno(session) == LIBSSH2_ERROR_EAGAIN)
+    ssh2_wait(session, s);
+  ++res.attempts;
+  if (!methods) {
+    if (libssh2_userauth_authenticated(session)) {
+      LOG(debug) << "Server accepted no authentication for " << r.username;
+      res.rc = 0;
+    } else {
+      res.rc = d.result(libssh2_session_last_errno(session));
+    }
+    return res;
+  }
+  LOG(debug) << "Authentication methods for " << r.username << ": "
+             << methods;
+  if (!has_method(methods, "publickey")) {
+    res.rc = LIBSSH2_ERROR_METHOD_NOT_SUPPORTED;
+    return res;
+  }
+  for (size_t i : mem.order(r, ids)) {
+    ++res.attempts;
+    res.rc = d.result(auth_pukey_mem(session, s, r.username, ids[i].key,
+                                     ids[i].keypass));
+    if (!res.rc) {
+      res.identity = i;
+      mem.remember(r, ids[i]);
+      return res;
+    }
+    // What worked before may still work, once connected again
+    if (fatal(res.rc))
+      return res;
+  }
+  mem.forget(r);
+  return res;
+}
@@ -0,0 +1,72 @@
+#if !defined TEST_AUTH_HPP_INCLUDED
+#define TEST_AUTH_HPP_INCLUDED
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+
+#include "key.hpp"
+#include "lru.hpp"
+#include "ssh.hpp"
+
+// A key to authenticate with, and its passphrase if encrypted
+struct identity {
+  key_pair key;
+  const char* keypass = nullptr;
+};
+
+// Which identity last got in, per user@host:port, so that the next
+// connection tries it first
+class identity_memory {
+public:
+  struct options {
+    // user@host:port entries kept at most
+    size_t capacity = 4096;
+  };
+
+  identity_memory();
+  explicit identity_memory(const options& opts);
+
+  // Indexes of ids, the one that last worked for r first, the others in
+  // their given order
+  std::vector<size_t> order(const remote_t& r,
+                            const std::vector<identity>& ids);
+  // id worked for r
+  void remember(const remote_t& r, const identity& id);
+  // Nothing worked for r
+  void forget(const remote_t& r);
+
+  void clear();
+  size_t size() const;
+
+  // Memory shared by connections
+  static identity_memory& global();
+
+private:
+  options opts;
+  mutable std::mutex m;
+  // digest of the public key by remote
+  lru_cache<std::string, key_id> entries;
+};
+
+struct auth_outcome {
+  // 0 once an identity is accepted, otherwise the last failure
+  int rc;
+  // index of the accepted identity, ids.size() if none
+  size_t identity;
+  // authentication requests sent
+  size_t attempts;
+};
+
+// Authenticate r.username on a connected session, trying ids one after
+// the other until one is accepted. Public key authentication is not
+// attempted if the server does not offer it, and the identity that
+// worked last time for r (according to mem) is tried first.
+auth_outcome auth_identities(LIBSSH2_SESSION *session,
+                             boost::asio::ip::tcp::socket& s,
+                             const remote_t& r,
+                             const std::vector<identity>& ids,
+                             identity_memory& mem = identity_memory::global());
+
+#endif// TEST_AUTH_HPP_INCLUDED
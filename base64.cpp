@@ -0,0 +1,298 @@
+#include <atomic>
+#include <cstdint>
+
+#include "base64.hpp"
+
+#if (defined __x86_64__ || defined __i386__) && defined __GNUC__
+#define BASE64_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+const char alphabet[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+const signed char decode_table[256] = {
+#define X -1
+  X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X, X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,
+  X,X,X,X,X,X,X,X,X,X,X,62,X,X,X,63, 52,53,54,55,56,57,58,59,60,61,X,X,X,X,X,X,
+  X,0,1,2,3,4,5,6,7,8,9,10,11,12,13,14, 15,16,17,18,19,20,21,22,23,24,25,X,X,X,X,X,
+  X,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40,
+  41,42,43,44,45,46,47,48,49,50,51,X,X,X,X,X,
+  X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X, X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,
+  X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X, X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,
+  X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X, X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,
+  X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X, X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,
+#undef X
+};
+
+// Each vector loop handles whole blocks and leaves the tail to these
+
+char* encode_scalar(const uint8_t* in, size_t len, char* out) {
+  for (; len >= 3; in += 3, len -= 3) {
+    uint32_t v = (in[0] << 16) | (in[1] << 8) | in[2];
+    *out++ = alphabet[v >> 18];
+    *out++ = alphabet[(v >> 12) & 63];
+    *out++ = alphabet[(v >> 6) & 63];
+    *out++ = alphabet[v & 63];
+  }
+  if (len) {
+    uint32_t v = (in[0] << 16) | (len > 1 ? in[1] << 8 : 0);
+    *out++ = alphabet[v >> 18];
+    *out++ = alphabet[(v >> 12) & 63];
+    *out++ = len > 1 ? alphabet[(v >> 6) & 63] : '=';
+    *out++ = '=';
+  }
+  return out;
+}
+
+// in holds no padding
+bool decode_scalar(const char* in, size_t len, uint8_t*& out) {
+  uint32_t acc = 0;
+  int bits = 0;
+  for (size_t i = 0; i < len; ++i) {
+    int v = decode_table[static_cast<unsigned char>(in[i])];
+    if (v < 0)
+      return false;
+    acc = (acc << 6) | v;
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      *out++ = uint8_t(acc >> bits);
+    }
+  }
+  return true;
+}
+
+#if defined BASE64_X86
+
+// W. Muła and D. Lemire, "Faster Base64 Encoding and Decoding using AVX2
+// Instructions": 3 bytes are split into 4 6-bit indices with
+// multiplications, indices are turned into characters with a pshufb
+// offset table; decoding classifies characters by nibble to validate them.
+
+__attribute__((target("ssse3")))
+inline __m128i enc_reshuffle(__m128i in) {
+  in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                                         4, 5, 3, 4, 1, 2, 0, 1));
+  __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+  __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+  __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+  return _mm_or_si128(t1, t3);
+}
+
+__attribute__((target("ssse3")))
+inline __m128i enc_translate(__m128i idx) {
+  const __m128i offsets = _mm_setr_epi8(
+    'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+    '/' - 63, 'A', 0, 0);
+  __m128i r = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+  __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+  r = _mm_or_si128(r, _mm_and_si128(less, _mm_set1_epi8(13)));
+  return _mm_add_epi8(_mm_shuffle_epi8(offsets, r), idx);
+}
+
+// Characters to 6-bit values, or false if one is not base64
+__attribute__((target("ssse3")))
+inline bool dec_translate(__m128i& s) {
+  const __m128i lut_lo = _mm_setr_epi8(
+    0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+    0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+  const __m128i lut_hi = _mm_setr_epi8(
+    0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m128i lut_roll = _mm_setr_epi8(
+    0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i mask_2f = _mm_set1_epi8(0x2f);
+  __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(s, 4), mask_2f);
+  __m128i lo_nibbles = _mm_and_si128(s, mask_2f);
+  __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+  __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+  if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi),
+                                       _mm_setzero_si128())) != 0xffff)
+    return false;
+  __m128i eq_2f = _mm_cmpeq_epi8(s, mask_2f);
+  __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+  s = _mm_add_epi8(s, roll);
+  return true;
+}
+
+// 16 6-bit values to 12 bytes, in the low 12 bytes
+__attribute__((target("ssse3")))
+inline __m128i dec_pack(__m128i v) {
+  __m128i ab_bc = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+  __m128i abc = _mm_madd_epi16(ab_bc, _mm_set1_epi32(0x00011000));
+  return _mm_shuffle_epi8(abc, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                             14, 13, 12, -1, -1, -1, -1));
+}
+
+__attribute__((target("ssse3")))
+char* encode_ssse3(const uint8_t* in, size_t len, char* out) {
+  // Loads 16 bytes to use 12
+  for (; len >= 16; in += 12, len -= 12, out += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out),
+                     enc_translate(enc_reshuffle(v)));
+  }
+  return encode_scalar(in, len, out);
+}
+
+__attribute__((target("ssse3")))
+bool decode_ssse3(const char* in, size_t len, uint8_t*& out) {
+  // Stores 16 bytes for 12 decoded: the next 8 characters make room
+  for (; len >= 24; in += 16, len -= 16, out += 12) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+    if (!dec_translate(v))
+      return false;
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), dec_pack(v));
+  }
+  return decode_scalar(in, len, out);
+}
+
+// The AVX2 versions run the same steps on two 128-bit lanes
+
+__attribute__((target("avx2")))
+char* encode_avx2(const uint8_t* in, size_t len, char* out) {
+  const __m256i shuffle = _mm256_broadcastsi128_si256(
+    _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+  const __m256i offsets = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+    'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+    '/' - 63, 'A', 0, 0));
+  // Loads 28 bytes to use 24
+  for (; len >= 28; in += 24, len -= 24, out += 32) {
+    __m256i v = _mm256_inserti128_si256(
+      _mm256_castsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in))),
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 12)), 1);
+    v = _mm256_shuffle_epi8(v, shuffle);
+    __m256i t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+    __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    __m256i t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+    __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    __m256i idx = _mm256_or_si256(t1, t3);
+    __m256i r = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+    __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx);
+    r = _mm256_or_si256(r, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+    r = _mm256_add_epi8(_mm256_shuffle_epi8(offsets, r), idx);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), r);
+  }
+  return encode_ssse3(in, len, out);
+}
+
+__attribute__((target("avx2")))
+bool decode_avx2(const char* in, size_t len, uint8_t*& out) {
+  const __m256i lut_lo = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+    0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+    0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a));
+  const __m256i lut_hi = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+    0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10));
+  const __m256i lut_roll = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+    0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0));
+  const __m256i pack = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+  const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+  // Stores 32 bytes for 24 decoded: the next 11 characters make room
+  for (; len >= 43; in += 32, len -= 32, out += 24) {
+    __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+    __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(s, 4), mask_2f);
+    __m256i lo_nibbles = _mm256_and_si256(s, mask_2f);
+    __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+    __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+    if (!_mm256_testz_si256(lo, hi))
+      return false;
+    __m256i eq_2f = _mm256_cmpeq_epi8(s, mask_2f);
+    s = _mm256_add_epi8(s, _mm256_shuffle_epi8(
+                          lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles)));
+    __m256i ab_bc = _mm256_maddubs_epi16(s, _mm256_set1_epi32(0x01400140));
+    __m256i abc = _mm256_madd_epi16(ab_bc, _mm256_set1_epi32(0x00011000));
+    abc = _mm256_shuffle_epi8(abc, pack);
+    abc = _mm256_permutevar8x32_epi32(
+      abc, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), abc);
+  }
+  return decode_ssse3(in, len, out);
+}
+
+#endif
+
+using encoder = char* (*)(const uint8_t*, size_t, char*);
+using decoder = bool (*)(const char*, size_t, uint8_t*&);
+
+struct codec {
+  base64_isa isa;
+  encoder encode;
+  decoder decode;
+};
+
+const codec codecs[] = {
+  { base64_isa::scalar, encode_scalar, decode_scalar },
+#if defined BASE64_X86
+  { base64_isa::ssse3, encode_ssse3, decode_ssse3 },
+  { base64_isa::avx2, encode_avx2, decode_avx2 },
+#endif
+};
+
+bool supported(base64_isa isa) {
+#if defined BASE64_X86
+  // May run before the constructor initializing the CPU model
+  __builtin_cpu_init();
+#endif
+  switch (isa) {
+#if defined BASE64_X86
+    case base64_isa::avx2: return __builtin_cpu_supports("avx2");
+    case base64_isa::ssse3: return __builtin_cpu_supports("ssse3");
+#endif
+    case base64_isa::scalar: return true;
+    default: break;
+  }
+  return false;
+}
+
+const codec* pick(base64_isa isa) {
+  for (size_t i = sizeof(codecs) / sizeof(codecs[0]); i--;)
+    if (codecs[i].isa <= isa && supported(codecs[i].isa))
+      return &codecs[i];
+  return &codecs[0];
+}
+
+std::atomic<const codec*> current{ pick(base64_isa::avx2) };
+
+}
+
+base64_isa base64_select(base64_isa isa) {
+  const codec* c = pick(isa);
+  current.store(c, std::memory_order_relaxed);
+  return c->isa;
+}
+
+size_t base64_encode(const void* in, size_t len, char* out) {
+  const codec* c = current.load(std::memory_order_relaxed);
+  return c->encode(static_cast<const uint8_t*>(in), len, out) - out;
+}
+
+bool base64_decode(std::string_view in, char* out, size_t& outlen) {
+  size_t len = in.size();
+  while (len && in[len - 1] == '=')
+    --len;
+  if (len % 4 == 1 || in.size() - len > 2)
+    return false;
+  const codec* c = current.load(std::memory_order_relaxed);
+  uint8_t* o = reinterpret_cast<uint8_t*>(out);
+  if (!c->decode(in.data(), len, o))
+    return false;
+  outlen = o - reinterpret_cast<uint8_t*>(out);
+  return true;
+}
+
+bool base64_decode(std::string_view in, std::string& out) {
+  out.resize(base64_decoded_max(in.size()));
+  size_t len = 0;
+  bool ok = base64_decode(in, &out[0], len);
+  out.resize(ok ? len : 0);
+  return ok;
+}
@@ -0,0 +1,28 @@
+#if !defined TEST_BASE64_HPP_INCLUDED
+#define TEST_BASE64_HPP_INCLUDED
+
+#include <string>
+#include <string_view>
+
+// Characters needed to encode n bytes, padding included
+constexpr size_t base64_encoded_size(size_t n) { return (n + 2) / 3 * 4; }
+// Bytes decoded from n characters, at most
+constexpr size_t base64_decoded_max(size_t n) { return (n + 3) / 4 * 3; }
+
+// Encode len bytes from in into out, which must hold
+// base64_encoded_size(len) characters; returns the count written
+size_t base64_encode(const void* in, size_t len, char* out);
+
+// Decode base64 text (padding optional, no whitespace) into out, which
+// must hold base64_decoded_max(in.size()) bytes. Returns false on invalid
+// input, otherwise sets outlen to the count written.
+bool base64_decode(std::string_view in, char* out, size_t& outlen);
+// Decode base64 text into out, returns false on invalid input
+bool base64_decode(std::string_view in, std::string& out);
+
+// Implementations of the codec; the best one the CPU supports is used
+enum class base64_isa { scalar, ssse3, avx2 };
+// Use isa, or the best supported one below it; returns the one in use
+base64_isa base64_select(base64_isa isa);
+
+#endif// TEST_BASE64_HPP_INCLUDED
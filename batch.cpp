@@ -0,0 +1,120 @@
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <boost/algorithm/string/trim.hpp>
+
+#include "batch.hpp"
+#include "ssh_async.hpp"
+#include "test.hpp"
+#include "transport.hpp"
+
+#include "log.hpp"
+
+namespace {
+
+struct batch_state {
+  const std::vector<remote_t>& hosts;
+  const key_pair& key;
+  const char* keypass;
+  const std::function<void(const batch_result&)>& on_result;
+  boost::asio::io_context& io;
+  std::atomic<size_t> next{ 0 };
+  std::mutex report;
+
+  // Start authentication against the next pending host, if any
+  void launch() {
+    size_t i = next++;
+    if (i >= hosts.size())
+      return;
+    auto start = std::chrono::steady_clock::now();
+    async_test_pubkey(io, hosts[i], key, keypass,
+                      [this, i, start](int rc, std::exception_ptr e) {
+      batch_result res{ hosts[i], rc, {},
+                        std::chrono::duration_cast<std::chrono::microseconds>
+                        (std::chrono::steady_clock::now() - start) };
+      if (e) {
+        try {
+          std::rethrow_exception(e);
+        } catch (const std::exception& ex) {
+          res.error = ex.what();
+        }
+      }
+      {
+        std::lock_guard _lock(report);
+        on_result(res);
+      }
+      launch();
+    });
+  }
+};
+
+}
+
+void batch_test_pubkey(const std::vector<remote_t>& hosts,
+                       const key_pair& key, const char* keypass,
+                       const batch_options& opts,
+                       const std::function<void(const batch_result&)>&
+                       on_result) {
+  size_t threads = opts.threads ? opts.threads :
+    std::max(1u, std::thread::hardware_concurrency());
+  boost::asio::io_context io{ int(threads) };
+  batch_state state{ hosts, key, keypass, on_result, io };
+  for (size_t i = 0; i < std::max<size_t>(opts.concurrency, 1); ++i)
+    state.launch();
+
+  // Handshake and auth packets of all sessions ready at once go out
+  // together
+  std::vector<std::thread> pool;
+  for (size_t i = 1; i < threads; ++i)
+    pool.emplace_back([&io] { run_batched(io); });
+  run_batched(io);
+  for (auto& t : pool)
+    t.join();
+}
+
+std::vector<remote_t> read_hosts(std::istream& in, const remote_t& defaults) {
+  std::vector<remote_t> res;
+  std::string line;
+  while (std::getline(in, line)) {
+    line = line.substr(0, line.find('#'));
+    boost::algorithm::trim(line);
+    if (line.empty())
+      continue;
+    remote_t r(defaults);
+    // A port given after ':' is a number, not left for the resolver to
+    // reject
+    auto set_port = [&r, &line](std::string port) {
+      if (port.empty() || port.size() > 5 ||
+          !std::all_of(port.begin(), port.end(),
+                       [](char c) { return c >= '0' && c <= '9'; }) ||
+          std::stoul(port) > 65535)
+        THROW("Invalid port: " + line);
+      r.port = std::move(port);
+    };
+    auto at = line.rfind('@');
+    if (at != std::string::npos) {
+      r.username = line.substr(0, at);
+      line.erase(0, at + 1);
+      if (line.empty())
+        THROW("Invalid host: " + r.username + '@');
+    }
+    if (line.front() == '[') {
+      auto end = line.find(']');
+      if (end == std::string::npos)
+        THROW("Invalid host: " + line);
+      if (end + 1 < line.size() && line[end + 1] == ':')
+        set_port(line.substr(end + 2));
+      r.host = line.substr(1, end - 1);
+    } else if (std::count(line.begin(), line.end(), ':') == 1) {
+      auto colon = line.find(':');
+      set_port(line.substr(colon + 1));
+      r.host = line.substr(0, colon);
+    } else {
+      // hostname or bare IPv6 address
+      r.host = line;
+    }
+    res.push_back(std::move(r));
+  }
+  return res;
+}
@@ -0,0 +1,42 @@
+#if !defined TEST_BATCH_HPP_INCLUDED
+#define TEST_BATCH_HPP_INCLUDED
+
+#include <chrono>
+#include <functional>
+#include <istream>
+#include <string>
+#include <vector>
+
+#include "ssh.hpp"
+
+struct batch_result {
+  const remote_t& remote;
+  // authentication rc, meaningless if error is set
+  int rc;
+  // why the session could not be established, empty on success
+  std::string error;
+  std::chrono::microseconds latency;
+};
+
+struct batch_options {
+  // authentications in flight at once
+  size_t concurrency = 256;
+  // threads running the io_context, 0 for one per core
+  size_t threads = 0;
+};
+
+// Test public key authentication against every host, at most
+// opts.concurrency at a time. on_result is called as soon as each host is
+// done (never concurrently), in completion order.
+void batch_test_pubkey(const std::vector<remote_t>& hosts,
+                       const key_pair& key, const char* keypass,
+                       const batch_options& opts,
+                       const std::function<void(const batch_result&)>&
+                       on_result);
+
+// Read one "[user@]host[:port]" per line (IPv6 addresses in brackets when
+// a port is given). Blank lines and '#' comments are skipped; missing
+// fields are taken from defaults.
+std::vector<remote_t> read_hosts(std::istream& in, const remote_t& defaults);
+
+#endif// TEST_BATCH_HPP_INCLUDED
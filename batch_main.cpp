@@ -0,0 +1,83 @@
+// Check public key access over a list of hosts:
+//   BatchAuth [-c concurrency] [-j threads] [-u user] [-p port]
+//             pubkey_file privkey_file [hosts_file|-]
+// The key passphrase, if any, is read from KEY_PASS. One line is printed
+// per host as soon as it is done: host:port, rc, latency (ms), error.
+#include <fstream>
+#include <iostream>
+
+#include "batch.hpp"
+#include "log.hpp"
+
+static int usage(const char* argv0) {
+  std::cerr << "usage: " << argv0 << " [-c concurrency] [-j threads]"
+            << " [-u user] [-p port] [-t seconds] [-m profile]"
+            << " pubkey_file privkey_file"
+            << " [hosts_file|-]" << std::endl;
+  return 2;
+}
+
+int main(int argc, char** argv) {
+  log_set_level(getenv("TRACE") ? log_level::trace :
+                getenv("DEBUG") ? log_level::debug : log_level::warning);
+
+  batch_options opts;
+  remote_t defaults(nullptr, nullptr, getenv("USER"));
+  defaults.check_host = !getenv("NO_HOST_CHECK");
+  const char* profile = "auto";
+  std::vector<const char*> args;
+  try {
+    for (int i = 1; i < argc; ++i) {
+      std::string a = argv[i];
+      if (a.size() == 2 && a[0] == '-' && i + 1 < argc) {
+        switch (a[1]) {
+          case 'c': opts.concurrency = std::stoul(argv[++i]); continue;
+          case 'j': opts.threads = std::stoul(argv[++i]); continue;
+          case 'u': defaults.username = argv[++i]; continue;
+          case 'p': defaults.port = argv[++i]; continue;
+          case 't':
+            defaults.timeouts.total =
+              std::chrono::seconds(std::stoul(argv[++i]));
+            continue;
+          case 'm': profile = argv[++i]; continue;
+          default: return usage(argv[0]);
+        }
+      }
+      args.push_back(argv[i]);
+    }
+  } catch (const std::logic_error&) {
+    // Not a number
+    return usage(argv[0]);
+  }
+  if (args.size() < 2 || args.size() > 3)
+    return usage(argv[0]);
+
+  try {
+    defaults.methods = method_profile(profile);
+    auto key = key_pair::from_files(args[0], args[1]);
+    std::vector<remote_t> hosts;
+    if (args.size() == 3 && std::string(args[2]) != "-") {
+      std::ifstream in(args[2]);
+      if (!in)
+        throw std::runtime_error(std::string("Cannot read ") + args[2]);
+      hosts = read_hosts(in, defaults);
+    } else {
+      hosts = read_hosts(std::cin, defaults);
+    }
+
+    size_t failed = 0;
+    batch_test_pubkey(hosts, key, getenv("KEY_PASS"), opts,
+                      [&failed](const batch_result& res) {
+      if (!res.error.empty() || res.rc)
+        ++failed;
+      std::cout << res.remote.host << ':' << res.remote.port << '\t'
+                << (res.error.empty() ? known_retvals(res.rc) : "ERROR")
+                << '\t' << res.latency.count() / 1000.0 << '\t'
+                << res.error << std::endl;
+    });
+    return failed ? 1 : 0;
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 2;
+  }
+}
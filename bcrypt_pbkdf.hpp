@@ -0,0 +1,14 @@
+#if !defined TEST_BCRYPT_PBKDF_HPP_INCLUDED
+#define TEST_BCRYPT_PBKDF_HPP_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Derive keylen bytes from a passphrase, as OpenSSH does for "bcrypt"
+// protected private keys. Returns false on invalid parameters.
+bool bcrypt_pbkdf(const char* pass, size_t passlen, const uint8_t* salt,
+                  size_t saltlen, uint8_t* key, size_t keylen,
+                  unsigned rounds);
+
+#endif// TEST_BCRYPT_PBKDF_HPP_INCLUDED
@@ -0,0 +1,286 @@
+// Microbenchmarks of local hot paths. Run with BENCH_FILTER=substring to
+// select benchmarks and BENCH_SAMPLES=n to change the number of samples.
+// Reports mean ns/op, heap allocations/op and per-sample percentiles.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <vector>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include "key_store.hpp"
+#include "known_hosts.hpp"
+#include "lines.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "ssh.hpp"
+#include "utils.hpp"
+
+static std::atomic<size_t> allocations{ 0 };
+
+void* operator new(size_t n) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = malloc(n ? n : 1))
+    return p;
+  throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+namespace {
+
+template <typename T> void keep(T&& v) {
+  asm volatile("" : : "g"(&v) : "memory");
+}
+
+size_t samples() {
+  const char* s = getenv("BENCH_SAMPLES");
+  return s ? std::max(1, atoi(s)) : 20;
+}
+
+bool selected(const std::string& name) {
+  const char* f = getenv("BENCH_FILTER");
+  return !f || name.find(f) != std::string::npos;
+}
+
+// Time f: pick an iteration count so one sample lasts ~5ms, then report
+// statistics over samples() samples
+template <typename F> void bench(const std::string& name, F f) {
+  if (!selected(name))
+    return;
+  using clock = std::chrono::steady_clock;
+  auto run = [&f](size_t iters) {
+    auto start = clock::now();
+    for (size_t i = 0; i < iters; ++i)
+      f();
+    return std::chrono::duration<double, std::nano>(clock::now() - start)
+      .count();
+  };
+  // Warm up first: a cold first call must not skew the iteration count
+  run(1);
+  size_t iters = 1;
+  for (double t = run(1); t < 5e6 && iters < (1 << 24);
+       t = run(iters))
+    iters *= t < 5e5 ? 10 : 2;
+
+  std::vector<double> per_op;
+  size_t allocs = allocations.load();
+  double total = 0;
+  for (size_t s = 0; s < samples(); ++s) {
+    double t = run(iters);
+    total += t;
+    per_op.push_back(t / iters);
+  }
+  double ops = double(iters) * per_op.size();
+  double allocs_per_op = (allocations.load() - allocs) / ops;
+  std::sort(per_op.begin(), per_op.end());
+  auto pct = [&per_op](double p) {
+    return per_op[std::min(per_op.size() - 1, size_t(p * per_op.size()))];
+  };
+  std::cout << std::left << std::setw(40) << name << std::right
+            << std::fixed << std::setprecision(1)
+            << std::setw(14) << total / ops << " ns/op"
+            << std::setw(12) << std::setprecision(2) << allocs_per_op
+            << " allocs/op"
+            << "  p50 " << std::setprecision(1) << pct(0.5)
+            << "  p90 " << pct(0.9) << "  p99 " << pct(0.99) << std::endl;
+}
+
+std::string slurp(const std::string& fn) {
+  std::ifstream in(fn, std::ios::binary);
+  std::ostringstream buf;
+  buf << in.rdbuf();
+  return buf.str();
+}
+
+std::string key_b64(const std::string& pub) {
+  std::istringstream in(pub);
+  std::string type, b64;
+  in >> type >> b64;
+  return b64;
+}
+
+// known_hosts file of n keys, one in ten hashed, named host-<i>.example
+boost::filesystem::path make_known_hosts(size_t n, const std::string& pub) {
+  auto fn = boost::filesystem::temp_directory_path() /
+    boost::filesystem::unique_path("bench-kh-%%%%-%%%%");
+  std::ofstream out(fn.string());
+  std::string b64 = key_b64(pub);
+  for (size_t i = 0; i < n; ++i) {
+    std::string name = "host-" + std::to_string(i) + ".example";
+    if (i % 10) {
+      out << name << " ssh-ed25519 " << b64 << '\n';
+      continue;
+    }
+    unsigned char salt[20], md[EVP_MAX_MD_SIZE];
+    unsigned int mdlen;
+    for (size_t j = 0; j < sizeof(salt); ++j)
+      salt[j] = (unsigned char)(i * 31 + j);
+    HMAC(EVP_sha1(), salt, sizeof(salt),
+         reinterpret_cast<const unsigned char*>(name.data()), name.size(),
+         md, &mdlen);
+    out << "|1|" << base64dump(reinterpret_cast<char*>(salt), sizeof(salt))
+        << '|' << base64dump(reinterpret_cast<char*>(md), mdlen)
+        << " ssh-ed25519 " << b64 << '\n';
+  }
+  return fn;
+}
+
+}
+
+int main() {
+  log_set_level(log_level::warning);
+#if !defined __OPTIMIZE__
+  std::cerr << "warning: built without optimization, timings are not "
+               "representative (use CMAKE_BUILD_TYPE=Release)" << std::endl;
+#endif
+  const std::string keys = KEYS_DIR;
+  std::string ed_pub = slurp(keys + "/fake_ed.pub");
+  std::string ed_key = slurp(keys + "/fake_ed");
+  std::string rsa_pub = slurp(keys + "/fake_rsa.pub");
+  std::string rsa_key = slurp(keys + "/fake_rsa");
+  const char* keypass = "foobar";
+  std::string ed_blob;
+  base64_decode(key_b64(ed_pub), ed_blob);
+
+  std::string blob32(32, 'x'), blob512(512, 'y');
+  bench("base64dump 32B", [&] {
+    std::ostringstream out;
+    out << base64dump(blob32.data(), blob32.size());
+    keep(out);
+  });
+  bench("base64dump 512B", [&] {
+    std::ostringstream out;
+    out << base64dump(blob512.data(), blob512.size());
+    keep(out);
+  });
+  std::string b64_512(base64_encoded_size(blob512.size()), '\0');
+  base64_encode(blob512.data(), blob512.size(), &b64_512[0]);
+  std::string dec512(base64_decoded_max(b64_512.size()), '\0');
+  const std::pair<base64_isa, const char*> isas[] = {
+    { base64_isa::scalar, "scalar" }, { base64_isa::ssse3, "ssse3" },
+    { base64_isa::avx2, "avx2" } };
+  for (const auto& isa : isas) {
+    if (base64_select(isa.first) != isa.first)
+      continue;
+    bench(std::string("base64 encode 512B ") + isa.second, [&] {
+      keep(base64_encode(blob512.data(), blob512.size(), &b64_512[0]));
+    });
+    bench(std::string("base64 decode 512B ") + isa.second, [&] {
+      size_t len;
+      keep(base64_decode(b64_512, &dec512[0], len));
+    });
+  }
+  base64_select(base64_isa::avx2);
+
+  for (size_t n : { 1000, 10000, 100000 }) {
+    auto fn = make_known_hosts(n, ed_pub);
+    unlinkable _fn(fn.string());
+    std::string sz = std::to_string(n);
+    bench("known_hosts load " + sz, [&] {
+      known_hosts_db db;
+      keep(db.load(fn));
+    });
+    known_hosts_db db;
+    db.load(fn);
+    std::string plain = "host-" + std::to_string(n - 1) + ".example";
+    bench("known_hosts check plain " + sz, [&] {
+      keep(db.check(plain, 22, ed_blob.data(), ed_blob.size()));
+    });
+    bench("known_hosts check hashed (memoized) " + sz, [&] {
+      keep(db.check("host-0.example", 22, ed_blob.data(), ed_blob.size()));
+    });
+    if (n <= 10000) {
+      size_t i = 0;
+      bench("known_hosts check hashed (cold) " + sz, [&] {
+        std::string name = "cold-" + std::to_string(i++);
+        keep(db.check(name, 22, ed_blob.data(), ed_blob.size()));
+      });
+    }
+  }
+
+  bench("key_pair::from_files", [&] {
+    keep(key_pair::from_files(keys + "/fake_ed.pub", keys + "/fake_ed"));
+  });
+  auto ed = key_pair::borrow(ed_pub, ed_key);
+  bench("key_tmpfiles round-trip", [&] {
+    key_tmpfiles files(ed);
+    keep(files);
+  });
+  bench("cached_key_tmpfiles hit", [&] {
+    keep(cached_key_tmpfiles(ed));
+  });
+
+  log_set_level(log_level::info);
+  bench("LOG skipped at run time", [&] {
+    LOG(debug) << "fingerprint: " << base64dump(ed_blob);
+  });
+  // Formatting and queueing only: the sink writes into the void
+  std::streambuf* clog_buf = std::clog.rdbuf(nullptr);
+  bench("LOG enabled", [&] {
+    LOG(info) << "fingerprint: " << base64dump(ed_blob);
+  });
+  log_flush();
+  std::clog.rdbuf(clog_buf);
+  std::clog.clear();
+  log_set_level(log_level::warning);
+
+  // Command output as exec_commands streams it, 32 kiB per read
+  std::string output;
+  for (int i = 0; output.size() < 32768; ++i)
+    output += "line " + std::to_string(i) + std::string(i % 80, '.') + "\n";
+  output.resize(32768);
+  buffer_pool pool;
+  size_t line_count = 0;
+  line_reader reader(pool, [&](std::string_view l, bool) {
+    line_count += l.size() != 0;
+  });
+  bench("line_reader 32KiB", [&] {
+    size_t room;
+    char* buf = reader.space(room);
+    size_t n = std::min(room, output.size());
+    memcpy(buf, output.data(), n);
+    reader.commit(n);
+  });
+  keep(line_count);
+  std::string no_newline(4096, '.');
+  bench("find_newline 4KiB", [&] {
+    keep(find_newline(no_newline.data(), no_newline.size()));
+  });
+
+  bench("phase_timer", [] {
+    phase_timer t(phase::auth);
+  });
+
+  bench("make_session + free", [] {
+    LIBSSH2_SESSION* session = make_session();
+    libssh2_session_free(session);
+  });
+
+  bench("openssh key decrypt ed25519 (bcrypt)", [&] {
+    key_store store;
+    keep(store.unlock(ed_key, keypass));
+  });
+  bench("openssh key decrypt rsa (bcrypt)", [&] {
+    key_store store;
+    keep(store.unlock(rsa_key, keypass));
+  });
+  key_store store;
+  bench("key_store hit", [&] {
+    keep(store.unlock(ed_key, keypass));
+  });
+  // What auth_pukey_mem does with the key before calling libssh2
+  bench("unlocked_key, cached in store", [&] {
+    unlocked_key k(ed.priv(), keypass);
+    keep(k);
+  });
+  return 0;
+}
@@ -0,0 +1,178 @@
+#include <algorithm>
+#include <sys/socket.h>
+#include <libssh2.h>
+
+#include "deadline.hpp"
+
+#include "log.hpp"
+
+timer_wheel::timer& timer_wheel::timer::operator=(timer&& from) {
+  cancel();
+  std::swap(wheel, from.wheel);
+  std::swap(e, from.e);
+  return *this;
+}
+
+bool timer_wheel::timer::cancel() {
+  if (!e)
+    return true;
+  bool res = wheel->cancel(e);
+  e.reset();
+  return res;
+}
+
+timer_wheel::timer_wheel() : timer_wheel(options{}) {}
+
+timer_wheel::timer_wheel(const options& o)
+  : opts(o), slots(std::max<size_t>(o.slots, 1)) {
+  if (opts.tick.count() <= 0)
+    opts.tick = std::chrono::milliseconds(1);
+  th = std::thread([this] { run(); });
+}
+
+timer_wheel::~timer_wheel() {
+  {
+    std::lock_guard _lock(m);
+    stop = true;
+  }
+  cv.notify_one();
+  th.join();
+}
+
+timer_wheel::timer timer_wheel::schedule(clock_type::time_point when,
+                                         std::function<void()> cb) {
+  timer t;
+  if (when == clock_type::time_point::max())
+    return t;
+  auto e = std::make_shared<entry>();
+  e->cb = std::move(cb);
+  // Rounded up: never early
+  auto since = std::max(when - epoch, clock_type::duration::zero());
+  e->tick = uint64_t((since + opts.tick - clock_type::duration(1)) /
+                     opts.tick);
+  bool wake;
+  {
+    std::lock_guard _lock(m);
+    // Ticks slept through had nothing to fire
+    if (!count)
+      current = std::max(current, uint64_t((clock_type::now() - epoch) /
+                                           opts.tick));
+    e->tick = std::max(e->tick, current);
+    e->slot = e->tick % slots.size();
+    slots[e->slot].push_front(e);
+    e->pos = slots[e->slot].begin();
+    // The thread sleeps without timeout while there is nothing to do
+    wake = !count++;
+  }
+  if (wake)
+    cv.notify_one();
+  t.wheel = this;
+  t.e = std::move(e);
+  return t;
+}
+
+bool timer_wheel::cancel(const std::shared_ptr<entry>& e) {
+  std::unique_lock lock(m);
+  switch (e->st) {
+    case entry::state::pending:
+      slots[e->slot].erase(e->pos);
+      e->st = entry::state::cancelled;
+      --count;
+      return true;
+    case entry::state::firing:
+      if (std::this_thread::get_id() != th.get_id())
+        fired_cv.wait(lock, [&e] { return e->st == entry::state::fired; });
+      return false;
+    default:
+      break;
+  }
+  return false;
+}
+
+size_t timer_wheel::pending() const {
+  std::lock_guard _lock(m);
+  return count;
+}
+
+void timer_wheel::run() {
+  std::unique_lock lock(m);
+  std::vector<std::shared_ptr<entry>> due;
+  while (!stop) {
+    if (!count) {
+      cv.wait(lock);
+      continue;
+    }
+    uint64_t now = uint64_t((clock_type::now() - epoch) / opts.tick);
+    if (now >= current) {
+      // Every slot at most once, even after a long sleep
+      uint64_t n = std::min<uint64_t>(now + 1 - current, slots.size());
+      for (uint64_t t = now + 1 - n; t <= now; ++t) {
+        slot_t& slot = slots[t % slots.size()];
+        for (auto it = slot.begin(); it != slot.end();) {
+          if ((*it)->tick > now) {
+            ++it;
+            continue;
+          }
+          (*it)->st = entry::state::firing;
+          due.push_back(std::move(*it));
+          it = slot.erase(it);
+          --count;
+        }
+      }
+      current = now + 1;
+    }
+    if (!due.empty()) {
+      lock.unlock();
+      for (auto& e : due) {
+        try {
+          e->cb();
+        } catch (const std::exception& ex) {
+          LOG(warning) << "Timer callback failed: " << ex.what();
+        }
+      }
+      lock.lock();
+      for (auto& e : due) {
+        e->st = entry::state::fired;
+        e->cb = nullptr;
+      }
+      due.clear();
+      fired_cv.notify_all();
+      continue;
+    }
+    cv.wait_until(lock, epoch + opts.tick * current);
+  }
+}
+
+timer_wheel& timer_wheel::global() {
+  static timer_wheel wheel;
+  return wheel;
+}
+
+session_deadline::session_deadline(const ssh_timeouts& t_, timer_wheel& w)
+  : t(t_), wheel(w),
+    end(t.total.count() ? timer_wheel::clock_type::now() + t.total :
+        timer_wheel::clock_type::time_point::max()),
+    fired(std::make_shared<std::atomic<bool>>(false)) {}
+
+timer_wheel::clock_type::time_point
+session_deadline::phase_end(std::chrono::milliseconds limit) const {
+  if (!limit.count())
+    return end;
+  return std::min(end, timer_wheel::clock_type::now() + limit);
+}
+
+timer_wheel::timer session_deadline::arm(boost::asio::ip::tcp::socket& s,
+                                         std::chrono::milliseconds limit) {
+  // The socket stays open while the timer lives: its descriptor is safe to
+  // use from the wheel thread
+  int fd = s.native_handle();
+  return wheel.schedule(phase_end(limit), [fd, fired = fired] {
+    LOG(debug) << "Time limit reached, shutting socket " << fd << " down";
+    fired->store(true);
+    ::shutdown(fd, SHUT_RDWR);
+  });
+}
+
+int session_deadline::result(int rc) const {
+  return rc && expired() ? LIBSSH2_ERROR_SOCKET_TIMEOUT : rc;
+}
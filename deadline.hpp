@@ -0,0 +1,127 @@
+#if !defined TEST_DEADLINE_HPP_INCLUDED
+#define TEST_DEADLINE_HPP_INCLUDED
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+
+// Coarse timers for many sessions at once: a hashed timing wheel, advanced
+// by its own thread. Scheduling and cancelling are O(1). Callbacks run on
+// the wheel thread and must be quick: shut a socket down, post a handler.
+class timer_wheel {
+  struct entry;
+public:
+  using clock_type = std::chrono::steady_clock;
+  struct options {
+    // resolution of the timers
+    std::chrono::milliseconds tick{ 10 };
+    // one per tick, later timers wait for their round
+    size_t slots = 4096;
+  };
+
+  // A scheduled callback, cancelled with the instance
+  class timer {
+    friend class timer_wheel;
+    timer_wheel* wheel = nullptr;
+    std::shared_ptr<entry> e;
+  public:
+    timer() = default;
+    timer(timer&& from) { *this = std::move(from); }
+    timer& operator=(timer&& from);
+    ~timer() { cancel(); }
+    // Once this returns, the callback does not run or has run; false if it
+    // did. Safe from within the callback.
+    bool cancel();
+    // false once cancelled, or if nothing was scheduled
+    explicit operator bool() const { return bool(e); }
+  };
+
+  timer_wheel();
+  explicit timer_wheel(const options& opts);
+  timer_wheel(const timer_wheel&) = delete;
+  ~timer_wheel();
+
+  // Run cb at (or up to one tick after) when; never if when is
+  // time_point::max()
+  timer schedule(clock_type::time_point when, std::function<void()> cb);
+  // Timers scheduled and not fired nor cancelled yet
+  size_t pending() const;
+
+  // Wheel shared by sessions
+  static timer_wheel& global();
+
+private:
+  using slot_t = std::list<std::shared_ptr<entry>>;
+  struct entry {
+    enum class state { pending, firing, fired, cancelled };
+    uint64_t tick;
+    std::function<void()> cb;
+    state st = state::pending;
+    size_t slot;
+    slot_t::iterator pos;
+  };
+  void run();
+  bool cancel(const std::shared_ptr<entry>& e);
+
+  options opts;
+  clock_type::time_point epoch = clock_type::now();
+  // next tick to process
+  uint64_t current = 0;
+  std::vector<slot_t> slots;
+  size_t count = 0;
+  bool stop = false;
+  mutable std::mutex m;
+  // wakes the wheel thread, and cancellers waiting for a callback
+  std::condition_variable cv, fired_cv;
+  std::thread th;
+};
+
+// Time limits of one connection, each phase counted from its start. Zero
+// means no limit.
+struct ssh_timeouts {
+  std::chrono::milliseconds connect{ 10000 };
+  std::chrono::milliseconds handshake{ 20000 };
+  std::chrono::milliseconds auth{ 30000 };
+  // for the whole operation, phases included
+  std::chrono::milliseconds total{ 60000 };
+};
+
+// A time limit passed; reported as LIBSSH2_ERROR_SOCKET_TIMEOUT
+struct ssh_timeout : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+// Deadlines of one blocking connection: each phase gets its own limit, cut
+// down to what remains of the total. When a limit passes the socket is
+// shut down, so that waits return and libssh2 calls fail.
+class session_deadline {
+  ssh_timeouts t;
+  timer_wheel& wheel;
+  timer_wheel::clock_type::time_point end;
+  std::shared_ptr<std::atomic<bool>> fired;
+public:
+  explicit session_deadline(const ssh_timeouts& t,
+                            timer_wheel& w = timer_wheel::global());
+  const ssh_timeouts& timeouts() const { return t; }
+  // When a phase started now and limited to limit must end
+  timer_wheel::clock_type::time_point
+  phase_end(std::chrono::milliseconds limit) const;
+  // Shut s down at the end of a phase starting now, unless the timer is
+  // gone by then
+  timer_wheel::timer arm(boost::asio::ip::tcp::socket& s,
+                         std::chrono::milliseconds limit);
+  // A time limit passed
+  bool expired() const { return fired->load(); }
+  // rc, or LIBSSH2_ERROR_SOCKET_TIMEOUT if it failed because of a limit
+  int result(int rc) const;
+};
+
+#endif// TEST_DEADLINE_HPP_INCLUDED
@@ -0,0 +1,261 @@
+#include <algorithm>
+#include <memory>
+
+#include "exec.hpp"
+#include "ssh.hpp"
+#include "ssh_async.hpp"
+#include "test.hpp"
+
+#include "log.hpp"
+
+using clock_type = std::chrono::steady_clock;
+
+namespace {
+
+// One command on its own channel. step() does what can be done without
+// blocking: it returns LIBSSH2_ERROR_EAGAIN when waiting for the socket,
+// 0 otherwise, and throws on failure.
+struct exec_op {
+  enum class state { opening, starting, reading, closing, closed, done };
+
+  exec_result& r;
+  size_t index;
+  LIBSSH2_SESSION *session;
+  const exec_options& opts;
+  LIBSSH2_CHANNEL *channel = nullptr;
+  state st = state::opening;
+  clock_type::time_point start = clock_type::now();
+  // stdout and stderr, when streaming to opts.on_line
+  std::unique_ptr<line_reader> lines[2];
+  // a stream was left unread for want of a buffer
+  bool starved = false;
+
+  exec_op(exec_result& r_, size_t index_, LIBSSH2_SESSION *session_,
+          const exec_options& opts_, buffer_pool* buffers)
+    : r(r_), index(index_), session(session_), opts(opts_) {
+    if (opts.on_line)
+      for (int i = 0; i < 2; ++i)
+        lines[i] = std::make_unique<line_reader>(
+          *buffers, [this, i](std::string_view text, bool partial) {
+            opts.on_line(exec_line{ index, i, text, partial });
+          });
+  }
+
+  void keep(std::string& to, const char* buf, size_t n) {
+    size_t room = opts.max_output - std::min(opts.max_output, to.size());
+    if (n > room)
+      r.truncated = true;
+    to.append(buf, std::min(n, room));
+  }
+
+  // Output already received, or end of it, waiting in libssh2
+  bool pending() const {
+    return st == state::reading && !starved &&
+      (libssh2_poll_channel_read(channel, 0) ||
+       libssh2_poll_channel_read(channel, 1) ||
+       libssh2_channel_eof(channel));
+  }
+
+  void exit_info() {
+    r.exit_status = libssh2_channel_get_exit_status(channel);
+    char* sig = nullptr;
+    size_t siglen = 0;
+    if (!libssh2_channel_get_exit_signal(channel, &sig, &siglen, nullptr,
+                                         nullptr, nullptr, nullptr) && sig) {
+      r.exit_signal.assign(sig, siglen);
+      libssh2_free(session, sig);
+    }
+  }
+
+  // The reading state when streaming: output goes from libssh2 straight
+  // to the line buffers
+  int read_lines() {
+    starved = false;
+    for (int i = 0; i < 2; ++i) {
+      size_t room;
+      char* buf = lines[i]->space(room);
+      if (!buf && lines[1 - i]->buffered() &&
+          libssh2_poll_channel_read(channel, i)) {
+        // The other stream's line may wait for the server, which waits
+        // for this stream to be read: the window is shared. It lends its
+        // buffer, handing over what it has of the line.
+        lines[1 - i]->spill();
+        buf = lines[i]->space(room);
+      }
+      if (!buf) {
+        starved = true;
+        continue;
+      }
+      ssize_t n = libssh2_channel_read_ex(channel, i, buf, room);
+      lines[i]->commit(n > 0 ? n : 0);
+      if (n > 0)
+        return 0;
+      if (n < 0 && n != LIBSSH2_ERROR_EAGAIN)
+        THROW("Cannot read command output: " + ssh2_err(session));
+    }
+    // Not before the output of both streams was read
+    if (!libssh2_channel_eof(channel))
+      return LIBSSH2_ERROR_EAGAIN;
+    lines[0]->finish();
+    lines[1]->finish();
+    st = state::closing;
+    return 0;
+  }
+
+  int step(char* buf, size_t len) {
+    switch (st) {
+      case state::opening:
+        channel = libssh2_channel_open_ex(session, "session",
+                                          sizeof("session") - 1,
+                                          opts.window,
+                                          LIBSSH2_CHANNEL_PACKET_DEFAULT,
+                                          nullptr, 0);
+        if (channel) {
+          st = state::starting;
+          return 0;
+        }
+        if (libssh2_session_last_errno(session) == LIBSSH2_ERROR_EAGAIN)
+          return LIBSSH2_ERROR_EAGAIN;
+        THROW("Cannot open channel: " + ssh2_err(session));
+      case state::starting: {
+        int rc = libssh2_channel_exec(channel, r.command.c_str());
+        if (rc == LIBSSH2_ERROR_EAGAIN)
+          return rc;
+        if (rc)
+          THROW("Cannot run command: " + ssh2_err(session));
+        st = state::reading;
+        return 0;
+      }
+      case state::reading: {
+        if (lines[0])
+          return read_lines();
+        ssize_t out = libssh2_channel_read(channel, buf, len);
+        if (out > 0) {
+          keep(r.out, buf, out);
+          return 0;
+        }
+        ssize_t err = libssh2_channel_read_stderr(channel, buf, len);
+        if (err > 0) {
+          keep(r.err, buf, err);
+          return 0;
+        }
+        if ((out < 0 && out != LIBSSH2_ERROR_EAGAIN) ||
+            (err < 0 && err != LIBSSH2_ERROR_EAGAIN))
+          THROW("Cannot read command output: " + ssh2_err(session));
+        if (!libssh2_channel_eof(channel))
+          return LIBSSH2_ERROR_EAGAIN;
+        st = state::closing;
+        return 0;
+      }
+      case state::closing: {
+        int rc = libssh2_channel_close(channel);
+        if (rc == LIBSSH2_ERROR_EAGAIN)
+          return rc;
+        if (rc)
+          THROW("Cannot close channel: " + ssh2_err(session));
+        st = state::closed;
+        return 0;
+      }
+      case state::closed: {
+        // Exit status and signal come before the peer's close
+        int rc = libssh2_channel_wait_closed(channel);
+        if (rc == LIBSSH2_ERROR_EAGAIN)
+          return rc;
+        exit_info();
+        st = state::done;
+        return 0;
+      }
+      case state::done:
+        break;
+    }
+    return 0;
+  }
+};
+
+}
+
+std::vector<exec_result> exec_commands(LIBSSH2_SESSION *session,
+                                       boost::asio::ip::tcp::socket& s,
+                                       const std::vector<std::string>&
+                                       commands,
+                                       const exec_options& opts) {
+  std::vector<exec_result> results(commands.size());
+  std::shared_ptr<buffer_pool> buffers = opts.buffers;
+  if (opts.on_line && !buffers)
+    buffers = std::make_shared<buffer_pool>(
+      32768, 2 * std::max<size_t>(opts.max_channels, 1));
+  std::vector<std::unique_ptr<exec_op>> active;
+  // Read buffer shared by all channels, output is copied out of it
+  std::vector<char> buf(32768);
+  size_t next = 0, cur = 0, idle = 0;
+
+  auto finish = [&](size_t i) {
+    exec_op& op = *active[i];
+    op.r.elapsed = std::chrono::duration_cast<std::chrono::microseconds>
+      (clock_type::now() - op.start);
+    if (op.channel)
+      ssh2_retry(session, s, [&op] {
+        return libssh2_channel_free(op.channel);
+      });
+    active.erase(active.begin() + i);
+  };
+
+  for (;;) {
+    while (active.size() < std::max<size_t>(opts.max_channels, 1) &&
+           next < commands.size()) {
+      results[next].command = commands[next];
+      active.push_back(std::make_unique<exec_op>(results[next], next,
+                                                 session, opts,
+                                                 buffers.get()));
+      ++next;
+    }
+    if (active.empty())
+      break;
+    cur %= active.size();
+    exec_op& op = *active[cur];
+    int rc;
+    try {
+      rc = op.step(buf.data(), buf.size());
+    } catch (const std::exception& e) {
+      op.r.error = e.what();
+      finish(cur);
+      continue;
+    }
+    if (rc == LIBSSH2_ERROR_EAGAIN) {
+      // A channel being opened is tracked by the session, not by the
+      // channel: it must be resumed before anything else
+      if (op.st == exec_op::state::opening) {
+        ssh2_wait(session, s);
+        continue;
+      }
+      ++cur;
+      // Sleep once every channel is waiting, unless reading for one of
+      // them pulled in data for another
+      if (++idle >= active.size()) {
+        idle = 0;
+        if (std::none_of(active.begin(), active.end(),
+                         [](const auto& a) { return a->pending(); })) {
+          // Output held up for want of a buffer is read once another
+          // exec_commands call sharing the pool puts one back; the
+          // socket may stay silent until then
+          if (std::any_of(active.begin(), active.end(),
+                          [](const auto& a) { return a->starved; }))
+            buffers->wait(std::chrono::milliseconds(10));
+          else
+            ssh2_wait(session, s);
+        }
+      }
+      continue;
+    }
+    idle = 0;
+    if (op.st == exec_op::state::done) {
+      LOG(debug) << "Command exited with " << op.r.exit_status << ": "
+                 << op.r.command;
+      finish(cur);
+      continue;
+    }
+    // Round-robin, so that a chatty command does not hold the others
+    ++cur;
+  }
+  return results;
+}
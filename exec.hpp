@@ -0,0 +1,70 @@
+#if !defined TEST_EXEC_HPP_INCLUDED
+#define TEST_EXEC_HPP_INCLUDED
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <libssh2.h>
+
+#include "lines.hpp"
+
+struct exec_result {
+  std::string command;
+  // output, unless streamed to exec_options::on_line
+  std::string out, err;
+  // output past exec_options::max_output was dropped
+  bool truncated = false;
+  int exit_status = -1;
+  // signal that killed the command, if any
+  std::string exit_signal;
+  // why the command could not be run, empty if it was
+  std::string error;
+  std::chrono::microseconds elapsed{ 0 };
+};
+
+// A line of output, handed to exec_options::on_line as it comes
+struct exec_line {
+  // index of the command
+  size_t command;
+  // 0 for stdout, 1 for stderr
+  int stream;
+  // without its '\n', valid during the call only
+  std::string_view text;
+  // a piece of a line longer than a buffer, or handed over early when
+  // the other stream needed its buffer; continued in a later call
+  bool partial;
+};
+
+struct exec_options {
+  // channels open at once; sshd allows 10 per connection by default
+  // (MaxSessions)
+  size_t max_channels = 8;
+  // bytes kept per command, for stdout and for stderr
+  size_t max_output = 1 << 20;
+  // SSH window of each channel: output the server sends ahead of what was
+  // read, and libssh2 buffers
+  unsigned window = LIBSSH2_CHANNEL_WINDOW_DEFAULT;
+  // When set, output is not kept in exec_result but handed to on_line
+  // line by line. Nothing is read while on_line runs, nor for a command
+  // needing a buffer while buffers has none to spare: its window fills up
+  // and the server stops sending, so memory stays bounded whatever the
+  // output size. An exception from on_line fails the command.
+  std::function<void(const exec_line&)> on_line;
+  // Buffers of on_line, which exec_commands calls may share to bound
+  // their memory together; by default, 2 * max_channels of 32 kiB
+  std::shared_ptr<buffer_pool> buffers;
+};
+
+// Run commands over one authenticated session, each on its own channel,
+// at most opts.max_channels at a time. Results are in command order.
+std::vector<exec_result> exec_commands(LIBSSH2_SESSION *session,
+                                       boost::asio::ip::tcp::socket& s,
+                                       const std::vector<std::string>&
+                                       commands,
+                                       const exec_options& opts =
+                                       exec_options());
+
+#endif// TEST_EXEC_HPP_INCLUDED
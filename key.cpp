@@ -0,0 +1,43 @@
+#include <openssl/evp.h>
+
+#include "key.hpp"
+#include "test.hpp"
+#include "utils.hpp"
+
+#include "log.hpp"
+
+key_id key_digest(std::initializer_list<std::string_view> parts) {
+  key_id md;
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  if (!ctx)
+    THROW("Cannot allocate digest context");
+  auto_del<EVP_MD_CTX, void, EVP_MD_CTX_free> _ctx(ctx);
+  EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+  for (auto p : parts) {
+    EVP_DigestUpdate(ctx, p.data(), p.size());
+    EVP_DigestUpdate(ctx, "", 1);
+  }
+  EVP_DigestFinal_ex(ctx, md.data(), nullptr);
+  return md;
+}
+
+key_pair::key_pair(std::string_view pub, std::string_view priv) {
+  // One buffer for both halves
+  auto buf = std::make_shared<std::string>();
+  buf->reserve(pub.size() + priv.size());
+  buf->append(pub).append(priv);
+  pub_ = std::string_view(buf->data(), pub.size());
+  priv_ = std::string_view(buf->data() + pub.size(), priv.size());
+  owner = std::move(buf);
+}
+
+key_pair key_pair::from_files(const boost::filesystem::path& pub,
+                              const boost::filesystem::path& priv) {
+  auto maps = std::make_shared<std::pair<mapped_file, mapped_file>>(pub,
+                                                                   priv);
+  if (maps->first.view().empty() || maps->second.view().empty())
+    THROW("Empty key file " + (maps->first.view().empty() ? pub : priv)
+          .string());
+  LOG(debug) << "Mapped key files " << pub << " & " << priv;
+  return key_pair(maps->first.view(), maps->second.view(), maps);
+}
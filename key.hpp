@@ -0,0 +1,52 @@
+#if !defined TEST_KEY_HPP_INCLUDED
+#define TEST_KEY_HPP_INCLUDED
+
+#include <array>
+#include <cstring>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <boost/filesystem.hpp>
+
+// SHA-256 of key material, used to key caches
+using key_id = std::array<unsigned char, 32>;
+// Digest of parts, each followed by a NUL separator
+key_id key_digest(std::initializer_list<std::string_view> parts);
+// Hash of a key_id for unordered containers: its bytes are uniform already
+struct key_id_hash {
+  size_t operator()(const key_id& id) const {
+    size_t h;
+    memcpy(&h, id.data(), sizeof(h));
+    return h;
+  }
+};
+
+// Public and private key text of one identity. The bytes are owned once
+// (or borrowed) and copies of the handle only share them, so a key_pair
+// is passed down to libssh2 without copying key data.
+class key_pair {
+  std::string_view pub_, priv_;
+  // keeps pub_ and priv_ alive, null when borrowed
+  std::shared_ptr<const void> owner;
+  key_pair(std::string_view pub, std::string_view priv,
+           std::shared_ptr<const void> o)
+    : pub_(pub), priv_(priv), owner(std::move(o)) {}
+public:
+  // Copies pub and priv, once
+  key_pair(std::string_view pub, std::string_view priv);
+  // Maps both files in memory; throws if they cannot be read
+  static key_pair from_files(const boost::filesystem::path& pub,
+                             const boost::filesystem::path& priv);
+  // Refers to pub and priv, which must outlive the key_pair and its copies
+  static key_pair borrow(std::string_view pub, std::string_view priv) {
+    return key_pair(pub, priv, nullptr);
+  }
+
+  std::string_view pub() const { return pub_; }
+  std::string_view priv() const { return priv_; }
+  // Digest of the pair, computed on each call
+  key_id id() const { return key_digest({ pub_, priv_ }); }
+};
+
+#endif// TEST_KEY_HPP_INCLUDED
@@ -0,0 +1,89 @@
+#if !defined TEST_KEY_STORE_HPP_INCLUDED
+#define TEST_KEY_STORE_HPP_INCLUDED
+
+#include <chrono>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "key.hpp"
+#include "lru.hpp"
+
+// Memory locked in RAM (when allowed) and wiped when freed, for key
+// material
+class secure_buffer {
+  char* buf = nullptr;
+  size_t len = 0;
+public:
+  explicit secure_buffer(size_t n);
+  secure_buffer(const secure_buffer&) = delete;
+  ~secure_buffer();
+  char* data() { return buf; }
+  const char* data() const { return buf; }
+  size_t size() const { return len; }
+  // Drop the tail, which is wiped
+  void shrink(size_t n);
+  std::string_view view() const { return std::string_view(buf, len); }
+};
+
+// Passphrase-protected OpenSSH private keys, decrypted once (bcrypt KDF is
+// meant to be slow) and kept unencrypted in secure memory for a while.
+class key_store {
+public:
+  struct options {
+    // how long a decrypted key is kept after being decrypted
+    std::chrono::seconds ttl{ 600 };
+    // decrypted keys kept at most, and as many wrong passphrases
+    size_t capacity = 64;
+    // how long a passphrase found wrong for a key is remembered
+    std::chrono::seconds reject_ttl{ 30 };
+  };
+
+  key_store();
+  explicit key_store(const options& opts);
+
+  // Unencrypted OpenSSH form of keydata, or nullptr if keydata is not an
+  // encrypted OpenSSH key, uses an unsupported cipher or keypass is wrong,
+  // the last case being told by wrong_pass. Concurrent unlocks of the same
+  // key and passphrase wait for one decryption.
+  std::shared_ptr<const secure_buffer> unlock(std::string_view keydata,
+                                              const char* keypass,
+                                              bool* wrong_pass = nullptr);
+  void clear();
+  size_t size() const;
+
+  // Store shared by authentications
+  static key_store& global();
+
+private:
+  struct outcome {
+    std::shared_ptr<const secure_buffer> key;
+    bool wrong_pass = false;
+  };
+  options opts;
+  mutable std::mutex m;
+  lru_cache<key_id, std::shared_ptr<const secure_buffer>, key_id_hash> keys;
+  // passphrases found wrong (no key then)
+  lru_cache<key_id, bool, key_id_hash> rejected;
+  // decryptions under way
+  std::unordered_map<key_id, std::shared_future<outcome>, key_id_hash>
+  pending;
+};
+
+// Private key and passphrase to hand to libssh2: the decrypted key from
+// key_store::global() when possible (no passphrase then), the given ones
+// otherwise
+struct unlocked_key {
+  std::shared_ptr<const secure_buffer> plain;
+  std::string_view data;
+  const char* pass;
+  // pass does not decrypt data: libssh2 would only fail after running the
+  // KDF again
+  bool wrong_pass = false;
+  unlocked_key(std::string_view keydata, const char* keypass);
+};
+
+#endif// TEST_KEY_STORE_HPP_INCLUDED
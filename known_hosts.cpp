@@ -0,0 +1,240 @@
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <libssh2.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include "known_hosts.hpp"
+#include "test.hpp"
+#include "utils.hpp"
+
+#include "log.hpp"
+
+using namespace boost::filesystem;
+
+// Key type name at the beginning of an SSH key blob
+static std::string blob_type(const char* blob, size_t len) {
+  if (len < 4)
+    return {};
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(blob);
+  size_t n = (size_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+  if (n > len - 4)
+    return {};
+  return std::string(blob + 4, n);
+}
+
+static std::string lower(std::string s) {
+  std::transform(s.begin(), s.end(), s.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return s;
+}
+
+// Host name as written in known_hosts files
+static std::string kh_name(const std::string& host, int port) {
+  if (port == 22)
+    return lower(host);
+  return "[" + lower(host) + "]:" + std::to_string(port);
+}
+
+// '*' and '?' glob matching, as used in known_hosts host patterns
+static bool glob_match(const char* pat, const char* s) {
+  for (; *pat; ++pat, ++s) {
+    if (*pat == '*') {
+      for (;; ++s) {
+        if (glob_match(pat + 1, s))
+          return true;
+        if (!*s)
+          return false;
+      }
+    }
+    if (!*s || (*pat != '?' && *pat != *s))
+      return false;
+  }
+  return !*s;
+}
+
+size_t known_hosts_db::load(const path& file) {
+  std::ifstream in(file.string());
+  if (!in)
+    return 0;
+  size_t loaded = 0;
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream fields(line);
+    std::string hosts, type, b64;
+    known_host_key key;
+    if (!(fields >> hosts) || hosts[0] == '#')
+      continue;
+    if (hosts[0] == '@') {
+      // @cert-authority lines are not host keys
+      if (hosts != "@revoked")
+        continue;
+      key.revoked = true;
+      fields >> hosts;
+    }
+    if (!(fields >> type >> b64) || !base64_decode(b64, key.blob))
+      continue;
+    key.type = blob_type(key.blob.data(), key.blob.size());
+    if (key.type.empty())
+      continue;
+
+    if (hosts.compare(0, 3, "|1|") == 0) {
+      // |1|base64(salt)|base64(HMAC-SHA1(salt, name))
+      std::string_view h(hosts);
+      auto sep = h.find('|', 3);
+      hashed_entry e;
+      if (sep == std::string::npos ||
+          !base64_decode(h.substr(3, sep - 3), e.salt) ||
+          !base64_decode(h.substr(sep + 1), e.hash))
+        continue;
+      e.key = std::move(key);
+      hashed.push_back(std::move(e));
+    } else {
+      std::vector<std::string> patterns;
+      bool wildcard = false;
+      std::istringstream names(hosts);
+      std::string name;
+      while (std::getline(names, name, ',')) {
+        name = lower(name);
+        wildcard |= name.find_first_of("*?!") != std::string::npos;
+        patterns.push_back(std::move(name));
+      }
+      if (wildcard) {
+        wildcards.push_back(pattern_entry{ std::move(patterns), key });
+      } else {
+        for (const auto& p : patterns)
+          plain[p].push_back(key);
+      }
+    }
+    ++loaded;
+  }
+  count += loaded;
+  {
+    // Names may match the new entries
+    std::lock_guard _lock(memo_m);
+    memo.clear();
+  }
+  LOG(trace) << "Read " << loaded << " keys from " << file;
+  return loaded;
+}
+
+known_hosts_db::key_list
+known_hosts_db::slow_matches(const std::string& name) const {
+  {
+    std::lock_guard _lock(memo_m);
+    if (const key_list* keys = memo.get(name))
+      return *keys;
+  }
+  key_list res;
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int mdlen;
+  for (const auto& e : hashed) {
+    HMAC(EVP_sha1(), e.salt.data(), int(e.salt.size()),
+         reinterpret_cast<const unsigned char*>(name.data()), name.size(),
+         md, &mdlen);
+    if (e.hash.size() == mdlen && !memcmp(e.hash.data(), md, mdlen))
+      res.push_back(&e.key);
+  }
+  for (const auto& e : wildcards) {
+    bool match = false, negated = false;
+    for (const auto& p : e.patterns) {
+      if (p[0] == '!')
+        negated |= glob_match(p.c_str() + 1, name.c_str());
+      else
+        match |= glob_match(p.c_str(), name.c_str());
+    }
+    if (match && !negated)
+      res.push_back(&e.key);
+  }
+  std::lock_guard _lock(memo_m);
+  memo.put(name, res);
+  return res;
+}
+
+int known_hosts_db::check(const std::string& host, int port, const char* key,
+                          size_t len) const {
+  std::string name = kh_name(host, port);
+  std::string type = blob_type(key, len);
+  bool match = false, mismatch = false, revoked = false;
+  auto consider = [&](const known_host_key& k) {
+    if (k.type != type)
+      return;
+    bool same = k.blob.size() == len && !memcmp(k.blob.data(), key, len);
+    if (k.revoked)
+      revoked |= same;
+    else
+      (same ? match : mismatch) = true;
+  };
+  auto it = plain.find(name);
+  if (it != plain.end())
+    for (const auto& k : it->second)
+      consider(k);
+  if (!hashed.empty() || !wildcards.empty())
+    for (const auto* k : slow_matches(name))
+      consider(*k);
+  if (revoked || (mismatch && !match))
+    return LIBSSH2_KNOWNHOST_CHECK_MISMATCH;
+  return match ? LIBSSH2_KNOWNHOST_CHECK_MATCH :
+    LIBSSH2_KNOWNHOST_CHECK_NOTFOUND;
+}
+
+std::chrono::milliseconds known_hosts_store::check_interval{ 1000 };
+
+namespace {
+
+std::vector<path> known_hosts_files() {
+  std::vector<path> files{ home() / ".ssh" / "known_hosts",
+                           home() / ".ssh" / "known_hosts2" };
+#if !defined _WIN32 && !defined _WIN64
+  files.emplace_back("/etc/ssh/ssh_known_hosts");
+  files.emplace_back("/etc/ssh/ssh_known_hosts2");
+#endif
+  return files;
+}
+
+// Modification time and size of each file, time is -1 if missing
+using file_stamp = std::pair<std::time_t, boost::uintmax_t>;
+std::vector<file_stamp> known_hosts_stamps(const std::vector<path>& files) {
+  std::vector<file_stamp> res;
+  for (const auto& f : files) {
+    boost::system::error_code ec;
+    std::time_t t = last_write_time(f, ec);
+    if (ec) {
+      res.emplace_back(-1, 0);
+      continue;
+    }
+    res.emplace_back(t, file_size(f, ec));
+  }
+  return res;
+}
+
+std::mutex store_m;
+std::shared_ptr<const known_hosts_db> store_db;
+std::vector<file_stamp> store_stamps;
+std::chrono::steady_clock::time_point store_checked;
+
+}
+
+std::shared_ptr<const known_hosts_db> known_hosts_store::get() {
+  std::lock_guard _lock(store_m);
+  auto now = std::chrono::steady_clock::now();
+  if (store_db && now - store_checked < check_interval)
+    return store_db;
+  store_checked = now;
+  auto files = known_hosts_files();
+  auto stamps = known_hosts_stamps(files);
+  if (store_db && stamps == store_stamps)
+    return store_db;
+  auto db = std::make_shared<known_hosts_db>();
+  for (size_t i = 0; i < files.size(); ++i)
+    if (stamps[i].first != -1)
+      db->load(files[i]);
+  LOG(debug) << "Loaded " << db->size() << " known host keys";
+  store_db = std::move(db);
+  store_stamps = std::move(stamps);
+  return store_db;
+}
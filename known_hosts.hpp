@@ -0,0 +1,72 @@
+#if !defined TEST_KNOWN_HOSTS_HPP_INCLUDED
+#define TEST_KNOWN_HOSTS_HPP_INCLUDED
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/filesystem.hpp>
+
+#include "lru.hpp"
+
+struct known_host_key {
+  // key type as found in the blob, e.g. "ssh-ed25519"
+  std::string type;
+  // raw key blob, as returned by libssh2_session_hostkey
+  std::string blob;
+  // @revoked marker
+  bool revoked = false;
+};
+
+// Parsed OpenSSH known_hosts files, indexed by host name. Read-only once
+// loaded, so an instance can be shared between threads.
+class known_hosts_db {
+public:
+  // Parse an OpenSSH known_hosts file, returns the number of keys read
+  size_t load(const boost::filesystem::path& file);
+
+  // Check a host key against the loaded entries. Returns one of
+  // LIBSSH2_KNOWNHOST_CHECK_MATCH, _MISMATCH or _NOTFOUND.
+  int check(const std::string& host, int port, const char* key,
+            size_t len) const;
+
+  size_t size() const { return count; }
+
+private:
+  struct hashed_entry {
+    std::string salt, hash;
+    known_host_key key;
+  };
+  struct pattern_entry {
+    std::vector<std::string> patterns;
+    known_host_key key;
+  };
+  using key_list = std::vector<const known_host_key*>;
+
+  // keys of hashed and wildcard entries matching name
+  key_list slow_matches(const std::string& name) const;
+
+  size_t count = 0;
+  std::unordered_map<std::string, std::vector<known_host_key>> plain;
+  std::vector<hashed_entry> hashed;
+  std::vector<pattern_entry> wildcards;
+  // slow_matches results, as hashed entries need one HMAC per entry;
+  // cleared when entries are added
+  static const size_t memo_capacity = 4096;
+  mutable std::mutex memo_m;
+  mutable lru_cache<std::string, key_list> memo{ memo_capacity };
+};
+
+// Process-wide known hosts: the user and system known_hosts files, parsed
+// once and reloaded only when one of them changes.
+class known_hosts_store {
+public:
+  // Current database; files are checked for changes at most once per
+  // check_interval
+  static std::shared_ptr<const known_hosts_db> get();
+  static std::chrono::milliseconds check_interval;
+};
+
+#endif// TEST_KNOWN_HOSTS_HPP_INCLUDED
@@ -0,0 +1,176 @@
+#include <cstring>
+
+#include "lines.hpp"
+#include "test.hpp"
+
+#include "log.hpp"
+
+#if (defined __x86_64__ || defined __i386__) && defined __GNUC__
+#define LINES_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+size_t find_scalar(const char* p, size_t n) {
+  const void* q = memchr(p, '\n', n);
+  return q ? static_cast<const char*>(q) - p : n;
+}
+
+#if defined LINES_X86
+
+__attribute__((target("sse2")))
+size_t find_sse2(const char* p, size_t n) {
+  const __m128i nl = _mm_set1_epi8('\n');
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+    if (unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)))
+      return i + __builtin_ctz(mask);
+  }
+  return i + find_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+size_t find_avx2(const char* p, size_t n) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+    if (unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl)))
+      return i + __builtin_ctz(mask);
+  }
+  return i + find_sse2(p + i, n - i);
+}
+
+#endif
+
+using finder = size_t (*)(const char*, size_t);
+
+finder pick() {
+#if defined LINES_X86
+  // May run before the constructor initializing the CPU model
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return find_avx2;
+  if (__builtin_cpu_supports("sse2"))
+    return find_sse2;
+#endif
+  return find_scalar;
+}
+
+const finder find = pick();
+
+}
+
+size_t find_newline(const char* p, size_t n) {
+  return find(p, n);
+}
+
+buffer_pool::buffer_pool(size_t buffer_size, size_t max_buffers)
+  : size(buffer_size), max(max_buffers) {
+  if (!size || !max)
+    THROW("Empty buffer pool");
+}
+
+buffer_pool::~buffer_pool() {
+  for (char* buf : free_list)
+    delete[] buf;
+}
+
+char* buffer_pool::get() {
+  std::lock_guard<std::mutex> l(m);
+  if (out == max)
+    return nullptr;
+  ++out;
+  if (free_list.empty())
+    return new char[size];
+  char* buf = free_list.back();
+  free_list.pop_back();
+  return buf;
+}
+
+void buffer_pool::put(char* buf) {
+  {
+    std::lock_guard<std::mutex> l(m);
+    free_list.push_back(buf);
+    --out;
+  }
+  cv.notify_one();
+}
+
+bool buffer_pool::wait(std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> l(m);
+  return cv.wait_for(l, timeout, [this] { return out < max; });
+}
+
+size_t buffer_pool::in_use() const {
+  std::lock_guard<std::mutex> l(m);
+  return out;
+}
+
+line_reader::line_reader(buffer_pool& pool_, line_handler f_)
+  : pool(pool_), f(std::move(f_)) {}
+
+line_reader::~line_reader() {
+  if (buf)
+    pool.put(buf);
+}
+
+char* line_reader::space(size_t& room) {
+  if (!buf && !(buf = pool.get()))
+    return nullptr;
+  room = pool.buffer_size() - end;
+  return buf + end;
+}
+
+void line_reader::commit(size_t n) {
+  if (!buf)
+    return;
+  // Only the new bytes can hold a '\n'
+  size_t from = end;
+  end += n;
+  for (;;) {
+    size_t i = from + find_newline(buf + from, end - from);
+    if (i == end)
+      break;
+    f(std::string_view(buf + begin, i - begin), false);
+    begin = from = i + 1;
+  }
+  if (begin == end) {
+    release();
+    return;
+  }
+  if (end < pool.buffer_size())
+    return;
+  if (begin) {
+    // Make room after the unterminated line
+    memmove(buf, buf + begin, end - begin);
+    end -= begin;
+    begin = 0;
+    return;
+  }
+  // A line as long as the buffer: hand it over in pieces
+  f(std::string_view(buf, end), true);
+  release();
+}
+
+void line_reader::finish() {
+  if (begin != end)
+    f(std::string_view(buf + begin, end - begin), false);
+  release();
+}
+
+void line_reader::spill() {
+  if (begin != end)
+    f(std::string_view(buf + begin, end - begin), true);
+  release();
+}
+
+void line_reader::release() {
+  begin = end = 0;
+  if (buf) {
+    pool.put(buf);
+    buf = nullptr;
+  }
+}
@@ -0,0 +1,82 @@
+#if !defined TEST_LINES_HPP_INCLUDED
+#define TEST_LINES_HPP_INCLUDED
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+// Offset of the first '\n' in [p, p + n), n if there is none. Scans 16 or
+// 32 bytes at a time with SSE2 or AVX2 when the CPU has them.
+size_t find_newline(const char* p, size_t n);
+
+// Fixed-size buffers, at most max_buffers of them handed out at once: the
+// line_readers sharing a pool use that much memory together, however much
+// they are fed. Thread-safe.
+class buffer_pool {
+public:
+  explicit buffer_pool(size_t buffer_size = 32768, size_t max_buffers = 64);
+  buffer_pool(const buffer_pool&) = delete;
+  // Every buffer must have been put back
+  ~buffer_pool();
+
+  // A buffer of buffer_size() bytes, nullptr if max_buffers are out
+  char* get();
+  void put(char* buf);
+  // Wait until a buffer is put back, at most for timeout; false if none
+  // was
+  bool wait(std::chrono::milliseconds timeout);
+
+  size_t buffer_size() const { return size; }
+  size_t in_use() const;
+
+private:
+  const size_t size, max;
+  mutable std::mutex m;
+  std::condition_variable cv;
+  std::vector<char*> free_list;
+  size_t out = 0;
+};
+
+// Called with each line, without its '\n'. The view points into the
+// reader's buffer and is valid during the call only. partial is set for
+// the pieces of a line longer than a buffer, or spilled, but the last one.
+using line_handler = std::function<void(std::string_view line, bool partial)>;
+
+// Splits a byte stream into lines, in place: bytes are read into space(),
+// and commit() hands each completed line to the handler. A buffer is taken
+// from the pool only while bytes of an unterminated line are kept, or
+// while room is lent by space().
+class line_reader {
+public:
+  line_reader(buffer_pool& pool, line_handler f);
+  line_reader(const line_reader&) = delete;
+  ~line_reader();
+
+  // Room for the next bytes, at least one; nullptr if the pool has no
+  // buffer to spare, in which case the stream must be left unread
+  char* space(size_t& room);
+  // n bytes (possibly none) were written to space()
+  void commit(size_t n);
+  // End of the stream: hand over the last line if it has no '\n'
+  void finish();
+  // Hand over the bytes kept of the unterminated line as a partial piece,
+  // giving the buffer back to the pool
+  void spill();
+
+  // Bytes of the unterminated line kept
+  size_t buffered() const { return end - begin; }
+
+private:
+  void release();
+
+  buffer_pool& pool;
+  line_handler f;
+  char* buf = nullptr;
+  // bytes of the unterminated line, none of them a '\n'
+  size_t begin = 0, end = 0;
+};
+
+#endif// TEST_LINES_HPP_INCLUDED
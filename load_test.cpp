@@ -0,0 +1,427 @@
+// Load test against a throwaway sshd on a loopback port:
+//   LoadTest [-c concurrency] [-r auths_per_second] [-d seconds] [-k key]
+//            [-m profile]
+// sshd (SSHD, or /usr/sbin/sshd) runs as the current user with freshly
+// generated host keys, authorizing keys/*.pub. Each worker runs
+// connect+handshake+pubkey auth through _test_pubkey in a loop; with -r
+// auths are paced and latency counts from the scheduled start. Reports
+// throughput, latency percentiles and errors. Set SSH_METRICS for the
+// per-phase breakdown. -m picks the method profile (see methods.hpp).
+//
+// With -a MiB, compares algorithms instead: for each key exchange and
+// cipher pair, reports the handshake latency over -n handshakes, then
+// the throughput of MiB pulled through one channel.
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+#include <fcntl.h>
+#include <pwd.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "log.hpp"
+#include "ssh.hpp"
+#include "ssh_async.hpp"
+#include "utils.hpp"
+
+extern char** environ;
+
+namespace fs = boost::filesystem;
+using clock_type = std::chrono::steady_clock;
+
+namespace {
+
+std::string slurp(const fs::path& fn) {
+  std::ifstream in(fn.string(), std::ios::binary);
+  if (!in)
+    throw std::runtime_error("Cannot read " + fn.string());
+  std::ostringstream buf;
+  buf << in.rdbuf();
+  return buf.str();
+}
+
+// Start argv[0] with stdout (and stderr if quiet) on /dev/null
+pid_t spawn(const std::vector<std::string>& args, bool quiet) {
+  std::vector<char*> argv;
+  for (const auto& a : args)
+    argv.push_back(const_cast<char*>(a.c_str()));
+  argv.push_back(nullptr);
+  posix_spawn_file_actions_t fa;
+  posix_spawn_file_actions_init(&fa);
+  autofn _fa([&fa] { posix_spawn_file_actions_destroy(&fa); });
+  posix_spawn_file_actions_addopen(&fa, 1, "/dev/null", O_WRONLY, 0);
+  if (quiet)
+    posix_spawn_file_actions_addopen(&fa, 2, "/dev/null", O_WRONLY, 0);
+  pid_t pid;
+  if (posix_spawn(&pid, argv[0], &fa, nullptr, argv.data(), environ))
+    throw std::runtime_error("Cannot run " + args[0]);
+  return pid;
+}
+
+bool run(const std::vector<std::string>& args) {
+  pid_t pid = spawn(args, true);
+  int status;
+  return waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+    !WEXITSTATUS(status);
+}
+
+std::string find_program(const char* env, const char* name) {
+  if (const char* p = getenv(env))
+    return p;
+  for (const char* dir : { "/usr/sbin", "/usr/bin", "/usr/local/sbin",
+                           "/usr/local/bin" }) {
+    fs::path p = fs::path(dir) / name;
+    if (fs::exists(p))
+      return p.string();
+  }
+  throw std::runtime_error(std::string(name) + " not found, set " + env);
+}
+
+// An unused loopback port (free when probed)
+std::string free_port() {
+  using tcp = boost::asio::ip::tcp;
+  boost::asio::io_context io;
+  tcp::acceptor a(io, tcp::endpoint(boost::asio::ip::address_v4::loopback(),
+                                    0));
+  return std::to_string(a.local_endpoint().port());
+}
+
+// Temporary directory, removed with its content on destruction
+struct tmp_dir {
+  fs::path path = fs::temp_directory_path() /
+    fs::unique_path("loadtest-%%%%-%%%%");
+  tmp_dir() { fs::create_directory(path); }
+  tmp_dir(const tmp_dir&) = delete;
+  ~tmp_dir() {
+    boost::system::error_code ec;
+    fs::remove_all(path, ec);
+  }
+};
+
+// sshd -D in a temporary directory, killed and cleaned up on destruction
+class local_sshd {
+  tmp_dir tmp;
+  const fs::path& dir = tmp.path;
+  pid_t pid = -1;
+public:
+  std::string port;
+
+  explicit local_sshd(const fs::path& keys_dir) {
+    std::string sshd = find_program("SSHD", "sshd");
+    std::string keygen = find_program("SSH_KEYGEN", "ssh-keygen");
+    std::ofstream cfg((dir / "sshd_config").string());
+    for (const char* type : { "ed25519", "ecdsa" }) {
+      fs::path key = dir / (std::string("ssh_host_") + type + "_key");
+      if (!run({ keygen, "-q", "-t", type, "-N", "", "-f", key.string() }))
+        throw std::runtime_error("Cannot generate host key " + key.string());
+      cfg << "HostKey " << key.string() << '\n';
+    }
+    std::ofstream auth((dir / "authorized_keys").string());
+    for (const auto& e : fs::directory_iterator(keys_dir))
+      if (e.path().extension() == ".pub")
+        auth << slurp(e.path());
+    auth.close();
+    port = free_port();
+    cfg << "ListenAddress 127.0.0.1:" << port << '\n'
+        << "AuthorizedKeysFile " << (dir / "authorized_keys").string() << '\n'
+        << "PidFile " << (dir / "sshd.pid").string() << '\n'
+        << "StrictModes no\n"
+        << "UsePAM no\n"
+        << "PasswordAuthentication no\n"
+        << "KbdInteractiveAuthentication no\n"
+        << "MaxStartups 10000\n"
+        << "MaxAuthTries 10\n"
+        << "LogLevel ERROR\n";
+    cfg.close();
+    fs::path cfgfn = dir / "sshd_config";
+    // OpenSSH 9.8+ would otherwise throttle a client making that many
+    // connections
+    if (run({ sshd, "-t", "-f", cfgfn.string(), "-o",
+              "PerSourcePenalties=no" }))
+      std::ofstream((dir / "sshd_config").string(), std::ios::app)
+        << "PerSourcePenalties no\n";
+    else if (!run({ sshd, "-t", "-f", cfgfn.string() }))
+      throw std::runtime_error("sshd rejects " + cfgfn.string());
+    pid = spawn({ sshd, "-D", "-e", "-f", cfgfn.string() }, false);
+    wait_ready();
+  }
+
+  local_sshd(const local_sshd&) = delete;
+
+  ~local_sshd() {
+    if (pid > 0) {
+      kill(pid, SIGTERM);
+      waitpid(pid, nullptr, 0);
+    }
+  }
+
+private:
+  void wait_ready() {
+    using tcp = boost::asio::ip::tcp;
+    boost::asio::io_context io;
+    tcp::endpoint ep(boost::asio::ip::address_v4::loopback(),
+                     std::stoi(port));
+    for (int i = 0; i < 100; ++i) {
+      int status;
+      if (waitpid(pid, &status, WNOHANG) == pid) {
+        pid = -1;
+        throw std::runtime_error("sshd exited early");
+      }
+      tcp::socket s(io);
+      boost::system::error_code ec;
+      s.connect(ep, ec);
+      if (!ec)
+        return;
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    throw std::runtime_error("sshd does not listen on port " + port);
+  }
+};
+
+struct worker_stats {
+  std::vector<double> latencies_ms;
+  std::map<std::string, size_t> errors;
+};
+
+void worker(const key_pair& key, const char* keypass,
+            clock_type::time_point next, clock_type::time_point end,
+            clock_type::duration interval, worker_stats& stats) {
+  while (next < end) {
+    if (interval.count())
+      std::this_thread::sleep_until(next);
+    auto start = interval.count() ? next : clock_type::now();
+    std::string error;
+    try {
+      LIBSSH2_SESSION* session = make_session();
+      auto_del<LIBSSH2_SESSION, int, libssh2_session_free> _session(session);
+      int rc = _test_pubkey(session, key, keypass);
+      if (rc)
+        error = known_retvals(rc);
+    } catch (const std::exception& e) {
+      error = e.what();
+    }
+    auto now = clock_type::now();
+    if (error.empty())
+      stats.latencies_ms.push_back(
+        std::chrono::duration<double, std::milli>(now - start).count());
+    else
+      ++stats.errors[error];
+    next = interval.count() ? next + interval : now;
+  }
+}
+
+// Seconds to read bytes of command output through a new channel
+double pull(LIBSSH2_SESSION *session, boost::asio::ip::tcp::socket& s,
+            size_t bytes) {
+  LIBSSH2_CHANNEL *channel;
+  while (!(channel = libssh2_channel_open_session(session)) &&
+         libssh2_session_last_errno(session) == LIBSSH2_ERROR_EAGAIN)
+    ssh2_wait(session, s);
+  if (!channel)
+    throw std::runtime_error("Cannot open channel" + ssh2_err(session));
+  autofn _channel([&] {
+    ssh2_retry(session, s, [&] { return libssh2_channel_free(channel); });
+  });
+  std::string command = "head -c " + std::to_string(bytes) + " /dev/zero";
+  auto start = clock_type::now();
+  if (ssh2_retry(session, s, [&] {
+        return libssh2_channel_exec(channel, command.c_str());
+      }))
+    throw std::runtime_error("Cannot run command" + ssh2_err(session));
+  std::vector<char> buf(256 << 10);
+  size_t got = 0;
+  for (;;) {
+    ssize_t n = libssh2_channel_read(channel, buf.data(), buf.size());
+    if (n > 0) {
+      got += n;
+      continue;
+    }
+    if (n < 0 && n != LIBSSH2_ERROR_EAGAIN)
+      throw std::runtime_error("Cannot read" + ssh2_err(session));
+    if (libssh2_channel_eof(channel))
+      break;
+    ssh2_wait(session, s);
+  }
+  if (got != bytes)
+    throw std::runtime_error("Short read: " + std::to_string(got) +
+                             " bytes");
+  return std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+// Handshake latency and bulk throughput for each algorithm pair
+bool compare_methods(const key_pair& key, const char* keypass,
+                     size_t handshakes, size_t mib) {
+  const char* kexes[] = {
+    "curve25519-sha256", "ecdh-sha2-nistp256", "ecdh-sha2-nistp384",
+    "ecdh-sha2-nistp521", "diffie-hellman-group14-sha256",
+    "diffie-hellman-group16-sha512" };
+  const char* ciphers[] = {
+    "aes128-gcm@openssh.com", "aes256-gcm@openssh.com",
+    "chacha20-poly1305@openssh.com", "aes128-ctr", "aes256-ctr" };
+  std::cout << "CPU " << (cpu_fast_aes_gcm() ? "has" : "lacks")
+            << " AES and PCLMUL instructions\n"
+            << std::left << std::setw(32) << "kex" << std::setw(32)
+            << "cipher" << std::right << std::setw(12) << "hs p50 ms"
+            << std::setw(12) << "hs p90 ms" << std::setw(12) << "MiB/s"
+            << std::endl;
+  bool ok = true;
+  for (const char* kex : kexes)
+    for (const char* cipher : ciphers) {
+      remote_t r(remote);
+      // Only this pair is offered; the MAC matters for CTR only
+      r.methods = { kex, cipher, method_profile("max-throughput").mac };
+      std::cout << std::left << std::setw(32) << kex << std::setw(32)
+                << cipher << std::right << std::fixed
+                << std::setprecision(2) << std::flush;
+      try {
+        std::vector<double> lat;
+        for (size_t i = 0; i < handshakes; ++i) {
+          boost::asio::io_context io;
+          ssh_conn conn(io);
+          auto start = clock_type::now();
+          ssh_connect(conn.session, conn.s, r);
+          lat.push_back(std::chrono::duration<double, std::milli>(
+                          clock_type::now() - start).count());
+        }
+        std::sort(lat.begin(), lat.end());
+        auto pct = [&lat](double p) {
+          return lat.empty() ? 0 :
+            lat[std::min(lat.size() - 1, size_t(p * lat.size()))];
+        };
+        std::cout << std::setw(12) << pct(0.5) << std::setw(12)
+                  << pct(0.9) << std::flush;
+        boost::asio::io_context io;
+        ssh_conn conn(io);
+        ssh_connect(conn.session, conn.s, r);
+        int rc = auth_pukey_mem(conn.session, conn.s, r.username, key,
+                                keypass);
+        if (rc)
+          throw std::runtime_error("Authentication failed: " +
+                                   known_retvals(rc));
+        double secs = pull(conn.session, conn.s, mib << 20);
+        std::cout << std::setw(12) << std::setprecision(1) << mib / secs
+                  << std::endl;
+      } catch (const std::exception& e) {
+        std::cout << "  " << e.what() << std::endl;
+        ok = false;
+      }
+    }
+  return ok;
+}
+
+int usage(const char* argv0) {
+  std::cerr << "usage: " << argv0 << " [-c concurrency]"
+            << " [-r auths_per_second] [-d seconds] [-k key] [-m profile]\n"
+            << "       " << argv0 << " -a MiB [-n handshakes] [-k key]"
+            << std::endl;
+  return 2;
+}
+
+}
+
+int main(int argc, char** argv) {
+  log_set_level(getenv("TRACE") ? log_level::trace :
+                getenv("DEBUG") ? log_level::debug : log_level::error);
+  size_t concurrency = 8;
+  double rate = 0, duration = 10;
+  std::string keyname = "fake_ed";
+  std::string profile = "auto";
+  size_t compare_mib = 0, handshakes = 20;
+  for (int i = 1; i < argc; ++i) {
+    std::string a = argv[i];
+    if (a.size() != 2 || a[0] != '-' || i + 1 >= argc)
+      return usage(argv[0]);
+    switch (a[1]) {
+      case 'c': concurrency = std::max(1ul, std::stoul(argv[++i])); break;
+      case 'r': rate = std::stod(argv[++i]); break;
+      case 'd': duration = std::stod(argv[++i]); break;
+      case 'k': keyname = argv[++i]; break;
+      case 'm': profile = argv[++i]; break;
+      case 'a': compare_mib = std::stoul(argv[++i]); break;
+      case 'n': handshakes = std::max(1ul, std::stoul(argv[++i])); break;
+      default: return usage(argv[0]);
+    }
+  }
+
+  try {
+    fs::path keys = KEYS_DIR;
+    auto key = key_pair::from_files(keys / (keyname + ".pub"),
+                                    keys / keyname);
+    const char* keypass = getenv("KEY_PASS") ? getenv("KEY_PASS") : "foobar";
+
+    local_sshd sshd(keys);
+    struct passwd* pw = getpwuid(getuid());
+    remote = remote_t("127.0.0.1", sshd.port.c_str(),
+                      pw ? pw->pw_name : getenv("USER"));
+    // Host keys were just generated
+    remote.check_host = false;
+    remote.methods = method_profile(profile);
+    if (compare_mib)
+      return compare_methods(key, keypass, handshakes, compare_mib) ? 0 : 1;
+    std::cout << "sshd on 127.0.0.1:" << sshd.port << ", " << profile
+              << " methods, " << concurrency << " workers, ";
+    if (rate > 0)
+      std::cout << rate << " auths/s";
+    else
+      std::cout << "unpaced";
+    std::cout << ", " << duration << "s" << std::endl;
+
+    auto interval = rate > 0 ?
+      std::chrono::duration_cast<clock_type::duration>(
+        std::chrono::duration<double>(concurrency / rate)) :
+      clock_type::duration::zero();
+    auto start = clock_type::now();
+    auto end = start + std::chrono::duration_cast<clock_type::duration>(
+      std::chrono::duration<double>(duration));
+    std::vector<worker_stats> stats(concurrency);
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < concurrency; ++i)
+      // Paced workers are spread evenly over the interval
+      workers.emplace_back(worker, std::cref(key), keypass,
+                           start + interval * i / concurrency, end, interval,
+                           std::ref(stats[i]));
+    for (auto& t : workers)
+      t.join();
+    double elapsed = std::chrono::duration<double>(clock_type::now() - start)
+      .count();
+
+    std::vector<double> lat;
+    std::map<std::string, size_t> errors;
+    size_t failed = 0;
+    for (const auto& s : stats) {
+      lat.insert(lat.end(), s.latencies_ms.begin(), s.latencies_ms.end());
+      for (const auto& e : s.errors) {
+        errors[e.first] += e.second;
+        failed += e.second;
+      }
+    }
+    std::sort(lat.begin(), lat.end());
+    auto pct = [&lat](double p) {
+      return lat.empty() ? 0 :
+        lat[std::min(lat.size() - 1, size_t(p * lat.size()))];
+    };
+    std::cout << std::fixed << std::setprecision(1)
+              << lat.size() << " auths ok, " << failed << " failed in "
+              << elapsed << "s: " << lat.size() / elapsed << " auths/s\n"
+              << std::setprecision(2) << "latency ms: p50 " << pct(0.5)
+              << "  p90 " << pct(0.9) << "  p99 " << pct(0.99)
+              << "  p99.9 " << pct(0.999)
+              << "  max " << (lat.empty() ? 0 : lat.back()) << std::endl;
+    for (const auto& e : errors)
+      std::cout << std::setw(8) << e.second << "  " << e.first << '\n';
+    return failed ? 1 : 0;
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 2;
+  }
+}
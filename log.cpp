@@ -0,0 +1,262 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+
+#include "log.hpp"
+
+std::atomic<int> log_runtime_level{ int(log_level::trace) };
+
+void log_set_level(log_level lvl) {
+  log_runtime_level.store(int(lvl), std::memory_order_relaxed);
+}
+
+namespace {
+
+const char* level_names[] = { "trace", "debug", "info", "warning", "error",
+                              "fatal" };
+
+struct slot {
+  std::chrono::system_clock::time_point when;
+  log_level lvl;
+  size_t len;
+  char text[472];
+};
+
+// Single producer (its thread), single consumer (the sink) queue
+struct ring {
+  static const size_t size = 256;
+  slot slots[size];
+  // next slot to write, next slot to read
+  std::atomic<size_t> head{ 0 }, tail{ 0 };
+  std::atomic<size_t> dropped{ 0 };
+  std::atomic<bool> orphan{ false };
+  uintptr_t thread = uintptr_t(pthread_self());
+};
+
+// Writes into a slot, truncating what does not fit
+struct slot_buf : std::streambuf {
+  void reset(char* b, size_t n) { setp(b, b + n); }
+  size_t len() const { return pptr() - pbase(); }
+};
+
+class sink;
+sink& the_sink();
+
+// Same layout as the Boost.Log trivial logger
+void write(const slot& s, uintptr_t thread) {
+  auto us = std::chrono::duration_cast<std::chrono::microseconds>
+    (s.when.time_since_epoch()).count();
+  time_t secs = time_t(us / 1000000);
+  struct tm tm;
+  localtime_r(&secs, &tm);
+  char stamp[32];
+  strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+  char head[96];
+  const char* name = level_names[int(s.lvl)];
+  int n = snprintf(head, sizeof(head), "[%s.%06ld] [0x%016lx] [%s]%*s",
+                   stamp, long(us % 1000000), (unsigned long)thread, name,
+                   int(8 - strlen(name)), "");
+  std::clog.write(head, n).write(s.text, s.len) << '\n';
+}
+
+class sink {
+  std::mutex m;
+  std::vector<std::shared_ptr<ring>> rings;
+  // held while draining: a single consumer at a time
+  std::mutex drain_m;
+  std::condition_variable cv;
+  std::atomic<size_t> dropped{ 0 };
+
+  void run() {
+    std::unique_lock lock(m);
+    for (;;) {
+      // Producers notify without the lock, a wakeup may be missed
+      cv.wait_for(lock, std::chrono::milliseconds(100));
+      lock.unlock();
+      drain();
+      lock.lock();
+    }
+  }
+
+public:
+  // Once exiting, records are written by the threads logging them
+  std::atomic<bool> sync{ false };
+
+  sink() {
+    // Never destroyed, so that it outlives anything logging at exit
+    std::thread([this] { run(); }).detach();
+    std::atexit([] {
+      the_sink().sync.store(true);
+      the_sink().drain();
+    });
+  }
+
+  std::shared_ptr<ring> attach() {
+    auto r = std::make_shared<ring>();
+    std::lock_guard _lock(m);
+    rings.push_back(r);
+    return r;
+  }
+
+  void wake() { cv.notify_one(); }
+
+  void drain() {
+    std::lock_guard _drain(drain_m);
+    std::vector<std::shared_ptr<ring>> snapshot;
+    {
+      std::lock_guard _lock(m);
+      snapshot = rings;
+    }
+    // Merge pending records of all threads by time
+    std::vector<std::pair<const slot*, uintptr_t>> pending;
+    std::vector<size_t> heads;
+    for (const auto& r : snapshot) {
+      size_t head = r->head.load(std::memory_order_acquire);
+      heads.push_back(head);
+      for (size_t i = r->tail.load(std::memory_order_relaxed); i != head; ++i)
+        pending.emplace_back(&r->slots[i % ring::size], r->thread);
+      if (size_t d = r->dropped.exchange(0, std::memory_order_relaxed))
+        dropped.fetch_add(d, std::memory_order_relaxed);
+    }
+    std::stable_sort(pending.begin(), pending.end(),
+                     [](const auto& a, const auto& b) {
+                       return a.first->when < b.first->when; });
+    for (const auto& p : pending)
+      write(*p.first, p.second);
+    if (!pending.empty())
+      std::clog.flush();
+    for (size_t i = 0; i < snapshot.size(); ++i)
+      snapshot[i]->tail.store(heads[i], std::memory_order_release);
+
+    // Forget queues of exited threads once drained
+    std::lock_guard _lock(m);
+    rings.erase(std::remove_if(rings.begin(), rings.end(),
+                               [](const std::shared_ptr<ring>& r) {
+                                 return r->orphan.load() &&
+                                   r->tail.load() == r->head.load(); }),
+                rings.end());
+  }
+
+  size_t dropped_count() {
+    drain();
+    return dropped.load(std::memory_order_relaxed);
+  }
+};
+
+sink& the_sink() {
+  static sink* s = new sink;
+  return *s;
+}
+
+// Formatting state of a thread
+struct thread_log {
+  std::shared_ptr<ring> r;
+  slot_buf buf;
+  std::ostream os{ &buf };
+  slot scratch;
+  slot* current = nullptr;
+};
+
+// Used by threads past their thread_log destruction, one at a time
+struct fallback_log {
+  std::mutex m;
+  thread_log tl;
+};
+fallback_log& fallback() {
+  static fallback_log* f = new fallback_log;
+  return *f;
+}
+
+thread_local thread_log* tl_ptr = nullptr;
+thread_local bool tl_gone = false;
+
+struct thread_log_owner {
+  ~thread_log_owner() {
+    tl_ptr->r->orphan.store(true);
+    delete tl_ptr;
+    tl_ptr = nullptr;
+    tl_gone = true;
+  }
+};
+
+thread_log* local() {
+  if (!tl_ptr && !tl_gone) {
+    tl_ptr = new thread_log;
+    tl_ptr->r = the_sink().attach();
+    thread_local thread_log_owner owner;
+  }
+  return tl_ptr;
+}
+
+}
+
+log_record::log_record(log_level lvl)
+  : os(local() ? local()->os : fallback().tl.os) {
+  thread_log* tl = local();
+  if (!tl) {
+    fallback().m.lock();
+    tl = &fallback().tl;
+    tl->current = &tl->scratch;
+  } else {
+    ring& r = *tl->r;
+    size_t head = r.head.load(std::memory_order_relaxed);
+    if (head - r.tail.load(std::memory_order_acquire) < ring::size) {
+      tl->current = &r.slots[head % ring::size];
+    } else {
+      // Full: format into scratch, then drop
+      r.dropped.fetch_add(1, std::memory_order_relaxed);
+      tl->current = &tl->scratch;
+    }
+  }
+  tl->current->when = std::chrono::system_clock::now();
+  tl->current->lvl = lvl;
+  tl->buf.reset(tl->current->text, sizeof(tl->current->text));
+  os.clear();
+  os.flags(std::ios::dec | std::ios::skipws);
+  os.width(0);
+  os.precision(6);
+  os.fill(' ');
+}
+
+log_record::~log_record() {
+  thread_log* tl = local();
+  if (!tl) {
+    fallback_log& f = fallback();
+    f.tl.scratch.len = f.tl.buf.len();
+    write(f.tl.scratch, uintptr_t(pthread_self()));
+    f.m.unlock();
+    return;
+  }
+  tl->current->len = tl->buf.len();
+  if (tl->current == &tl->scratch) {
+    the_sink().wake();
+    return;
+  }
+  ring& r = *tl->r;
+  size_t head = r.head.load(std::memory_order_relaxed);
+  r.head.store(head + 1, std::memory_order_release);
+  sink& s = the_sink();
+  if (s.sync.load(std::memory_order_relaxed))
+    s.drain();
+  // Only an empty queue may have a sleeping sink to wake up
+  else if (head == r.tail.load(std::memory_order_relaxed))
+    s.wake();
+}
+
+void log_flush() {
+  the_sink().drain();
+}
+
+size_t log_dropped() {
+  return the_sink().dropped_count();
+}
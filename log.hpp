@@ -0,0 +1,51 @@
+#if !defined TEST_LOG_HPP_INCLUDED
+#define TEST_LOG_HPP_INCLUDED
+
+#include <atomic>
+#include <ostream>
+
+enum class log_level { trace, debug, info, warning, error, fatal };
+
+// Statements below this level (0 for trace to 5 for fatal) are compiled
+// out, arguments included: their condition is constant false
+#if !defined LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 0
+#endif
+
+extern std::atomic<int> log_runtime_level;
+// Skip statements below lvl at run time
+void log_set_level(log_level lvl);
+inline bool log_enabled(log_level lvl) {
+  return int(lvl) >= log_runtime_level.load(std::memory_order_relaxed);
+}
+
+// One log statement, formatted straight into a slot of the thread's queue
+// and handed to the sink thread on destruction. Neither allocates nor
+// blocks: records are truncated to the slot size, and dropped when the
+// queue is full.
+class log_record {
+  std::ostream& os;
+public:
+  explicit log_record(log_level lvl);
+  log_record(const log_record&) = delete;
+  ~log_record();
+  std::ostream& stream() { return os; }
+};
+
+// Write every record queued so far
+void log_flush();
+// Records dropped so far because a queue was full
+size_t log_dropped();
+
+// Turns the stream expression of LOG into void, to match the other branch
+struct log_voidify {
+  void operator&(std::ostream&) {}
+};
+
+// An expression, so that it nests under an unbraced if/else as one
+// statement would
+#define LOG(lvl)                                                        \
+  !(int(log_level::lvl) >= LOG_MIN_LEVEL && log_enabled(log_level::lvl)) \
+  ? (void)0 : log_voidify() & log_record(log_level::lvl).stream()
+
+#endif// TEST_LOG_HPP_INCLUDED
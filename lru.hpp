@@ -0,0 +1,78 @@
+#if !defined TEST_LRU_HPP_INCLUDED
+#define TEST_LRU_HPP_INCLUDED
+
+#include <chrono>
+#include <functional>
+#include <list>
+#include <unordered_map>
+
+// At most capacity values by key, the least recently used one evicted to
+// make room. Each value may expire: it is dropped when looked up after
+// that, or when evicted. Lookups and updates take constant time. Not
+// thread-safe: owners lock around it.
+template <typename K, typename V, typename Hash = std::hash<K>>
+class lru_cache {
+public:
+  using clock = std::chrono::steady_clock;
+
+  explicit lru_cache(size_t capacity) : cap(capacity) {}
+  lru_cache(const lru_cache&) = delete;
+
+  // Value of k, made the most recently used one; nullptr if there is none
+  // or it expired by now. Valid until the cache is next changed.
+  V* get(const K& k, clock::time_point now = clock::now()) {
+    auto it = index.find(k);
+    if (it == index.end())
+      return nullptr;
+    if (it->second->expires <= now) {
+      order.erase(it->second);
+      index.erase(it);
+      return nullptr;
+    }
+    order.splice(order.end(), order, it->second);
+    return &it->second->value;
+  }
+
+  // Set the value of k, replacing any
+  void put(const K& k, V v,
+           clock::time_point expires = clock::time_point::max()) {
+    erase(k);
+    if (!cap)
+      return;
+    if (order.size() >= cap) {
+      index.erase(order.front().key);
+      order.pop_front();
+    }
+    order.push_back(entry{ k, expires, std::move(v) });
+    index.emplace(k, std::prev(order.end()));
+  }
+
+  bool erase(const K& k) {
+    auto it = index.find(k);
+    if (it == index.end())
+      return false;
+    order.erase(it->second);
+    index.erase(it);
+    return true;
+  }
+
+  void clear() {
+    index.clear();
+    order.clear();
+  }
+  // Expired values not dropped yet included
+  size_t size() const { return order.size(); }
+
+private:
+  struct entry {
+    K key;
+    clock::time_point expires;
+    V value;
+  };
+  size_t cap;
+  // most recently used last
+  std::list<entry> order;
+  std::unordered_map<K, typename std::list<entry>::iterator, Hash> index;
+};
+
+#endif// TEST_LRU_HPP_INCLUDED
@@ -1,25 +1,45 @@
+#include <algorithm>
+#include <fstream>
 #include <memory>
+#include <sstream>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/socket.h>
 
 #define BOOST_TEST_MODULE agent
 #include <boost/test/unit_test.hpp>
 #include <boost/test/results_collector.hpp>
-#include <boost/log/core.hpp>
-#include <boost/log/trivial.hpp>
-#include <boost/log/expressions.hpp>
 
+#include "arena.hpp"
+#include "auth.hpp"
 #include "ssh.hpp"
+#include "ssh_async.hpp"
+#include "pool.hpp"
+#include "batch.hpp"
+#include "deadline.hpp"
+#include "exec.hpp"
+#include "key_store.hpp"
+#include "known_hosts.hpp"
+#include "lines.hpp"
+#include "log.hpp"
+#include "lru.hpp"
+#include "methods.hpp"
+#include "metrics.hpp"
+#include "mux.hpp"
+#include "net.hpp"
+#include "sftp.hpp"
+#include "transport.hpp"
+#include "tunnel.hpp"
+#include "utils.hpp"
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
 
 // Initialize application (set logger level, setup exec destructor handler)
 struct auto_init {
   auto_init() {
-    namespace logging = boost::log;
-    auto lvl = getenv("TRACE") ?
-      logging::trivial::trace : (
-        getenv("QUIET") ? logging::trivial::info : logging::trivial::debug);
-    logging::core::get()->set_filter
-      (
-        logging::trivial::severity >= lvl
-        );
+    log_set_level(getenv("TRACE") ? log_level::trace : (
+                    getenv("QUIET") ? log_level::info : log_level::debug));
   }
 };
 static std::unique_ptr<auto_init> _auto_init_instance(new auto_init);
@@ -105,3 +125,974 @@ BOOST_AUTO_TEST_CASE( ssh ) {
   rc = test_pubkey(ed_pubkey, pkey, nullptr);
   BOOST_CHECK_EQUAL(rc, LIBSSH2_ERROR_PUBLICKEY_UNVERIFIED);
 }
+
+BOOST_AUTO_TEST_CASE( auth_identities_one_session ) {
+  if (getenv("TEST_EXPECTED"))
+    return;
+  remote.check_host = false;
+  // All of them on one connection, the mismatched pair first
+  std::vector<identity> ids{
+    { key_pair::borrow(ed_pubkey, pkey), nullptr },
+    { key_pair::borrow(pubkey, pkey_pp), keypass },
+    { key_pair::borrow(ed_pubkey, ed_pkey), nullptr } };
+  identity_memory mem;
+  for (size_t attempts : { 3, 2 }) {
+    boost::asio::io_context io;
+    ssh_conn c(io);
+    ssh_connect(c.session, c.s, remote);
+    auto res = auth_identities(c.session, c.s, remote, ids, mem);
+    BOOST_CHECK_EQUAL(res.rc, 0);
+    BOOST_CHECK_EQUAL(res.identity, 1);
+    // userauth_list, then keys; the winner goes first next time
+    BOOST_CHECK_EQUAL(res.attempts, attempts);
+  }
+}
+
+BOOST_AUTO_TEST_CASE( sftp ) {
+  if (getenv("TEST_EXPECTED"))
+    return;
+  remote.check_host = false;
+  boost::asio::io_context io;
+  ssh_conn c(io);
+  ssh_connect(c.session, c.s, remote);
+  BOOST_REQUIRE_EQUAL(auth_pukey_mem(c.session, c.s, remote.username,
+                                     key_pair::borrow(ed_pubkey, ed_pkey),
+                                     nullptr), 0);
+  auto dir = boost::filesystem::temp_directory_path() /
+    boost::filesystem::unique_path("sftp-%%%%-%%%%");
+  boost::filesystem::create_directory(dir);
+  autofn _dir([&dir] { boost::filesystem::remove_all(dir); });
+  // Empty, small, and more than one window
+  const size_t sizes[] = { 0, 100, (5 << 20) + 7 };
+  std::vector<sftp_transfer> up, down;
+  for (size_t i = 0; i < 3; ++i) {
+    std::string name = "f" + std::to_string(i);
+    std::ofstream out((dir / name).string(), std::ios::binary);
+    for (size_t j = 0; j < sizes[i]; ++j)
+      out.put(char(j * 7 + i));
+    std::string remote_name = dir.filename().string() + "-" + name;
+    up.push_back(sftp_transfer{ dir / name, remote_name });
+    down.push_back(sftp_transfer{ dir / (name + ".back"), remote_name });
+  }
+  sftp_options opts;
+  opts.parallel = 2;
+  sftp_session sftp(c.session, c.s);
+  sftp_options stalled;
+  stalled.window = 0;
+  BOOST_CHECK_THROW(sftp.upload(up, stalled), std::exception);
+  BOOST_CHECK_EQUAL(sftp.upload(up, opts), 0);
+  BOOST_CHECK_EQUAL(sftp.download(down, opts), 0);
+  for (size_t i = 0; i < 3; ++i) {
+    BOOST_CHECK_EQUAL(down[i].bytes, sizes[i]);
+    std::ifstream a(up[i].local.string(), std::ios::binary),
+      b(down[i].local.string(), std::ios::binary);
+    BOOST_CHECK(std::equal(std::istreambuf_iterator<char>(a),
+                           std::istreambuf_iterator<char>(),
+                           std::istreambuf_iterator<char>(b),
+                           std::istreambuf_iterator<char>()));
+    sftp.remove(up[i].remote);
+  }
+  std::vector<sftp_transfer> missing{ { dir / "none", "/nonexistent/file" } };
+  BOOST_CHECK_EQUAL(sftp.download(missing), 1);
+  BOOST_CHECK(!missing[0].error.empty());
+  BOOST_CHECK(!boost::filesystem::exists(dir / "none"));
+}
+
+BOOST_AUTO_TEST_CASE( exec ) {
+  if (getenv("TEST_EXPECTED"))
+    return;
+  remote.check_host = false;
+  boost::asio::io_context io;
+  ssh_conn c(io);
+  ssh_connect(c.session, c.s, remote);
+  BOOST_REQUIRE_EQUAL(auth_pukey_mem(c.session, c.s, remote.username,
+                                     key_pair::borrow(ed_pubkey, ed_pkey),
+                                     nullptr), 0);
+  std::vector<std::string> commands;
+  for (int i = 0; i < 20; ++i)
+    commands.push_back("echo out" + std::to_string(i) + "; echo err >&2; "
+                       "exit " + std::to_string(i % 4));
+  commands.push_back("head -c 100000 /dev/zero");
+  commands.push_back("kill -9 $$");
+  exec_options opts;
+  opts.max_channels = 4;
+  opts.max_output = 50000;
+  auto res = exec_commands(c.session, c.s, commands, opts);
+  BOOST_REQUIRE_EQUAL(res.size(), commands.size());
+  for (int i = 0; i < 20; ++i) {
+    BOOST_CHECK_EQUAL(res[i].error, "");
+    BOOST_CHECK_EQUAL(res[i].out, "out" + std::to_string(i) + "\n");
+    BOOST_CHECK_EQUAL(res[i].err, "err\n");
+    BOOST_CHECK_EQUAL(res[i].exit_status, i % 4);
+  }
+  BOOST_CHECK_EQUAL(res[20].out.size(), 50000);
+  BOOST_CHECK(res[20].truncated);
+  BOOST_CHECK_EQUAL(res[21].exit_signal, "KILL");
+}
+
+BOOST_AUTO_TEST_CASE( exec_streaming ) {
+  if (getenv("TEST_EXPECTED"))
+    return;
+  remote.check_host = false;
+  boost::asio::io_context io;
+  ssh_conn c(io);
+  ssh_connect(c.session, c.s, remote);
+  BOOST_REQUIRE_EQUAL(auth_pukey_mem(c.session, c.s, remote.username,
+                                     key_pair::borrow(ed_pubkey, ed_pkey),
+                                     nullptr), 0);
+  exec_options opts;
+  opts.max_channels = 4;
+
+  // Through a window much smaller than the output
+  std::vector<size_t> lines(3);
+  std::string long_line;
+  opts.window = 4096;
+  opts.buffers = std::make_shared<buffer_pool>(1024, 2);
+  opts.on_line = [&](const exec_line& l) {
+    if (l.command == 2 || l.partial)
+      long_line += l.text;
+    else if (l.text != std::to_string(++lines[l.command]))
+      throw std::runtime_error("out of order: " + std::string(l.text));
+  };
+  auto res = exec_commands(c.session, c.s,
+                           { "seq 100000", "seq 1000 >&2",
+                             "head -c 5000 /dev/zero | tr '\\0' x" }, opts);
+  for (const auto& r : res) {
+    BOOST_CHECK_EQUAL(r.error, "");
+    BOOST_CHECK_EQUAL(r.out, "");
+  }
+  BOOST_CHECK_EQUAL(lines[0], 100000);
+  BOOST_CHECK_EQUAL(lines[1], 1000);
+  BOOST_CHECK_EQUAL(long_line, std::string(5000, 'x'));
+  BOOST_CHECK_EQUAL(opts.buffers->in_use(), 0);
+
+  // stdout holds a line open while stderr fills the window they share,
+  // with fewer buffers than streams
+  opts.max_channels = 2;
+  opts.buffers = std::make_shared<buffer_pool>(1024, 1);
+  std::string streams[2][2];
+  bool ended[2][2] = {};
+  opts.on_line = [&](const exec_line& l) {
+    streams[l.command][l.stream] += l.text;
+    ended[l.command][l.stream] = !l.partial;
+  };
+  std::string cmd = "printf start; head -c 100000 /dev/zero | tr '\\0' e >&2;"
+    " echo ' end'";
+  res = exec_commands(c.session, c.s, { cmd, cmd }, opts);
+  for (int i = 0; i < 2; ++i) {
+    BOOST_CHECK_EQUAL(res[i].error, "");
+    BOOST_CHECK_EQUAL(streams[i][0], "start end");
+    BOOST_CHECK(streams[i][1] == std::string(100000, 'e'));
+    BOOST_CHECK(ended[i][0] && ended[i][1]);
+  }
+  BOOST_CHECK_EQUAL(opts.buffers->in_use(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( tunnel_relay ) {
+  if (getenv("TEST_EXPECTED"))
+    return;
+  using boost::asio::ip::tcp;
+  const size_t clients = 8, size = 1 << 20;
+  // Target of the forwarded connections, echoing what it gets
+  boost::asio::io_context echo_io;
+  tcp::acceptor echo(echo_io, tcp::endpoint(
+                       boost::asio::ip::address_v4::loopback(), 0));
+
+  remote.check_host = false;
+  boost::asio::io_context io;
+  ssh_conn c(io);
+  ssh_connect(c.session, c.s, remote);
+  BOOST_REQUIRE_EQUAL(auth_pukey_mem(c.session, c.s, remote.username,
+                                     key_pair::borrow(ed_pubkey, ed_pkey),
+                                     nullptr), 0);
+  ssh_forwarder::options opts;
+  opts.max_connections = clients;
+  ssh_forwarder fwd(c.session, c.s, opts);
+  fwd.forward(tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0),
+              "127.0.0.1", echo.local_endpoint().port());
+  auto local = fwd.local_endpoint(0);
+  // Threads started once nothing can throw before they are joined
+  std::vector<std::thread> echoes;
+  std::thread echo_thread([&] {
+    for (size_t i = 0; i < clients; ++i) {
+      auto conn = std::make_shared<tcp::socket>(echo_io);
+      boost::system::error_code ec;
+      echo.accept(*conn, ec);
+      if (ec)
+        break;
+      echoes.emplace_back([conn] {
+        std::vector<char> buf(65536);
+        boost::system::error_code ec;
+        for (;;) {
+          size_t n = conn->read_some(boost::asio::buffer(buf), ec);
+          if (ec ||
+              !boost::asio::write(*conn, boost::asio::buffer(buf.data(), n),
+                                  ec))
+            break;
+        }
+        conn->shutdown(tcp::socket::shutdown_send, ec);
+      });
+    }
+  });
+  std::thread io_thread([&io] { run_batched(io); });
+
+  // Connections in parallel, each sending and reading back its own data
+  std::vector<std::thread> threads;
+  std::atomic<size_t> good{ 0 };
+  for (size_t i = 0; i < clients; ++i)
+    threads.emplace_back([&, i] {
+      boost::asio::io_context cio;
+      tcp::socket s(cio);
+      s.connect(local);
+      std::string out(size, '\0'), in(size, '\0');
+      for (size_t j = 0; j < size; ++j)
+        out[j] = char(i * 31 + j * 7 + j / 4096);
+      std::thread writer([&] {
+        boost::asio::write(s, boost::asio::buffer(out));
+        s.shutdown(tcp::socket::shutdown_send);
+      });
+      boost::system::error_code ec;
+      size_t n = boost::asio::read(s, boost::asio::buffer(in), ec);
+      writer.join();
+      char extra;
+      s.read_some(boost::asio::buffer(&extra, 1), ec);
+      if (n == size && in == out && ec == boost::asio::error::eof)
+        ++good;
+    });
+  for (auto& t : threads)
+    t.join();
+  BOOST_CHECK_EQUAL(good, clients);
+  // Relays are dropped once both ends are done
+  for (int i = 0; i < 500 && fwd.stats(0).open; ++i)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  auto st = fwd.stats(0);
+  BOOST_CHECK_EQUAL(st.accepted, clients);
+  BOOST_CHECK_EQUAL(st.open, 0);
+  BOOST_CHECK_EQUAL(st.failed, 0);
+  BOOST_CHECK_EQUAL(st.bytes_out, clients * size);
+  BOOST_CHECK_EQUAL(st.bytes_in, clients * size);
+  BOOST_CHECK(st.out_rate() > 0);
+  LOG(info) << "tunnel: " << st.out_rate() / 1e6 << " MB/s each way";
+
+  boost::asio::post(io, [&fwd] { fwd.close(); });
+  io_thread.join();
+  // Wakes up the accept if fewer connections came than expected
+  ::shutdown(echo.native_handle(), SHUT_RDWR);
+  echo_thread.join();
+  for (auto& t : echoes)
+    t.join();
+}
+
+BOOST_AUTO_TEST_CASE( async_handshake_failure ) {
+  // A peer dropping the connection must be reported once, not hang
+  using tcp = boost::asio::ip::tcp;
+  boost::asio::io_context io;
+  tcp::acceptor a(io, tcp::endpoint(boost::asio::ip::address_v4::loopback(),
+                                    0));
+  tcp::socket peer(io);
+  a.async_accept(peer, [&](const boost::system::error_code&) {
+    peer.close();
+  });
+  remote_t r("127.0.0.1", std::to_string(a.local_endpoint().port()).c_str(),
+             "test");
+  int calls = 0;
+  std::exception_ptr err;
+  async_test_pubkey(io, r, pubkey, pkey, nullptr,
+                    [&](int, std::exception_ptr e) { ++calls; err = e; });
+  io.run();
+  BOOST_CHECK_EQUAL(calls, 1);
+  BOOST_CHECK(err);
+}
+
+BOOST_AUTO_TEST_CASE( pool_connect_failure ) {
+  // A failed connection must not hold a slot of the per-host limit
+  using tcp = boost::asio::ip::tcp;
+  boost::asio::io_context io;
+  tcp::acceptor a(io, tcp::endpoint(boost::asio::ip::address_v4::loopback(),
+                                    0));
+  remote_t r("127.0.0.1", std::to_string(a.local_endpoint().port()).c_str(),
+             "test");
+  a.close();
+  session_pool::options opts;
+  opts.max_per_host = 1;
+  session_pool pool(opts);
+  for (int i = 0; i < 2; ++i)
+    BOOST_CHECK_THROW(pool.checkout(r, key_pair::borrow(pubkey, pkey),
+                                    nullptr), std::exception);
+  BOOST_CHECK_EQUAL(pool.open(), 0);
+  BOOST_CHECK_EQUAL(pool.idle(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( transport_batch ) {
+  for (bool uring : { true, false }) {
+    io_batch::enable_uring(uring);
+    BOOST_TEST_MESSAGE("io_uring: " << io_batch::uses_uring());
+    int p[2][2];
+    for (auto& fds : p) {
+      BOOST_REQUIRE_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+      fcntl(fds[0], F_SETFL, O_NONBLOCK);
+      fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    }
+    autofn _close([&p] {
+      for (auto& fds : p) {
+        close(fds[0]);
+        close(fds[1]);
+      }
+    });
+    auto peer = [](int fd) {
+      char buf[256];
+      ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+      return n > 0 ? std::string(buf, n) : std::string();
+    };
+    auto a = std::make_shared<ssh2_transport>();
+    auto b = std::make_shared<ssh2_transport>();
+    char buf[64];
+    size_t syscalls = io_batch::syscalls();
+    {
+      // Held back until the batch ends, then one write for both
+      io_batch batch;
+      BOOST_CHECK_EQUAL(a->send(p[0][0], "hello ", 6, 0), 6);
+      BOOST_CHECK_EQUAL(b->send(p[1][0], "other", 5, 0), 5);
+      BOOST_CHECK_EQUAL(a->send(p[0][0], "world", 5, 0), 5);
+      // Nothing can answer what was not sent
+      BOOST_CHECK_EQUAL(a->recv(p[0][0], buf, sizeof(buf), 0), -EAGAIN);
+      BOOST_CHECK_EQUAL(a->pending(), 11);
+      BOOST_CHECK(!a->stalled());
+      BOOST_CHECK_EQUAL(peer(p[0][1]), "");
+    }
+    BOOST_CHECK_EQUAL(io_batch::syscalls() - syscalls,
+                      io_batch::uses_uring() ? 1 : 2);
+    BOOST_CHECK_EQUAL(a->pending(), 0);
+    BOOST_CHECK_EQUAL(peer(p[0][1]), "hello world");
+    BOOST_CHECK_EQUAL(peer(p[1][1]), "other");
+    // Outside of a batch, straight through both ways
+    BOOST_CHECK_EQUAL(a->send(p[0][0], "x", 1, 0), 1);
+    BOOST_CHECK_EQUAL(peer(p[0][1]), "x");
+    BOOST_CHECK_EQUAL(::send(p[0][1], "reply", 5, 0), 5);
+    BOOST_CHECK_EQUAL(a->recv(p[0][0], buf, sizeof(buf), 0), 5);
+
+    // More than the socket takes: the rest waits for room
+    std::string big(1 << 19, 'b');
+    {
+      io_batch batch;
+      BOOST_CHECK_EQUAL(a->send(p[0][0], big.data(), big.size(), 0),
+                        ssize_t(big.size()));
+    }
+    BOOST_CHECK(a->stalled());
+    size_t got = 0;
+    while (a->pending() || got < big.size()) {
+      char chunk[65536];
+      ssize_t n = ::recv(p[0][1], chunk, sizeof(chunk), 0);
+      if (n > 0)
+        got += n;
+      a->flush();
+    }
+    BOOST_CHECK_EQUAL(got, big.size());
+
+    // A failed write is reported by the next call
+    close(p[1][1]);
+    p[1][1] = -1;
+    {
+      io_batch batch;
+      BOOST_CHECK_EQUAL(b->send(p[1][0], "lost", 4, 0), 4);
+    }
+    BOOST_CHECK_EQUAL(b->send(p[1][0], "x", 1, 0), -EPIPE);
+    a->close();
+    BOOST_CHECK_EQUAL(a->send(p[0][0], "x", 1, 0), -EBADF);
+  }
+  io_batch::enable_uring(true);
+}
+
+BOOST_AUTO_TEST_CASE( mux_round_trip ) {
+  // Errors of the daemon reach the client, which can go on with requests
+  using tcp = boost::asio::ip::tcp;
+  boost::asio::io_context io;
+  tcp::acceptor a(io, tcp::endpoint(boost::asio::ip::address_v4::loopback(),
+                                    0));
+  auto dir = boost::filesystem::temp_directory_path() /
+    boost::filesystem::unique_path("mux-%%%%-%%%%");
+  boost::filesystem::create_directory(dir);
+  autofn _dir([&dir] { boost::filesystem::remove_all(dir); });
+  std::ofstream((dir / "id.pub").string()) << ed_pubkey;
+  std::ofstream((dir / "id").string()) << ed_pkey;
+  mux_target t;
+  t.host = "127.0.0.1";
+  t.port = std::to_string(a.local_endpoint().port());
+  t.username = "test";
+  t.pubkey_file = (dir / "id.pub").string();
+  t.privkey_file = (dir / "id").string();
+  a.close();
+
+  mux_server::options opts;
+  opts.socket = (dir / "mux.sock").string();
+  auto server = std::make_unique<mux_server>(opts);
+  BOOST_CHECK_THROW(mux_server{ opts }, std::exception);
+  std::thread runner([&server] { server->run(); });
+  {
+    mux_client c(opts.socket);
+    BOOST_CHECK_THROW(c.exec(t, { "true" }), std::exception);
+    std::vector<sftp_transfer> files{ { dir / "none", "none" } };
+    BOOST_CHECK_THROW(c.download(t, files), std::exception);
+    t.privkey_file = (dir / "missing").string();
+    BOOST_CHECK_THROW(c.exec(t, { "true" }), std::exception);
+  }
+  BOOST_CHECK_EQUAL(server->pool().open(), 0);
+  server->stop();
+  runner.join();
+  server.reset();
+  BOOST_CHECK(!boost::filesystem::exists(opts.socket));
+  BOOST_CHECK_THROW(mux_client{ opts.socket }, std::exception);
+  // Anything but a socket is left alone
+  std::ofstream(opts.socket) << "data";
+  BOOST_CHECK_THROW(mux_server{ opts }, std::exception);
+  BOOST_CHECK(boost::filesystem::exists(opts.socket));
+}
+
+BOOST_AUTO_TEST_CASE( mux_socket_private ) {
+  // Without XDG_RUNTIME_DIR the socket goes to a directory closed to others
+  const char* runtime = getenv("XDG_RUNTIME_DIR");
+  std::string saved = runtime ? runtime : "";
+  unsetenv("XDG_RUNTIME_DIR");
+  autofn _env([&] {
+    if (runtime)
+      setenv("XDG_RUNTIME_DIR", saved.c_str(), 1);
+  });
+  auto dir = boost::filesystem::path(mux_default_socket()).parent_path();
+  auto st = boost::filesystem::status(dir);
+  BOOST_CHECK(boost::filesystem::is_directory(st));
+  BOOST_CHECK_EQUAL(st.permissions(), boost::filesystem::owner_all);
+  // Opened to others by someone: refused
+  boost::filesystem::permissions(dir, boost::filesystem::owner_all |
+                                 boost::filesystem::others_read);
+  BOOST_CHECK_THROW(mux_default_socket(), std::exception);
+  boost::filesystem::permissions(dir, boost::filesystem::owner_all);
+  BOOST_CHECK_NO_THROW(mux_default_socket());
+}
+
+BOOST_AUTO_TEST_CASE( timer_wheel_fires ) {
+  timer_wheel wheel;
+  auto now = timer_wheel::clock_type::now();
+  std::mutex m;
+  std::vector<int> order;
+  auto push = [&](int i) {
+    return [&, i] {
+      std::lock_guard _lock(m);
+      order.push_back(i);
+    };
+  };
+  auto late = wheel.schedule(now + std::chrono::milliseconds(60), push(2));
+  auto early = wheel.schedule(now + std::chrono::milliseconds(20), push(1));
+  auto never = wheel.schedule(now + std::chrono::milliseconds(40), push(3));
+  BOOST_CHECK(!wheel.schedule(timer_wheel::clock_type::time_point::max(),
+                              push(4)));
+  BOOST_CHECK_EQUAL(wheel.pending(), 3);
+  BOOST_CHECK(never.cancel());
+  BOOST_CHECK_EQUAL(wheel.pending(), 2);
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  BOOST_CHECK_EQUAL(wheel.pending(), 0);
+  // Too late to cancel
+  BOOST_CHECK(!late.cancel());
+  std::lock_guard _lock(m);
+  BOOST_CHECK((order == std::vector<int>{ 1, 2 }));
+}
+
+BOOST_AUTO_TEST_CASE( handshake_deadline ) {
+  // A peer that never sends its banner must not hold a session forever
+  using tcp = boost::asio::ip::tcp;
+  boost::asio::io_context io;
+  tcp::acceptor a(io, tcp::endpoint(boost::asio::ip::address_v4::loopback(),
+                                    0));
+  remote_t r("127.0.0.1", std::to_string(a.local_endpoint().port()).c_str(),
+             "test");
+  r.timeouts.handshake = std::chrono::milliseconds(200);
+  {
+    ssh_conn conn(io);
+    BOOST_CHECK_THROW(ssh_connect(conn.session, conn.s, r), ssh_timeout);
+  }
+  tcp::socket peer(io);
+  a.async_accept(peer, [](const boost::system::error_code&) {});
+  int rc = 0;
+  std::exception_ptr err;
+  async_test_pubkey(io, r, pubkey, pkey, nullptr,
+                    [&](int rc_, std::exception_ptr e) { rc = rc_; err = e; });
+  io.run();
+  BOOST_CHECK(!err);
+  BOOST_CHECK_EQUAL(known_retvals(rc), "LIBSSH2_ERROR_SOCKET_TIMEOUT");
+}
+
+BOOST_AUTO_TEST_CASE( method_profiles ) {
+  LIBSSH2_SESSION *session = make_session();
+  auto_del<LIBSSH2_SESSION, int, libssh2_session_free> _session(session);
+  for (const char* name : { "default", "fastest-handshake", "max-throughput",
+                            "auto" })
+    BOOST_CHECK_NO_THROW(set_method_prefs(session, method_profile(name)));
+  auto prefs = method_profile("auto");
+  BOOST_CHECK_EQUAL(prefs.crypt.find(cpu_fast_aes_gcm() ? "aes128-gcm" :
+                                     "chacha20"), 0);
+  // Every SHA-1 key exchange after the SHA-2 ones
+  std::string kex = "," + prefs.kex + ",";
+  BOOST_CHECK_LT(kex.rfind("sha256,"), kex.find("-sha1,"));
+  BOOST_CHECK_LT(kex.rfind("sha512,"), kex.find("-sha1,"));
+  BOOST_CHECK_THROW(method_profile("slowest"), std::exception);
+  BOOST_CHECK_THROW(set_method_prefs(session, { "", "rot13", "" }),
+                    std::exception);
+}
+
+BOOST_AUTO_TEST_CASE( session_arena_blocks ) {
+  {
+    session_arena arena;
+    char* p = static_cast<char*>(arena.allocate(100));
+    BOOST_REQUIRE(p);
+    BOOST_CHECK_EQUAL(reinterpret_cast<uintptr_t>(p) % 16, 0);
+    // Freed blocks are reused first
+    arena.deallocate(p);
+    BOOST_CHECK_EQUAL(arena.allocate(90), p);
+    memset(p, 'a', 90);
+    size_t reserved = arena.reserved();
+    // Growing keeps the content, within or beyond size classes
+    p = static_cast<char*>(arena.reallocate(p, 3000));
+    BOOST_CHECK_EQUAL(std::string(p, 90), std::string(90, 'a'));
+    p = static_cast<char*>(arena.reallocate(p, 100000));
+    BOOST_CHECK_EQUAL(std::string(p, 90), std::string(90, 'a'));
+    BOOST_CHECK_EQUAL(arena.reserved(), reserved);
+    arena.deallocate(p);
+    // Left allocated: released with the arena
+    for (int i = 0; i < 1000; ++i)
+      BOOST_REQUIRE(arena.allocate(i));
+    BOOST_CHECK(arena.reserved() > reserved);
+  }
+  // Sessions churned from several threads
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t)
+    threads.emplace_back([] {
+      for (int i = 0; i < 200; ++i) {
+        LIBSSH2_SESSION *session = make_session();
+        set_method_prefs(session, method_profile("auto"));
+        libssh2_session_free(session);
+      }
+    });
+  for (auto& t : threads)
+    t.join();
+}
+
+BOOST_AUTO_TEST_CASE( line_reader_split ) {
+  // Every position, from every alignment, past the vector widths
+  std::string text(300, 'a');
+  for (size_t i = 0; i < text.size(); ++i) {
+    text[i] = '\n';
+    for (size_t from = 0; from < 40; ++from) {
+      size_t n = text.size() - from;
+      BOOST_REQUIRE_EQUAL(find_newline(text.data() + from, n),
+                          i < from ? n : i - from);
+    }
+    text[i] = 'a';
+  }
+  BOOST_CHECK_EQUAL(find_newline(text.data(), text.size()), text.size());
+
+  buffer_pool pool(16, 1);
+  std::vector<std::string> got;
+  line_reader lines(pool, [&](std::string_view l, bool partial) {
+    got.push_back(std::string(l) + (partial ? "+" : ""));
+  });
+  auto feed = [&](line_reader& r, const std::string& s) {
+    size_t room;
+    char* buf = r.space(room);
+    BOOST_REQUIRE(buf);
+    BOOST_REQUIRE(s.size() <= room);
+    memcpy(buf, s.data(), s.size());
+    r.commit(s.size());
+  };
+  feed(lines, "ab\ncd");
+  BOOST_CHECK_EQUAL(lines.buffered(), 2);
+  // The buffer is held for the unterminated line: no other reader gets one
+  line_reader other(pool, [](std::string_view, bool) {});
+  size_t room;
+  BOOST_CHECK(!other.space(room));
+  feed(lines, "ef\n\n");
+  BOOST_CHECK_EQUAL(pool.in_use(), 0);
+  feed(lines, "0123456789");
+  feed(lines, "abcdef");
+  feed(lines, "gh\nsp");
+  // Spilled: the buffer goes back, the line goes on
+  lines.spill();
+  BOOST_CHECK_EQUAL(pool.in_use(), 0);
+  feed(lines, "ill\nend");
+  lines.finish();
+  BOOST_CHECK_EQUAL(pool.in_use(), 0);
+  std::vector<std::string> expected{ "ab", "cdef", "", "0123456789abcdef+",
+                                     "gh", "sp+", "ill", "end" };
+  BOOST_CHECK_EQUAL_COLLECTIONS(got.begin(), got.end(),
+                                expected.begin(), expected.end());
+}
+
+BOOST_AUTO_TEST_CASE( batch_read_hosts ) {
+  std::istringstream in("# fleet\n"
+                        "alpha\n"
+                        "  root@beta:2222  # bastion\n"
+                        "\n"
+                        "[::1]:22022\n"
+                        "fe80::1\n");
+  auto hosts = read_hosts(in, remote_t("localhost", "22", "test"));
+  BOOST_REQUIRE_EQUAL(hosts.size(), 4);
+  BOOST_CHECK_EQUAL(hosts[0].host, "alpha");
+  BOOST_CHECK_EQUAL(hosts[0].port, "22");
+  BOOST_CHECK_EQUAL(hosts[0].username, "test");
+  BOOST_CHECK_EQUAL(hosts[1].host, "beta");
+  BOOST_CHECK_EQUAL(hosts[1].port, "2222");
+  BOOST_CHECK_EQUAL(hosts[1].username, "root");
+  BOOST_CHECK_EQUAL(hosts[2].host, "::1");
+  BOOST_CHECK_EQUAL(hosts[2].port, "22022");
+  BOOST_CHECK_EQUAL(hosts[3].host, "fe80::1");
+  std::istringstream no_host("root@\n");
+  BOOST_CHECK_THROW(read_hosts(no_host, remote_t("localhost", "22", "test")),
+                    std::exception);
+  for (const char* bad : { "host:\n", "[::1]:\n", "host:ssh\n",
+                           "host:70000\n" }) {
+    std::istringstream no_port(bad);
+    BOOST_CHECK_THROW(read_hosts(no_port, remote_t("localhost", "22", "test")),
+                      std::exception);
+  }
+}
+
+BOOST_AUTO_TEST_CASE( known_hosts_lookup ) {
+  auto key_b64 = [](const char* line) {
+    std::istringstream in(line);
+    std::string type, b64;
+    in >> type >> b64;
+    return b64;
+  };
+  std::string ed_b64 = key_b64(ed_pubkey), rsa_b64 = key_b64(pubkey);
+  std::string ed_blob, rsa_blob, salt = "0123456789abcdefghij";
+  BOOST_REQUIRE(base64_decode(ed_b64, ed_blob));
+  BOOST_REQUIRE(base64_decode(rsa_b64, rsa_blob));
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int mdlen;
+  std::string hashed_name = "[hashed.example]:2222";
+  HMAC(EVP_sha1(), salt.data(), int(salt.size()),
+       reinterpret_cast<const unsigned char*>(hashed_name.data()),
+       hashed_name.size(), md, &mdlen);
+  std::ostringstream salt64, hash64;
+  salt64 << base64dump(salt);
+  hash64 << base64dump(reinterpret_cast<const char*>(md), mdlen);
+
+  auto tmp = boost::filesystem::temp_directory_path() /
+    boost::filesystem::unique_path("kh-test-%%%%-%%%%");
+  unlinkable _tmp(tmp.string());
+  std::ofstream{ tmp.string() }
+    << "# comment\n"
+    << "plain.example,Alias.Example ssh-ed25519 " << ed_b64 << "\n"
+    << "[plain.example]:2022 ssh-rsa " << rsa_b64 << "\n"
+    << "|1|" << salt64.str() << "|" << hash64.str() << " ssh-ed25519 "
+    << ed_b64 << "\n"
+    << "*.wild.example,!bad.wild.example ssh-ed25519 " << ed_b64 << "\n"
+    << "@revoked revoked.example ssh-ed25519 " << ed_b64 << "\n"
+    << "revoked.example ssh-ed25519 " << ed_b64 << "\n";
+  known_hosts_db db;
+  BOOST_CHECK_EQUAL(db.load(tmp), 6);
+  auto check = [&](const char* host, int port, const std::string& key) {
+    return db.check(host, port, key.data(), key.size());
+  };
+  BOOST_CHECK_EQUAL(check("plain.example", 22, ed_blob),
+                    LIBSSH2_KNOWNHOST_CHECK_MATCH);
+  BOOST_CHECK_EQUAL(check("alias.example", 22, ed_blob),
+                    LIBSSH2_KNOWNHOST_CHECK_MATCH);
+  BOOST_CHECK_EQUAL(check("plain.example", 2022, ed_blob),
+                    LIBSSH2_KNOWNHOST_CHECK_NOTFOUND);
+  BOOST_CHECK_EQUAL(check("plain.example", 2022, rsa_blob),
+                    LIBSSH2_KNOWNHOST_CHECK_MATCH);
+  BOOST_CHECK_EQUAL(check("hashed.example", 2222, ed_blob),
+                    LIBSSH2_KNOWNHOST_CHECK_MATCH);
+  BOOST_CHECK_EQUAL(check("hashed.example", 22, ed_blob),
+                    LIBSSH2_KNOWNHOST_CHECK_NOTFOUND);
+  BOOST_CHECK_EQUAL(check("a.wild.example", 22, ed_blob),
+                    LIBSSH2_KNOWNHOST_CHECK_MATCH);
+  BOOST_CHECK_EQUAL(check("bad.wild.example", 22, ed_blob),
+                    LIBSSH2_KNOWNHOST_CHECK_NOTFOUND);
+  BOOST_CHECK_EQUAL(check("revoked.example", 22, ed_blob),
+                    LIBSSH2_KNOWNHOST_CHECK_MISMATCH);
+  std::string other = ed_blob;
+  other.back() ^= 1;
+  BOOST_CHECK_EQUAL(check("plain.example", 22, other),
+                    LIBSSH2_KNOWNHOST_CHECK_MISMATCH);
+  // Loading more after a check: the remembered matches are not reused
+  std::ofstream{ tmp.string() }
+    << "*.late.example ssh-ed25519 " << ed_b64 << "\n";
+  BOOST_CHECK_EQUAL(check("a.late.example", 22, ed_blob),
+                    LIBSSH2_KNOWNHOST_CHECK_NOTFOUND);
+  BOOST_CHECK_EQUAL(db.load(tmp), 1);
+  BOOST_CHECK_EQUAL(check("a.late.example", 22, ed_blob),
+                    LIBSSH2_KNOWNHOST_CHECK_MATCH);
+}
+
+BOOST_AUTO_TEST_CASE( key_tmpfiles_reuse ) {
+  auto ed = key_pair::borrow(ed_pubkey, ed_pkey);
+  auto files = cached_key_tmpfiles(ed);
+  // Only files kept off disk are reused
+  if (files->in_memory())
+    BOOST_CHECK_EQUAL(files, cached_key_tmpfiles(key_pair(ed_pubkey,
+                                                          ed_pkey)));
+  else
+    BOOST_CHECK_NE(files, cached_key_tmpfiles(key_pair(ed_pubkey, ed_pkey)));
+  BOOST_CHECK_NE(files, cached_key_tmpfiles(key_pair::borrow(pubkey, pkey)));
+  std::ifstream in(files->priv());
+  std::string content((std::istreambuf_iterator<char>(in)),
+                      std::istreambuf_iterator<char>());
+  BOOST_CHECK_EQUAL(content, std::string(ed_pkey) + "\n");
+  std::string path = files->pub();
+  clear_key_tmpfiles();
+  BOOST_CHECK(std::ifstream(path).good());
+  files.reset();
+  BOOST_CHECK(!std::ifstream(path).good());
+}
+
+BOOST_AUTO_TEST_CASE( key_pair_material ) {
+  // Borrowed: the very same bytes
+  auto borrowed = key_pair::borrow(ed_pubkey, ed_pkey);
+  BOOST_CHECK(borrowed.pub().data() == ed_pubkey);
+  // Owned: copied once, shared by copies of the handle
+  auto owned = std::make_unique<key_pair>(ed_pubkey, ed_pkey);
+  key_pair copy = *owned;
+  owned.reset();
+  BOOST_CHECK_EQUAL(copy.pub(), ed_pubkey);
+  BOOST_CHECK_EQUAL(copy.priv(), ed_pkey);
+  BOOST_CHECK(copy.id() == borrowed.id());
+
+  // Mapped: the file content as is
+  auto dir = boost::filesystem::temp_directory_path() /
+    boost::filesystem::unique_path("key-pair-%%%%-%%%%");
+  boost::filesystem::create_directory(dir);
+  autofn _dir([&dir] { boost::filesystem::remove_all(dir); });
+  std::ofstream(dir / "k.pub", std::ios::binary) << ed_pubkey << '\n';
+  std::ofstream(dir / "k", std::ios::binary) << ed_pkey;
+  std::ofstream(dir / "empty");
+  auto mapped = key_pair::from_files(dir / "k.pub", dir / "k");
+  BOOST_CHECK_EQUAL(mapped.pub(), std::string(ed_pubkey) + "\n");
+  BOOST_CHECK_EQUAL(mapped.priv(), ed_pkey);
+  BOOST_CHECK_THROW(key_pair::from_files(dir / "k.pub", dir / "missing"),
+                    std::exception);
+  BOOST_CHECK_THROW(key_pair::from_files(dir / "empty", dir / "k"),
+                    std::exception);
+}
+
+BOOST_AUTO_TEST_CASE( identity_order ) {
+  std::vector<identity> ids{
+    { key_pair::borrow(pubkey, pkey), nullptr },
+    { key_pair::borrow(pubkey, pkey_pp), keypass },
+    { key_pair::borrow(ed_pubkey, ed_pkey), nullptr } };
+  remote_t a("a.example", "22", "test"), b("b.example", "22", "test");
+  identity_memory mem;
+  BOOST_CHECK((mem.order(a, ids) == std::vector<size_t>{ 0, 1, 2 }));
+  mem.remember(a, ids[2]);
+  BOOST_CHECK((mem.order(a, ids) == std::vector<size_t>{ 2, 0, 1 }));
+  BOOST_CHECK((mem.order(b, ids) == std::vector<size_t>{ 0, 1, 2 }));
+  // Identities are told apart by public key
+  mem.remember(b, ids[1]);
+  BOOST_CHECK((mem.order(b, ids) == std::vector<size_t>{ 0, 1, 2 }));
+  // Unknown key: order unchanged
+  BOOST_CHECK((mem.order(a, { ids[0], ids[1] }) ==
+               std::vector<size_t>{ 0, 1 }));
+  mem.forget(a);
+  BOOST_CHECK_EQUAL(mem.size(), 1);
+  BOOST_CHECK((mem.order(a, ids) == std::vector<size_t>{ 0, 1, 2 }));
+}
+
+BOOST_AUTO_TEST_CASE( key_store_unlock ) {
+  key_store store;
+  bool wrong = true;
+  BOOST_CHECK(!store.unlock(pkey, keypass, &wrong));
+  BOOST_CHECK(!wrong);
+  // Remembered: the second time does not run the KDF
+  for (int i = 0; i < 2; ++i) {
+    BOOST_CHECK(!store.unlock(pkey_pp, "wrong", &wrong));
+    BOOST_CHECK(wrong);
+  }
+  // One decryption for concurrent unlocks
+  std::vector<std::shared_ptr<const secure_buffer>> keys(4);
+  std::vector<std::thread> threads;
+  for (auto& k : keys)
+    threads.emplace_back([&] { k = store.unlock(pkey_pp, keypass); });
+  for (auto& t : threads)
+    t.join();
+  auto rsa = keys[0];
+  for (auto& k : keys)
+    BOOST_CHECK_EQUAL(k, rsa);
+  auto ed = store.unlock(ed_pkey_pp, keypass);
+  BOOST_REQUIRE(rsa && ed);
+  BOOST_CHECK_EQUAL(store.size(), 2);
+  BOOST_CHECK_EQUAL(store.unlock(pkey_pp, keypass), rsa);
+  // Same key as pkey, apart from the random check integers
+  auto decode = [](std::string_view pem) {
+    std::string b64, bin;
+    for (char c : pem.substr(pem.find('\n'), pem.rfind("-----END") -
+                             pem.find('\n')))
+      if (c != '\n')
+        b64.push_back(c);
+    BOOST_REQUIRE(base64_decode(b64, bin));
+    return bin;
+  };
+  std::string a = decode(rsa->view()), b = decode(pkey);
+  BOOST_REQUIRE_EQUAL(a.size(), b.size());
+  auto diff = std::mismatch(a.begin(), a.end(), b.begin()).first - a.begin();
+  BOOST_CHECK(a.substr(diff + 8) == b.substr(diff + 8));
+}
+
+BOOST_AUTO_TEST_CASE( metrics_export ) {
+  metrics_reset();
+  std::thread t([] {
+    for (int i = 1; i <= 100; ++i)
+      record_phase(phase::auth, std::chrono::milliseconds(i));
+    record_rc(LIBSSH2_ERROR_AUTHENTICATION_FAILED);
+  });
+  t.join();
+  record_phase(phase::auth, std::chrono::milliseconds(1000));
+  record_rc(0);
+  std::string json = metrics_json();
+  BOOST_TEST_MESSAGE(json);
+  BOOST_CHECK(json.find("\"auth\":{\"count\":101,") != std::string::npos);
+  BOOST_CHECK(json.find("\"max_ns\":1000000000") != std::string::npos);
+  // Buckets are within ~6% of the value
+  BOOST_CHECK(json.find("\"p50_ns\":5") != std::string::npos);
+  BOOST_CHECK(json.find("\"LIBSSH2_ERROR_AUTHENTICATION_FAILED\":1")
+              != std::string::npos);
+  std::string prom = metrics_prometheus();
+  BOOST_CHECK(prom.find("ssh_phase_seconds_count{phase=\"auth\"} 101\n")
+              != std::string::npos);
+  BOOST_CHECK(prom.find("ssh_rc_total{rc=\"0\"} 1\n")
+              != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE( lru_cache_evict ) {
+  using clock = lru_cache<int, int>::clock;
+  lru_cache<int, int> c(2);
+  c.put(1, 10);
+  c.put(2, 20);
+  // 1 becomes the most recently used, so 2 goes
+  BOOST_REQUIRE(c.get(1));
+  c.put(3, 30);
+  BOOST_CHECK(!c.get(2));
+  BOOST_CHECK_EQUAL(*c.get(1), 10);
+  BOOST_CHECK_EQUAL(*c.get(3), 30);
+  c.put(3, 31);
+  BOOST_CHECK_EQUAL(c.size(), 2);
+  BOOST_CHECK_EQUAL(*c.get(3), 31);
+  // Expired values are dropped on lookup
+  auto now = clock::now();
+  c.put(4, 40, now + std::chrono::seconds(1));
+  BOOST_CHECK(c.get(4, now));
+  BOOST_CHECK(!c.get(4, now + std::chrono::seconds(1)));
+  BOOST_CHECK_EQUAL(c.size(), 1);
+  BOOST_CHECK(c.erase(3));
+  BOOST_CHECK(!c.erase(3));
+  lru_cache<int, int> none(0);
+  none.put(1, 10);
+  BOOST_CHECK(!none.get(1));
+}
+
+BOOST_AUTO_TEST_CASE( resolve_cache_reuse ) {
+  boost::asio::io_context io;
+  resolve_cache cache;
+  auto a = cache.resolve(io.get_executor(), "localhost", "22");
+  BOOST_REQUIRE(!a.empty());
+  BOOST_CHECK_EQUAL(cache.size(), 1);
+  BOOST_CHECK(cache.resolve(io.get_executor(), "localhost", "22") == a);
+  boost::asio::ip::tcp::resolver res(io);
+  endpoints_t b;
+  cache.async_resolve(res, "localhost", "22",
+                      [&](const boost::system::error_code& ec,
+                          endpoints_t e) {
+                        BOOST_CHECK(!ec);
+                        b = std::move(e);
+                      });
+  io.run();
+  BOOST_CHECK(b == a);
+  BOOST_CHECK_EQUAL(cache.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE( happy_connect_skips_dead ) {
+  using tcp = boost::asio::ip::tcp;
+  boost::asio::io_context io;
+  auto lo = boost::asio::ip::address_v4::loopback();
+  tcp::acceptor live(io, tcp::endpoint(lo, 0)), dead(io, tcp::endpoint(lo, 0));
+  endpoints_t endpoints{ dead.local_endpoint(), live.local_endpoint() };
+  dead.close();
+  tcp::socket s(io);
+  // The refused attempt must not wait for the stagger delay
+  auto start = std::chrono::steady_clock::now();
+  happy_connect(s, endpoints, std::chrono::seconds(10));
+  BOOST_CHECK(std::chrono::steady_clock::now() - start <
+              std::chrono::seconds(5));
+  BOOST_CHECK(s.remote_endpoint() == live.local_endpoint());
+  BOOST_CHECK_THROW(happy_connect(s, { endpoints[0] }), std::exception);
+
+  auto v6 = tcp::endpoint(boost::asio::ip::address_v6::loopback(), 1);
+  auto v4 = tcp::endpoint(lo, 1);
+  endpoints_t mixed = interleave_families({ v6, v6, v4, v4 });
+  BOOST_CHECK(mixed == endpoints_t({ v6, v4, v6, v4 }));
+}
+
+BOOST_AUTO_TEST_CASE( base64_codec ) {
+  // Every implementation against OpenSSL, over vector blocks and tails
+  std::string data(300, '\0');
+  for (size_t i = 0; i < data.size(); ++i)
+    data[i] = char(i * 167 + (i >> 3));
+  for (auto isa : { base64_isa::scalar, base64_isa::ssse3, base64_isa::avx2 }) {
+    if (base64_select(isa) != isa)
+      continue;
+    for (size_t n = 0; n <= data.size(); ++n) {
+      std::string ref(base64_encoded_size(n) + 1, '\0');
+      ref.resize(EVP_EncodeBlock(reinterpret_cast<unsigned char*>(&ref[0]),
+                                 reinterpret_cast<const unsigned char*>
+                                 (data.data()), int(n)));
+      std::string enc(base64_encoded_size(n), '\0');
+      BOOST_REQUIRE_EQUAL(base64_encode(data.data(), n, &enc[0]), enc.size());
+      BOOST_REQUIRE_EQUAL(enc, ref);
+      std::string dec;
+      BOOST_REQUIRE(base64_decode(enc, dec));
+      BOOST_REQUIRE(dec == data.substr(0, n));
+      if (enc.empty())
+        continue;
+      // Invalid characters are caught wherever they are
+      for (size_t i : { size_t(0), enc.size() / 2, enc.size() - 3 }) {
+        std::string bad = enc;
+        bad[i] = i % 2 ? '\x80' : '-';
+        BOOST_CHECK(!base64_decode(bad, dec));
+      }
+    }
+  }
+  base64_select(base64_isa::avx2);
+  std::string dec;
+  BOOST_CHECK(base64_decode("Zm9vYg", dec) && dec == "foob");
+  BOOST_CHECK(!base64_decode("Zm9vY", dec));
+  BOOST_CHECK(!base64_decode("Zm9v===", dec));
+  std::ostringstream out;
+  out << base64dump(std::string_view("foobar"));
+  BOOST_CHECK_EQUAL(out.str(), "Zm9vYmFy");
+}
+
+BOOST_AUTO_TEST_CASE( log_levels ) {
+  int evaluated = 0;
+  auto arg = [&evaluated] { return ++evaluated; };
+  log_level saved = log_level(log_runtime_level.load());
+  log_set_level(log_level::info);
+  // Arguments of skipped statements are not evaluated
+  LOG(debug) << arg();
+  BOOST_CHECK_EQUAL(evaluated, 0);
+  // One statement under an unbraced if: the else is not taken by LOG
+  bool other = false;
+  if (evaluated)
+    LOG(info) << arg();
+  else
+    other = true;
+  BOOST_CHECK(other);
+  BOOST_CHECK_EQUAL(evaluated, 0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t)
+    threads.emplace_back([t] {
+      LOG(info) << "log_levels test, thread " << t;
+    });
+  for (auto& t : threads)
+    t.join();
+  LOG(info) << "log_levels test, " << std::string(1000, 'x');
+  log_flush();
+  log_set_level(saved);
+}
@@ -0,0 +1,89 @@
+#include <cstring>
+#include <utility>
+#if defined __aarch64__ && defined __linux__
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+#include "methods.hpp"
+#include "ssh.hpp"
+#include "test.hpp"
+
+#include "log.hpp"
+
+namespace {
+
+// Elliptic curves first, then finite field groups by size: a group
+// exchange costs a round trip and the server usually picks a large group.
+// SHA-1 ones come last, only for servers offering nothing else.
+const char kex_fast[] =
+  "curve25519-sha256,curve25519-sha256@libssh.org,"
+  "ecdh-sha2-nistp256,ecdh-sha2-nistp384,ecdh-sha2-nistp521,"
+  "diffie-hellman-group14-sha256,diffie-hellman-group-exchange-sha256,"
+  "diffie-hellman-group16-sha512,diffie-hellman-group18-sha512,"
+  "diffie-hellman-group14-sha1,diffie-hellman-group-exchange-sha1,"
+  "diffie-hellman-group1-sha1";
+
+// AEAD ciphers need no MAC; AES-GCM is the fastest with AES instructions,
+// ChaCha20-Poly1305 without
+const char crypt_aes[] =
+  "aes128-gcm@openssh.com,aes256-gcm@openssh.com,"
+  "chacha20-poly1305@openssh.com,aes128-ctr,aes192-ctr,aes256-ctr,"
+  "aes256-cbc,rijndael-cbc@lysator.liu.se,aes192-cbc,aes128-cbc,"
+  "blowfish-cbc,arcfour128,arcfour,cast128-cbc,3des-cbc";
+const char crypt_chacha[] =
+  "chacha20-poly1305@openssh.com,aes128-ctr,aes192-ctr,aes256-ctr,"
+  "aes128-gcm@openssh.com,aes256-gcm@openssh.com,"
+  "aes256-cbc,rijndael-cbc@lysator.liu.se,aes192-cbc,aes128-cbc,"
+  "blowfish-cbc,arcfour128,arcfour,cast128-cbc,3des-cbc";
+
+// Encrypt-then-MAC first: the MAC check comes before any decryption
+const char mac_etm[] =
+  "hmac-sha2-256-etm@openssh.com,hmac-sha2-512-etm@openssh.com,"
+  "hmac-sha1-etm@openssh.com,hmac-sha2-256,hmac-sha2-512,hmac-sha1,"
+  "hmac-sha1-96,hmac-md5,hmac-md5-96,hmac-ripemd160,"
+  "hmac-ripemd160@openssh.com";
+
+}
+
+bool cpu_fast_aes_gcm() {
+#if defined __x86_64__ || defined __i386__
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul");
+#elif defined __aarch64__ && defined __linux__
+  unsigned long hw = getauxval(AT_HWCAP);
+  return (hw & HWCAP_AES) && (hw & HWCAP_PMULL);
+#else
+  return false;
+#endif
+}
+
+method_prefs method_profile(std::string_view name) {
+  if (name == "default")
+    return {};
+  if (name == "fastest-handshake")
+    return { kex_fast, "", "" };
+  if (name == "max-throughput")
+    return { "", crypt_aes, mac_etm };
+  if (name == "auto") {
+    // Once: the CPU does not change
+    static const bool aes = cpu_fast_aes_gcm();
+    return { kex_fast, aes ? crypt_aes : crypt_chacha, mac_etm };
+  }
+  THROW("Unknown method profile " + std::string(name));
+}
+
+void set_method_prefs(LIBSSH2_SESSION *session, const method_prefs& prefs) {
+  const std::pair<int, const std::string*> lists[] = {
+    { LIBSSH2_METHOD_KEX, &prefs.kex },
+    { LIBSSH2_METHOD_CRYPT_CS, &prefs.crypt },
+    { LIBSSH2_METHOD_CRYPT_SC, &prefs.crypt },
+    { LIBSSH2_METHOD_MAC_CS, &prefs.mac },
+    { LIBSSH2_METHOD_MAC_SC, &prefs.mac } };
+  for (const auto& l : lists) {
+    if (l.second->empty())
+      continue;
+    if (libssh2_session_method_pref(session, l.first, l.second->c_str()))
+      THROW("No supported method in " + *l.second + ssh2_err(session));
+  }
+}
@@ -0,0 +1,31 @@
+#if !defined TEST_METHODS_HPP_INCLUDED
+#define TEST_METHODS_HPP_INCLUDED
+
+#include <string>
+#include <string_view>
+#include <libssh2.h>
+
+// Algorithms offered during key exchange, as comma-separated lists in
+// order of preference; an empty list keeps libssh2's own
+struct method_prefs {
+  std::string kex, crypt, mac;
+};
+
+// Named preference profiles:
+// - "default": libssh2's order
+// - "fastest-handshake": cheapest key exchanges first
+// - "max-throughput": AES-GCM first, for CPUs with AES instructions
+// - "auto": cheap key exchange, and the fastest ciphers for this CPU
+// Each profile only reorders: every algorithm of libssh2's default is
+// still offered. Throws on an unknown name.
+method_prefs method_profile(std::string_view name);
+
+// AES and carry-less multiplication in hardware: AES-GCM is then faster
+// than ChaCha20-Poly1305
+bool cpu_fast_aes_gcm();
+
+// Apply prefs to session, before the handshake. Names libssh2 does not
+// support are ignored; throws if none of a list is supported.
+void set_method_prefs(LIBSSH2_SESSION *session, const method_prefs& prefs);
+
+#endif// TEST_METHODS_HPP_INCLUDED
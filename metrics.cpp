@@ -0,0 +1,274 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <vector>
+#include <libssh2.h>
+
+#include "metrics.hpp"
+#include "ssh.hpp"
+
+namespace {
+
+const size_t phase_count = size_t(phase::count);
+
+// Log-linear buckets: 16 per power of two, i.e. within ~6% of the value
+const int sub_bits = 4;
+const size_t sub_count = 1 << sub_bits;
+const size_t bucket_count = (64 - sub_bits + 1) * sub_count;
+
+size_t bucket_of(uint64_t v) {
+  if (v < sub_count)
+    return v;
+  int msb = 63 - __builtin_clzll(v);
+  int shift = msb - sub_bits;
+  return (shift + 1) * sub_count + ((v >> shift) & (sub_count - 1));
+}
+
+// Smallest value falling into bucket i
+uint64_t bucket_floor(size_t i) {
+  if (i < sub_count)
+    return i;
+  int shift = int(i / sub_count) - 1;
+  return (sub_count + i % sub_count) << shift;
+}
+
+// Updated by its owning thread only: plain loads and stores suffice, the
+// atomics only make concurrent exports well defined
+struct histogram {
+  std::array<std::atomic<uint64_t>, bucket_count> buckets{};
+  std::atomic<uint64_t> count{ 0 }, sum{ 0 }, max{ 0 };
+
+  static void bump(std::atomic<uint64_t>& a, uint64_t by) {
+    a.store(a.load(std::memory_order_relaxed) + by,
+            std::memory_order_relaxed);
+  }
+
+  void record(uint64_t v) {
+    bump(buckets[bucket_of(v)], 1);
+    bump(count, 1);
+    bump(sum, v);
+    if (v > max.load(std::memory_order_relaxed))
+      max.store(v, std::memory_order_relaxed);
+  }
+};
+
+// libssh2 error codes are small negative numbers; others share a slot
+const int rc_slots = 64;
+
+struct thread_metrics {
+  histogram phases[phase_count];
+  std::array<std::atomic<uint64_t>, rc_slots + 1> rcs{};
+  // value of reset_epoch these counts were started at
+  std::atomic<uint64_t> epoch{ 0 };
+};
+
+void clear(thread_metrics& tm) {
+  for (auto& h : tm.phases) {
+    for (auto& b : h.buckets)
+      b.store(0, std::memory_order_relaxed);
+    h.count.store(0, std::memory_order_relaxed);
+    h.sum.store(0, std::memory_order_relaxed);
+    h.max.store(0, std::memory_order_relaxed);
+  }
+  for (auto& rc : tm.rcs)
+    rc.store(0, std::memory_order_relaxed);
+}
+
+// Bumped by metrics_reset(): each thread zeroes its own counts when it
+// sees the change, as only the owner may write them. Until then its
+// counts are left out.
+std::atomic<uint64_t> reset_epoch{ 0 };
+
+std::mutex registry_m;
+// Live threads' metrics
+std::vector<thread_metrics*> registry;
+// Folded from threads that exited, so no sample is lost
+thread_metrics retired;
+
+void fold(thread_metrics& to, const thread_metrics& from) {
+  for (size_t p = 0; p < phase_count; ++p) {
+    histogram& t = to.phases[p];
+    const histogram& f = from.phases[p];
+    for (size_t i = 0; i < bucket_count; ++i)
+      histogram::bump(t.buckets[i],
+                      f.buckets[i].load(std::memory_order_relaxed));
+    histogram::bump(t.count, f.count.load(std::memory_order_relaxed));
+    histogram::bump(t.sum, f.sum.load(std::memory_order_relaxed));
+    uint64_t max = f.max.load(std::memory_order_relaxed);
+    if (max > t.max.load(std::memory_order_relaxed))
+      t.max.store(max, std::memory_order_relaxed);
+  }
+  for (int i = 0; i <= rc_slots; ++i)
+    histogram::bump(to.rcs[i], from.rcs[i].load(std::memory_order_relaxed));
+}
+
+// A thread's metrics, registered while it runs
+struct local_metrics {
+  thread_metrics m;
+  local_metrics() {
+    std::lock_guard _lock(registry_m);
+    registry.push_back(&m);
+  }
+  ~local_metrics() {
+    std::lock_guard _lock(registry_m);
+    if (m.epoch.load(std::memory_order_relaxed) ==
+        reset_epoch.load(std::memory_order_relaxed))
+      fold(retired, m);
+    registry.erase(std::find(registry.begin(), registry.end(), &m));
+  }
+};
+
+thread_metrics& local() {
+  thread_local local_metrics lm;
+  uint64_t epoch = reset_epoch.load(std::memory_order_acquire);
+  if (lm.m.epoch.load(std::memory_order_relaxed) != epoch) {
+    clear(lm.m);
+    // Published after the zeroes, for collect()
+    lm.m.epoch.store(epoch, std::memory_order_release);
+  }
+  return lm.m;
+}
+
+struct summary {
+  uint64_t count = 0, sum = 0, max = 0;
+  std::vector<uint64_t> buckets = std::vector<uint64_t>(bucket_count);
+
+  uint64_t quantile(double q) const {
+    uint64_t rank = uint64_t(q * count), seen = 0;
+    for (size_t i = 0; i < bucket_count; ++i) {
+      seen += buckets[i];
+      if (seen > rank)
+        return std::min(bucket_floor(i + 1) - 1, max);
+    }
+    return max;
+  }
+};
+
+// Merge all threads' metrics
+void collect(std::vector<summary>& phases, std::vector<uint64_t>& rcs) {
+  phases.assign(phase_count, summary{});
+  rcs.assign(rc_slots + 1, 0);
+  auto add = [&](const thread_metrics& tm) {
+    for (size_t p = 0; p < phase_count; ++p) {
+      const histogram& h = tm.phases[p];
+      summary& s = phases[p];
+      s.count += h.count.load(std::memory_order_relaxed);
+      s.sum += h.sum.load(std::memory_order_relaxed);
+      s.max = std::max(s.max, h.max.load(std::memory_order_relaxed));
+      for (size_t i = 0; i < bucket_count; ++i)
+        s.buckets[i] += h.buckets[i].load(std::memory_order_relaxed);
+    }
+    for (int i = 0; i <= rc_slots; ++i)
+      rcs[i] += tm.rcs[i].load(std::memory_order_relaxed);
+  };
+  std::lock_guard _lock(registry_m);
+  add(retired);
+  uint64_t epoch = reset_epoch.load(std::memory_order_relaxed);
+  for (const thread_metrics* tm : registry)
+    if (tm->epoch.load(std::memory_order_acquire) == epoch)
+      add(*tm);
+}
+
+std::string rc_label(int slot) {
+  return slot == rc_slots ? "other" : known_retvals(-slot);
+}
+
+const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+// Dump metrics at exit when asked to through SSH_METRICS
+struct exit_dump {
+  exit_dump() {
+    if (getenv("SSH_METRICS"))
+      std::atexit([] {
+        std::string fn = getenv("SSH_METRICS");
+        bool prom = fn.size() > 5 && fn.compare(fn.size() - 5, 5, ".prom") == 0;
+        std::ofstream(fn) << (prom ? metrics_prometheus() : metrics_json());
+      });
+  }
+} exit_dump_instance;
+
+}
+
+const char* phase_name(phase p) {
+  switch (p) {
+    case phase::resolve: return "resolve";
+    case phase::connect: return "connect";
+    case phase::handshake: return "handshake";
+    case phase::hostkey: return "hostkey";
+    case phase::auth: return "auth";
+    default: break;
+  }
+  return "unknown";
+}
+
+void record_phase(phase p, std::chrono::nanoseconds d) {
+  local().phases[size_t(p)].record(uint64_t(std::max<int64_t>(d.count(), 0)));
+}
+
+void record_rc(int rc) {
+  int slot = rc <= 0 && -rc < rc_slots ? -rc : rc_slots;
+  histogram::bump(local().rcs[slot], 1);
+}
+
+std::string metrics_json() {
+  std::vector<summary> phases;
+  std::vector<uint64_t> rcs;
+  collect(phases, rcs);
+  std::ostringstream out;
+  out << "{\"phases\":{";
+  for (size_t p = 0; p < phase_count; ++p) {
+    const summary& s = phases[p];
+    out << (p ? "," : "") << '"' << phase_name(phase(p)) << "\":{"
+        << "\"count\":" << s.count << ",\"sum_ns\":" << s.sum
+        << ",\"max_ns\":" << s.max;
+    for (double q : quantiles)
+      out << ",\"p" << q * 100 << "_ns\":" << s.quantile(q);
+    out << '}';
+  }
+  out << "},\"rc\":{";
+  bool first = true;
+  for (int i = 0; i <= rc_slots; ++i) {
+    if (!rcs[i])
+      continue;
+    out << (first ? "" : ",") << '"' << rc_label(i) << "\":" << rcs[i];
+    first = false;
+  }
+  out << "}}\n";
+  return out.str();
+}
+
+std::string metrics_prometheus() {
+  std::vector<summary> phases;
+  std::vector<uint64_t> rcs;
+  collect(phases, rcs);
+  std::ostringstream out;
+  out << "# HELP ssh_phase_seconds Latency of session setup phases\n"
+      << "# TYPE ssh_phase_seconds summary\n";
+  for (size_t p = 0; p < phase_count; ++p) {
+    const summary& s = phases[p];
+    const char* name = phase_name(phase(p));
+    for (double q : quantiles)
+      out << "ssh_phase_seconds{phase=\"" << name << "\",quantile=\"" << q
+          << "\"} " << s.quantile(q) / 1e9 << '\n';
+    out << "ssh_phase_seconds_sum{phase=\"" << name << "\"} " << s.sum / 1e9
+        << '\n'
+        << "ssh_phase_seconds_count{phase=\"" << name << "\"} " << s.count
+        << '\n';
+  }
+  out << "# HELP ssh_rc_total libssh2 return codes\n"
+      << "# TYPE ssh_rc_total counter\n";
+  for (int i = 0; i <= rc_slots; ++i)
+    if (rcs[i])
+      out << "ssh_rc_total{rc=\"" << rc_label(i) << "\"} " << rcs[i] << '\n';
+  return out.str();
+}
+
+void metrics_reset() {
+  std::lock_guard _lock(registry_m);
+  clear(retired);
+  reset_epoch.fetch_add(1, std::memory_order_release);
+}
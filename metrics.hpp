@@ -0,0 +1,53 @@
+#if !defined TEST_METRICS_HPP_INCLUDED
+#define TEST_METRICS_HPP_INCLUDED
+
+#include <chrono>
+#include <string>
+
+// Stages of connecting and authenticating a session
+enum class phase { resolve, connect, handshake, hostkey, auth, count };
+
+const char* phase_name(phase p);
+
+// Add a sample to the phase latency histogram. Samples go to per-thread
+// histograms without locking; exports merge them.
+void record_phase(phase p, std::chrono::nanoseconds d);
+// Count a libssh2 return code
+void record_rc(int rc);
+
+// Record the time since start as phase p, then restart from now
+inline void record_since(phase p, std::chrono::steady_clock::time_point& start) {
+  auto now = std::chrono::steady_clock::now();
+  record_phase(p, now - start);
+  start = now;
+}
+
+// Time a phase while in scope
+class phase_timer {
+  phase p;
+  std::chrono::steady_clock::time_point start;
+  bool done = false;
+public:
+  explicit phase_timer(phase p_)
+    : p(p_), start(std::chrono::steady_clock::now()) {}
+  phase_timer(const phase_timer&) = delete;
+  ~phase_timer() { stop(); }
+  void stop() {
+    if (!done)
+      record_since(p, start);
+    done = true;
+  }
+};
+
+// Count, sum, max and percentiles per phase, plus rc counters
+std::string metrics_json();
+std::string metrics_prometheus();
+// Forget everything recorded so far. Safe while sessions run: each thread
+// zeroes its own counts on its next sample, and exports leave them out
+// until then.
+void metrics_reset();
+
+// If SSH_METRICS names a file, metrics are written there at exit, as
+// Prometheus text if it ends in ".prom", as JSON otherwise
+
+#endif// TEST_METRICS_HPP_INCLUDED
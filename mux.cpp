@@ -0,0 +1,480 @@
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mux.hpp"
+#include "test.hpp"
+#include "utils.hpp"
+
+#include "log.hpp"
+
+using protocol = boost::asio::local::stream_protocol;
+
+namespace {
+
+// Frames are a 4-byte big-endian length followed by the body. A body is a
+// list of fields, each a 4-byte big-endian length and its bytes; numbers
+// are sent as decimal text.
+const size_t max_frame = 256 << 20;
+
+void put_u32(char* to, uint32_t n) {
+  to[0] = char(n >> 24);
+  to[1] = char(n >> 16);
+  to[2] = char(n >> 8);
+  to[3] = char(n);
+}
+
+uint32_t get_u32(const char* from) {
+  auto u = reinterpret_cast<const unsigned char*>(from);
+  return uint32_t(u[0]) << 24 | uint32_t(u[1]) << 16 |
+    uint32_t(u[2]) << 8 | uint32_t(u[3]);
+}
+
+struct writer {
+  std::string buf;
+  void str(std::string_view f) {
+    char len[4];
+    put_u32(len, uint32_t(f.size()));
+    buf.append(len, 4);
+    buf.append(f);
+  }
+  void num(int64_t n) { str(std::to_string(n)); }
+};
+
+// Throws on a malformed body
+struct reader {
+  std::string_view rest;
+  explicit reader(std::string_view body) : rest(body) {}
+  std::string_view str() {
+    if (rest.size() < 4)
+      THROW("Malformed mux message");
+    size_t len = get_u32(rest.data());
+    if (rest.size() - 4 < len)
+      THROW("Malformed mux message");
+    std::string_view f = rest.substr(4, len);
+    rest.remove_prefix(4 + len);
+    return f;
+  }
+  int64_t num() {
+    std::string_view f = str();
+    int64_t n;
+    auto [end, ec] = std::from_chars(f.data(), f.data() + f.size(), n);
+    if (ec != std::errc() || end != f.data() + f.size())
+      THROW("Malformed mux message");
+    return n;
+  }
+  size_t unum() {
+    int64_t n = num();
+    if (n < 0)
+      THROW("Malformed mux message");
+    return size_t(n);
+  }
+  // Element count of a list, each element taking at least one field
+  size_t count() {
+    size_t n = unum();
+    if (n > rest.size() / 4)
+      THROW("Malformed mux message");
+    return n;
+  }
+};
+
+std::string read_frame(protocol::socket& s) {
+  char len[4];
+  boost::asio::read(s, boost::asio::buffer(len));
+  size_t n = get_u32(len);
+  if (n > max_frame)
+    THROW("mux frame too large: " + std::to_string(n));
+  std::string body(n, '\0');
+  boost::asio::read(s, boost::asio::buffer(body));
+  return body;
+}
+
+void write_frame(protocol::socket& s, const std::string& body) {
+  char len[4];
+  put_u32(len, uint32_t(body.size()));
+  std::array<boost::asio::const_buffer, 2> bufs{
+    boost::asio::buffer(len), boost::asio::buffer(body) };
+  boost::asio::write(s, bufs);
+}
+
+// Local paths are sent absolute: the daemon has its own working directory
+std::string absolute(const std::string& path) {
+  return boost::filesystem::absolute(path).string();
+}
+
+void put_target(writer& w, const mux_target& t) {
+  w.str(t.host);
+  w.str(t.port);
+  w.str(t.username);
+  w.str(absolute(t.pubkey_file));
+  w.str(absolute(t.privkey_file));
+  w.num(t.keypass.has_value());
+  w.str(t.keypass.value_or(""));
+}
+
+mux_target get_target(reader& r) {
+  mux_target t;
+  t.host = r.str();
+  t.port = r.str();
+  t.username = r.str();
+  t.pubkey_file = r.str();
+  t.privkey_file = r.str();
+  bool has_pass = r.num();
+  std::string_view pass = r.str();
+  if (has_pass)
+    t.keypass = std::string(pass);
+  return t;
+}
+
+// Uid of the process at the other end of a connected Unix socket
+uid_t peer_uid(int fd) {
+#if defined SO_PEERCRED
+  ucred cred;
+  socklen_t len = sizeof(cred);
+  if (::getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+    THROW(std::string("Cannot get mux peer credentials: ") + strerror(errno));
+  return cred.uid;
+#else
+  uid_t uid;
+  gid_t gid;
+  if (::getpeereid(fd, &uid, &gid))
+    THROW(std::string("Cannot get mux peer credentials: ") + strerror(errno));
+  return uid;
+#endif
+}
+
+// The connection under the session is gone
+bool transport_failed(LIBSSH2_SESSION *session) {
+  switch (libssh2_session_last_errno(session)) {
+    case LIBSSH2_ERROR_SOCKET_SEND:
+    case LIBSSH2_ERROR_SOCKET_RECV:
+    case LIBSSH2_ERROR_SOCKET_DISCONNECT:
+    case LIBSSH2_ERROR_SOCKET_TIMEOUT:
+      return true;
+    default:
+      return false;
+  }
+}
+
+}
+
+std::string mux_default_socket() {
+  if (const char* dir = getenv("XDG_RUNTIME_DIR"))
+    return (boost::filesystem::path(dir) / "test-libssh2-mux.sock").string();
+  // The temporary directory is shared: anyone could have created the path
+  // first, so it is only used if it is a directory of ours, closed to
+  // others
+  auto dir = boost::filesystem::temp_directory_path() /
+    ("test-libssh2-mux-" + std::to_string(getuid()));
+  if (::mkdir(dir.c_str(), 0700) && errno != EEXIST)
+    THROW("Cannot create " + dir.string() + ": " + strerror(errno));
+  struct stat st;
+  if (::lstat(dir.c_str(), &st))
+    THROW("Cannot stat " + dir.string() + ": " + strerror(errno));
+  if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077))
+    THROW(dir.string() + " is not a private directory of the current user");
+  return (dir / "mux.sock").string();
+}
+
+mux_server::mux_server(const options& o)
+  : opts(o), sessions(o.pool), acceptor(io), timer(io) {
+  if (opts.socket.empty())
+    opts.socket = mux_default_socket();
+  protocol::endpoint ep(opts.socket);
+  boost::system::error_code ec;
+  {
+    protocol::socket probe(io);
+    probe.connect(ep, ec);
+    if (!ec)
+      THROW("A mux daemon already listens on " + opts.socket);
+  }
+  // Only a socket is ours to replace: the path may be a typo for a file
+  struct stat st;
+  if (!::lstat(opts.socket.c_str(), &st)) {
+    if (!S_ISSOCK(st.st_mode))
+      THROW(opts.socket + " exists and is not a socket");
+    ::unlink(opts.socket.c_str());
+  }
+  acceptor.open(ep.protocol());
+  // Created with no access for others, rather than restricted afterwards
+  mode_t mask = ::umask(0177);
+  acceptor.bind(ep, ec);
+  ::umask(mask);
+  if (ec)
+    THROW("Cannot listen on " + opts.socket + ": " + ec.message());
+  acceptor.listen();
+  LOG(info) << "mux daemon listening on " << opts.socket;
+}
+
+mux_server::~mux_server() {
+  stop();
+  {
+    // Requests in progress run to completion
+    std::unique_lock _lock(m);
+    cv.wait(_lock, [this] { return clients.empty(); });
+  }
+  ::unlink(opts.socket.c_str());
+}
+
+void mux_server::run() {
+  accept();
+  maintain();
+  io.run();
+}
+
+void mux_server::stop() {
+  {
+    std::lock_guard _lock(m);
+    stopping = true;
+    // Wakes up the threads waiting for requests
+    for (int fd : clients)
+      ::shutdown(fd, SHUT_RDWR);
+  }
+  boost::asio::post(io, [this] {
+    boost::system::error_code ec;
+    acceptor.close(ec);
+    timer.cancel();
+  });
+}
+
+void mux_server::accept() {
+  acceptor.async_accept([this](const boost::system::error_code& ec,
+                               protocol::socket s) {
+    if (ec == boost::asio::error::operation_aborted)
+      return;
+    if (ec) {
+      LOG(warning) << "mux accept failed: " << ec.message();
+    } else {
+      std::lock_guard _lock(m);
+      if (stopping)
+        return;
+      // Each client thread runs its socket on an io_context of its own
+      int fd = s.release();
+      clients.insert(fd);
+      std::thread([this, fd] { serve(fd); }).detach();
+    }
+    accept();
+  });
+}
+
+void mux_server::maintain() {
+  timer.expires_after(opts.maintain_every);
+  timer.async_wait([this](const boost::system::error_code& ec) {
+    if (ec)
+      return;
+    sessions.maintain();
+    maintain();
+  });
+}
+
+void mux_server::serve(int fd) {
+  boost::asio::io_context cio;
+  protocol::socket s(cio, protocol(), fd);
+  try {
+    // Requests carry passphrases and run as the daemon's user
+    uid_t uid = peer_uid(fd);
+    if (uid != getuid())
+      THROW("mux client of uid " + std::to_string(uid) + " refused");
+    for (;;)
+      write_frame(s, handle(read_frame(s)));
+  } catch (const boost::system::system_error& e) {
+    if (e.code() != boost::asio::error::eof)
+      LOG(debug) << "mux client dropped: " << e.what();
+  } catch (const std::exception& e) {
+    LOG(debug) << "mux client dropped: " << e.what();
+  }
+  std::lock_guard _lock(m);
+  clients.erase(fd);
+  // Closed under the lock: stop() must not shut down a reused descriptor
+  boost::system::error_code ec;
+  s.close(ec);
+  cv.notify_all();
+}
+
+std::string mux_server::handle(const std::string& request) {
+  writer w;
+  try {
+    reader r(request);
+    std::string op(r.str());
+    if (op != "exec" && op != "upload" && op != "download")
+      THROW("Unknown mux request: " + op);
+    mux_target t = get_target(r);
+    remote_t rem = opts.defaults;
+    rem.host = t.host;
+    rem.port = t.port;
+    rem.username = t.username;
+    auto key = key_pair::from_files(t.pubkey_file, t.privkey_file);
+
+    exec_options eo;
+    std::vector<std::string> commands;
+    sftp_options so;
+    std::vector<sftp_transfer> files;
+    if (op == "exec") {
+      eo.max_channels = r.unum();
+      eo.max_output = r.unum();
+      commands.resize(r.count());
+      for (auto& c : commands)
+        c = r.str();
+    } else {
+      so.window = r.unum();
+      if (!so.window)
+        THROW("SFTP window must not be 0");
+      so.parallel = r.unum();
+      so.mode = long(r.num());
+      files.resize(r.count());
+      for (auto& f : files) {
+        f.local = std::string(r.str());
+        f.remote = r.str();
+      }
+    }
+
+    auto lease = sessions.checkout(rem, key,
+                                   t.keypass ? t.keypass->c_str() : nullptr);
+    if (!lease)
+      THROW("Authentication failed: " + known_retvals(lease.rc()));
+    // A session that failed midway is closed rather than pooled
+    bool failed = true;
+    autofn _discard([&] { if (failed) lease.discard(); });
+    w.str("");
+    if (op == "exec") {
+      auto res = exec_commands(lease->session, lease->s, commands, eo);
+      w.num(res.size());
+      for (const auto& e : res) {
+        w.str(e.out);
+        w.str(e.err);
+        w.num(e.truncated);
+        w.num(e.exit_status);
+        w.str(e.exit_signal);
+        w.str(e.error);
+        w.num(e.elapsed.count());
+      }
+    } else {
+      sftp_session sftp(lease->session, lease->s);
+      if (op == "upload")
+        sftp.upload(files, so);
+      else
+        sftp.download(files, so);
+      w.num(files.size());
+      for (const auto& f : files) {
+        w.num(f.bytes);
+        w.str(f.error);
+        w.num(f.elapsed.count());
+      }
+    }
+    failed = transport_failed(lease->session);
+    if (w.buf.size() > max_frame)
+      THROW("mux reply too large: " + std::to_string(w.buf.size()));
+  } catch (const std::exception& e) {
+    w.buf.clear();
+    w.str(e.what());
+  }
+  return std::move(w.buf);
+}
+
+mux_client::mux_client(const std::string& socket) : s(io) {
+  boost::system::error_code ec;
+  s.connect(protocol::endpoint(socket), ec);
+  if (ec)
+    THROW("Cannot reach mux daemon at " + socket + ": " + ec.message());
+  // Checked before any passphrase is sent
+  uid_t uid = peer_uid(s.native_handle());
+  if (uid != getuid())
+    THROW("mux daemon at " + socket + " runs as uid " + std::to_string(uid));
+}
+
+std::string mux_client::call(const std::string& request) {
+  write_frame(s, request);
+  std::string reply = read_frame(s);
+  reader r(reply);
+  std::string_view error = r.str();
+  if (!error.empty())
+    THROW(std::string{ error });
+  return reply.substr(reply.size() - r.rest.size());
+}
+
+std::vector<exec_result> mux_client::exec(const mux_target& t,
+                                          const std::vector<std::string>&
+                                          commands,
+                                          const exec_options& opts) {
+  writer w;
+  w.str("exec");
+  put_target(w, t);
+  w.num(opts.max_channels);
+  w.num(opts.max_output);
+  w.num(commands.size());
+  for (const auto& c : commands)
+    w.str(c);
+  std::string reply = call(w.buf);
+  reader r(reply);
+  std::vector<exec_result> res(r.count());
+  if (res.size() != commands.size())
+    THROW("Malformed mux message");
+  for (size_t i = 0; i < res.size(); ++i) {
+    exec_result& e = res[i];
+    e.command = commands[i];
+    e.out = r.str();
+    e.err = r.str();
+    e.truncated = r.num();
+    e.exit_status = int(r.num());
+    e.exit_signal = r.str();
+    e.error = r.str();
+    e.elapsed = std::chrono::microseconds(r.num());
+  }
+  return res;
+}
+
+namespace {
+
+size_t read_transfers(const std::string& reply,
+                      std::vector<sftp_transfer>& files) {
+  reader r(reply);
+  if (r.count() != files.size())
+    THROW("Malformed mux message");
+  size_t failed = 0;
+  for (auto& f : files) {
+    f.bytes = uint64_t(r.num());
+    f.error = r.str();
+    f.elapsed = std::chrono::microseconds(r.num());
+    if (!f.error.empty())
+      ++failed;
+  }
+  return failed;
+}
+
+std::string sftp_request(const char* op, const mux_target& t,
+                         const std::vector<sftp_transfer>& files,
+                         const sftp_options& opts) {
+  writer w;
+  w.str(op);
+  put_target(w, t);
+  w.num(opts.window);
+  w.num(opts.parallel);
+  w.num(opts.mode);
+  w.num(files.size());
+  for (const auto& f : files) {
+    w.str(absolute(f.local.string()));
+    w.str(f.remote);
+  }
+  return std::move(w.buf);
+}
+
+}
+
+size_t mux_client::upload(const mux_target& t,
+                          std::vector<sftp_transfer>& files,
+                          const sftp_options& opts) {
+  return read_transfers(call(sftp_request("upload", t, files, opts)),
+                        files);
+}
+
+size_t mux_client::download(const mux_target& t,
+                            std::vector<sftp_transfer>& files,
+                            const sftp_options& opts) {
+  return read_transfers(call(sftp_request("download", t, files, opts)),
+                        files);
+}
@@ -0,0 +1,101 @@
+#if !defined TEST_MUX_HPP_INCLUDED
+#define TEST_MUX_HPP_INCLUDED
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+
+#include "exec.hpp"
+#include "pool.hpp"
+#include "sftp.hpp"
+
+// Who to run a request as. The daemon reads the key files itself.
+struct mux_target {
+  std::string host, port = "22", username;
+  std::string pubkey_file, privkey_file;
+  std::optional<std::string> keypass;
+};
+
+// Default daemon socket: $XDG_RUNTIME_DIR/test-libssh2-mux.sock, or
+// mux.sock in a per-user directory of the temporary directory, created
+// with mode 0700. Throws if that directory exists but is not private to the
+// current user.
+std::string mux_default_socket();
+
+// Long-running holder of authenticated sessions (session_pool), serving
+// exec and SFTP requests from local clients over a Unix-domain socket.
+// Each client connection is served by a thread of its own; requests on it
+// run one after the other, on a session checked out for the request.
+class mux_server {
+public:
+  struct options {
+    // empty for mux_default_socket()
+    std::string socket;
+    session_pool::options pool;
+    // host checks, timeouts and methods of every session
+    remote_t defaults{ nullptr, nullptr, nullptr };
+    // interval between session_pool::maintain() runs
+    std::chrono::seconds maintain_every{ 10 };
+  };
+
+  // Listen on opts.socket, accessible to the current user only. Throws if
+  // another daemon answers there, or if something other than a socket is
+  // in the way; a stale socket file is replaced.
+  explicit mux_server(const options& opts);
+  mux_server(const mux_server&) = delete;
+  // Disconnects remaining clients and removes the socket file
+  ~mux_server();
+
+  // Serve until stop()
+  void run();
+  // Stop accepting and disconnect clients; safe from any thread
+  void stop();
+
+  const session_pool& pool() const { return sessions; }
+
+private:
+  void accept();
+  void maintain();
+  // Serve one client until it disconnects
+  void serve(int fd);
+  std::string handle(const std::string& request);
+
+  options opts;
+  session_pool sessions;
+  boost::asio::io_context io;
+  boost::asio::local::stream_protocol::acceptor acceptor;
+  boost::asio::steady_timer timer;
+  std::mutex m;
+  std::condition_variable cv;
+  // descriptors of connected clients, shut down by stop()
+  std::set<int> clients;
+  bool stopping = false;
+};
+
+// Client of a mux_server: each call is one round-trip over the socket,
+// the daemon reusing an authenticated session when it has one. Calls
+// throw when the daemon is unreachable or cannot authenticate. Both ends
+// refuse a peer running as another user.
+class mux_client {
+  boost::asio::io_context io;
+  boost::asio::local::stream_protocol::socket s;
+  std::string call(const std::string& request);
+public:
+  explicit mux_client(const std::string& socket = mux_default_socket());
+
+  std::vector<exec_result> exec(const mux_target& t,
+                                const std::vector<std::string>& commands,
+                                const exec_options& opts = exec_options());
+  // Same as sftp_session, see there
+  size_t upload(const mux_target& t, std::vector<sftp_transfer>& files,
+                const sftp_options& opts = sftp_options());
+  size_t download(const mux_target& t, std::vector<sftp_transfer>& files,
+                  const sftp_options& opts = sftp_options());
+};
+
+#endif// TEST_MUX_HPP_INCLUDED
@@ -0,0 +1,142 @@
+// Session-multiplexing daemon, and a client running requests through it:
+//   Mux serve [-s socket] [-n sessions_per_host] [-i idle_seconds]
+//             [-t seconds] [-m profile]
+//   Mux exec [-s socket] [-u user] [-p port] pubkey_file privkey_file
+//            [user@]host[:port] command...
+//   Mux put|get [-s socket] [-u user] [-p port] pubkey_file privkey_file
+//               [user@]host[:port] local_file remote_file
+// serve runs in the foreground until SIGINT or SIGTERM. Clients pass the
+// key passphrase, if any, from KEY_PASS; exec prints each command's
+// output in turn and exits with the highest exit status.
+#include <algorithm>
+#include <csignal>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include "batch.hpp"
+#include "log.hpp"
+#include "mux.hpp"
+
+static int usage(const char* argv0) {
+  std::cerr << "usage: " << argv0 << " serve [-s socket]"
+            << " [-n sessions_per_host] [-i idle_seconds] [-t seconds]"
+            << " [-m profile]" << std::endl
+            << "       " << argv0 << " exec|put|get [-s socket] [-u user]"
+            << " [-p port] pubkey_file privkey_file [user@]host[:port]"
+            << " command...|local_file remote_file" << std::endl;
+  return 2;
+}
+
+static int serve(mux_server::options& opts) {
+  signal(SIGPIPE, SIG_IGN);
+  mux_server server(opts);
+  boost::asio::io_context sig_io;
+  boost::asio::signal_set signals(sig_io, SIGINT, SIGTERM);
+  signals.async_wait([&server](const boost::system::error_code& ec, int) {
+    if (!ec)
+      server.stop();
+  });
+  std::thread sig_thread([&sig_io] { sig_io.run(); });
+  server.run();
+  sig_io.stop();
+  sig_thread.join();
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  log_set_level(getenv("TRACE") ? log_level::trace :
+                getenv("DEBUG") ? log_level::debug : log_level::warning);
+  if (argc < 2)
+    return usage(argv[0]);
+  std::string cmd = argv[1];
+
+  try {
+    mux_server::options opts;
+    remote_t defaults(nullptr, nullptr, getenv("USER"));
+    opts.defaults.check_host = !getenv("NO_HOST_CHECK");
+    const char* profile = "auto";
+    std::vector<const char*> args;
+    for (int i = 2; i < argc; ++i) {
+      std::string a = argv[i];
+      // Options come first, the command may have its own
+      if (args.empty() && a.size() == 2 && a[0] == '-' && i + 1 < argc) {
+        switch (a[1]) {
+          case 's': opts.socket = argv[++i]; continue;
+          case 'n': opts.pool.max_per_host = std::stoul(argv[++i]); continue;
+          case 'i':
+            opts.pool.idle_timeout =
+              std::chrono::seconds(std::stoul(argv[++i]));
+            continue;
+          case 't':
+            opts.defaults.timeouts.total =
+              std::chrono::seconds(std::stoul(argv[++i]));
+            continue;
+          case 'm': profile = argv[++i]; continue;
+          case 'u': defaults.username = argv[++i]; continue;
+          case 'p': defaults.port = argv[++i]; continue;
+          default: return usage(argv[0]);
+        }
+      }
+      args.push_back(argv[i]);
+    }
+
+    if (cmd == "serve") {
+      if (!args.empty())
+        return usage(argv[0]);
+      opts.defaults.methods = method_profile(profile);
+      return serve(opts);
+    }
+    bool exec = cmd == "exec";
+    if ((!exec && cmd != "put" && cmd != "get") ||
+        args.size() < 4 || (!exec && args.size() != 5))
+      return usage(argv[0]);
+
+    std::istringstream in(args[2]);
+    auto hosts = read_hosts(in, defaults);
+    if (hosts.size() != 1)
+      return usage(argv[0]);
+    mux_target t;
+    t.host = hosts[0].host;
+    t.port = hosts[0].port;
+    t.username = hosts[0].username;
+    t.pubkey_file = args[0];
+    t.privkey_file = args[1];
+    if (const char* pass = getenv("KEY_PASS"))
+      t.keypass = pass;
+
+    mux_client client(opts.socket.empty() ? mux_default_socket() :
+                      opts.socket);
+    if (exec) {
+      auto res = client.exec(t, std::vector<std::string>(args.begin() + 3,
+                                                         args.end()));
+      int status = 0;
+      for (const auto& r : res) {
+        std::cout << r.out << std::flush;
+        std::cerr << r.err;
+        if (!r.error.empty()) {
+          std::cerr << r.command << ": " << r.error << std::endl;
+          status = 255;
+        } else if (!r.exit_signal.empty()) {
+          std::cerr << r.command << ": killed by " << r.exit_signal
+                    << std::endl;
+          status = 255;
+        }
+        status = std::max(status, r.exit_status);
+      }
+      return status;
+    }
+    std::vector<sftp_transfer> files(1);
+    bool put = cmd == "put";
+    files[0].local = args[put ? 3 : 4];
+    files[0].remote = args[put ? 4 : 3];
+    if (put ? client.upload(t, files) : client.download(t, files)) {
+      std::cerr << files[0].error << std::endl;
+      return 1;
+    }
+    return 0;
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 2;
+  }
+}
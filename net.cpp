@@ -0,0 +1,280 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <netinet/tcp.h>
+
+#include "deadline.hpp"
+#include "net.hpp"
+#include "test.hpp"
+#include "utils.hpp"
+
+#include "log.hpp"
+
+using tcp = boost::asio::ip::tcp;
+
+resolve_cache::resolve_cache() : resolve_cache(options{}) {}
+
+resolve_cache::resolve_cache(const options& o)
+  : opts(o), entries(o.capacity) {}
+
+bool resolve_cache::lookup(const std::string& key, endpoints_t& out) {
+  std::lock_guard _lock(m);
+  const endpoints_t* e = entries.get(key);
+  if (!e)
+    return false;
+  out = *e;
+  return true;
+}
+
+void resolve_cache::store(std::string key, const endpoints_t& endpoints) {
+  if (endpoints.empty())
+    return;
+  std::lock_guard _lock(m);
+  entries.put(key, endpoints, std::chrono::steady_clock::now() + opts.ttl);
+}
+
+static endpoints_t to_endpoints(const tcp::resolver::results_type& results) {
+  endpoints_t endpoints;
+  for (const auto& r : results)
+    endpoints.push_back(r.endpoint());
+  return interleave_families(std::move(endpoints));
+}
+
+endpoints_t resolve_cache::resolve(const boost::asio::any_io_executor& ex,
+                                   const std::string& host,
+                                   const std::string& port) {
+  std::string key = host + '\n' + port;
+  endpoints_t endpoints;
+  if (lookup(key, endpoints))
+    return endpoints;
+  tcp::resolver res(ex);
+  endpoints = to_endpoints(res.resolve(host, port));
+  store(std::move(key), endpoints);
+  return endpoints;
+}
+
+void resolve_cache::async_resolve(tcp::resolver& res,
+                                  const std::string& host,
+                                  const std::string& port, handler h) {
+  std::string key = host + '\n' + port;
+  endpoints_t endpoints;
+  if (lookup(key, endpoints))
+    return boost::asio::post(res.get_executor(),
+                             [h = std::move(h),
+                              endpoints = std::move(endpoints)]() mutable {
+                               h(boost::system::error_code(),
+                                 std::move(endpoints));
+                             });
+  res.async_resolve(host, port,
+                    [this, key = std::move(key), h = std::move(h)]
+                    (const boost::system::error_code& ec,
+                     tcp::resolver::results_type results) mutable {
+                      endpoints_t endpoints;
+                      if (!ec) {
+                        endpoints = to_endpoints(results);
+                        store(std::move(key), endpoints);
+                      }
+                      h(ec, std::move(endpoints));
+                    });
+}
+
+void resolve_cache::clear() {
+  std::lock_guard _lock(m);
+  entries.clear();
+}
+
+size_t resolve_cache::size() const {
+  std::lock_guard _lock(m);
+  return entries.size();
+}
+
+resolve_cache& resolve_cache::global() {
+  static resolve_cache cache;
+  return cache;
+}
+
+endpoints_t interleave_families(endpoints_t endpoints) {
+  if (endpoints.empty())
+    return endpoints;
+  bool first_v6 = endpoints.front().address().is_v6();
+  std::stable_partition(endpoints.begin(), endpoints.end(),
+                        [first_v6](const tcp::endpoint& e) {
+                          return e.address().is_v6() == first_v6; });
+  auto other = std::find_if(endpoints.begin(), endpoints.end(),
+                            [first_v6](const tcp::endpoint& e) {
+                              return e.address().is_v6() != first_v6; });
+  endpoints_t out;
+  out.reserve(endpoints.size());
+  for (auto a = endpoints.begin(), b = other;
+       a != other || b != endpoints.end();) {
+    if (a != other)
+      out.push_back(*a++);
+    if (b != endpoints.end())
+      out.push_back(*b++);
+  }
+  return out;
+}
+
+void tune_socket(tcp::socket& s, const socket_tuning& t) {
+  boost::system::error_code ec;
+  if (t.nodelay) {
+    s.set_option(tcp::no_delay(true), ec);
+    if (ec)
+      LOG(debug) << "TCP_NODELAY: " << ec.message();
+  }
+  if (t.sndbuf) {
+    s.set_option(tcp::socket::send_buffer_size(t.sndbuf), ec);
+    if (ec)
+      LOG(debug) << "SO_SNDBUF: " << ec.message();
+  }
+  if (t.rcvbuf) {
+    s.set_option(tcp::socket::receive_buffer_size(t.rcvbuf), ec);
+    if (ec)
+      LOG(debug) << "SO_RCVBUF: " << ec.message();
+  }
+  if (t.fastopen) {
+#if defined TCP_FASTOPEN_CONNECT
+    int on = 1;
+    if (setsockopt(s.native_handle(), IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on,
+                   sizeof(on)))
+      LOG(debug) << "TCP_FASTOPEN_CONNECT: " << strerror(errno);
+#else
+    LOG(debug) << "TCP_FASTOPEN_CONNECT is not supported";
+#endif
+  }
+}
+
+namespace {
+
+// State of one async_happy_connect call, kept alive by pending handlers.
+// Its sockets and timer live on a strand, so their handlers never run
+// concurrently even when the io_context is run by several threads.
+struct happy_connect_op : std::enable_shared_from_this<happy_connect_op> {
+  // where the handler runs
+  boost::asio::any_io_executor ex;
+  endpoints_t endpoints;
+  // attempt i connects to endpoints[i]; reserved, never reallocated
+  std::vector<tcp::socket> attempts;
+  boost::asio::steady_timer timer;
+  std::chrono::milliseconds stagger;
+  socket_tuning tuning;
+  connect_handler handler;
+  size_t pending = 0;
+  bool finished = false;
+  boost::system::error_code last_ec = boost::asio::error::host_not_found;
+
+  happy_connect_op(const boost::asio::any_io_executor& ex,
+                   const endpoints_t& e, connect_handler h,
+                   std::chrono::milliseconds s, const socket_tuning& t)
+    : ex(ex), endpoints(e), timer(boost::asio::make_strand(ex)), stagger(s),
+      tuning(t), handler(std::move(h)) {
+    attempts.reserve(endpoints.size());
+  }
+
+  void start_next() {
+    if (finished)
+      return;
+    size_t i = attempts.size();
+    if (i == endpoints.size()) {
+      if (!pending)
+        finish(last_ec, tcp::socket(timer.get_executor()));
+      return;
+    }
+    LOG(trace) << "Connecting to " << endpoints[i];
+    attempts.emplace_back(timer.get_executor());
+    boost::system::error_code ec;
+    attempts[i].open(endpoints[i].protocol(), ec);
+    // Otherwise async_connect reports the error
+    if (!ec)
+      tune_socket(attempts[i], tuning);
+    ++pending;
+    auto self = shared_from_this();
+    attempts[i].async_connect(endpoints[i],
+                              [self, i](const boost::system::error_code& ec) {
+                                self->attempt_done(i, ec);
+                              });
+    timer.expires_after(stagger);
+    timer.async_wait([self](const boost::system::error_code& ec) {
+      if (!ec)
+        self->start_next();
+    });
+  }
+
+  void attempt_done(size_t i, const boost::system::error_code& ec) {
+    --pending;
+    if (finished)
+      return;
+    if (!ec)
+      return finish(ec, std::move(attempts[i]));
+    LOG(debug) << "Cannot connect to " << endpoints[i] << ": "
+               << ec.message();
+    last_ec = ec;
+    // No need to wait for the stagger delay
+    timer.cancel();
+    start_next();
+  }
+
+  void finish(const boost::system::error_code& ec, tcp::socket s) {
+    finished = true;
+    timer.cancel();
+    boost::system::error_code ignored;
+    for (auto& a : attempts)
+      a.close(ignored);
+    boost::asio::post(ex, [h = std::move(handler), ec,
+                           s = std::move(s)]() mutable {
+      h(ec, std::move(s));
+    });
+  }
+};
+
+}
+
+connect_canceller
+async_happy_connect(const boost::asio::any_io_executor& ex,
+                    const endpoints_t& endpoints, connect_handler h,
+                    std::chrono::milliseconds stagger,
+                    const socket_tuning& tuning) {
+  auto op = std::make_shared<happy_connect_op>(ex, endpoints, std::move(h),
+                                               stagger, tuning);
+  auto strand = op->timer.get_executor();
+  boost::asio::dispatch(strand, [op] { op->start_next(); });
+  return [strand, weak = std::weak_ptr<happy_connect_op>(op)] {
+    boost::asio::post(strand, [weak] {
+      if (auto op = weak.lock())
+        if (!op->finished)
+          op->finish(boost::asio::error::operation_aborted,
+                     tcp::socket(op->timer.get_executor()));
+    });
+  };
+}
+
+void happy_connect(tcp::socket& s, const endpoints_t& endpoints,
+                   std::chrono::milliseconds stagger,
+                   std::chrono::steady_clock::time_point deadline,
+                   const socket_tuning& tuning) {
+  // Run on a private io_context, so the caller's needs not be running
+  boost::asio::io_context io;
+  boost::system::error_code result;
+  auto on_connect = [&](const boost::system::error_code& ec,
+                        tcp::socket winner) {
+    result = ec;
+    if (ec)
+      return;
+    auto protocol = winner.local_endpoint().protocol();
+    if (s.is_open())
+      s.close();
+    s.assign(protocol, winner.release());
+  };
+  auto cancel = async_happy_connect(io.get_executor(), endpoints, on_connect,
+                                    stagger, tuning);
+  // Destroyed before io: a firing timer is done posting by then
+  auto timer = timer_wheel::global().schedule(deadline, cancel);
+  io.run();
+  if (result == boost::asio::error::operation_aborted) {
+    LOG(debug) << "Connection timed out";
+    throw ssh_timeout("Cannot connect: timed out");
+  }
+  if (result)
+    THROW("Cannot connect: " + result.message());
+}
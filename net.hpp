@@ -0,0 +1,103 @@
+#if !defined TEST_NET_HPP_INCLUDED
+#define TEST_NET_HPP_INCLUDED
+
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+
+#include "lru.hpp"
+
+using endpoints_t = std::vector<boost::asio::ip::tcp::endpoint>;
+
+// Resolved host:port pairs, kept for a while so repeated connections to
+// the same host skip DNS. getaddrinfo does not report record TTLs, hence a
+// fixed ttl.
+class resolve_cache {
+public:
+  struct options {
+    // how long a resolution is reused
+    std::chrono::seconds ttl{ 60 };
+    // host:port pairs kept at most
+    size_t capacity = 4096;
+  };
+  using handler = std::function<void(const boost::system::error_code& ec,
+                                     endpoints_t endpoints)>;
+
+  resolve_cache();
+  explicit resolve_cache(const options& opts);
+
+  // Endpoints of host:port, from cache or resolved now. Throws on failure.
+  endpoints_t resolve(const boost::asio::any_io_executor& ex,
+                      const std::string& host, const std::string& port);
+  // Same, asynchronously: resolves with res on a miss, posts handler to
+  // res' executor on a hit
+  void async_resolve(boost::asio::ip::tcp::resolver& res,
+                     const std::string& host, const std::string& port,
+                     handler h);
+
+  void clear();
+  size_t size() const;
+
+  // Cache shared by connections
+  static resolve_cache& global();
+
+private:
+  bool lookup(const std::string& key, endpoints_t& out);
+  void store(std::string key, const endpoints_t& endpoints);
+
+  options opts;
+  mutable std::mutex m;
+  lru_cache<std::string, endpoints_t> entries;
+};
+
+// Alternate address families, keeping the resolver's order within each
+// (RFC 8305 section 4)
+endpoints_t interleave_families(endpoints_t endpoints);
+
+// Options applied to each socket before it connects
+struct socket_tuning {
+  // Disable Nagle's algorithm: SSH writes whole packets, and auth is a
+  // series of small request/reply exchanges
+  bool nodelay = true;
+  // Kernel buffer sizes, 0 for the system default. Set before connecting
+  // so that the TCP window scale covers them.
+  int sndbuf = 0, rcvbuf = 0;
+  // Send the first write (the client banner) with the SYN
+  // (TCP_FASTOPEN_CONNECT), once the server granted a cookie. Connecting
+  // then completes at once, so happy_connect cannot race endpoints.
+  bool fastopen = false;
+};
+// Apply t to open socket s; unsupported options are only logged
+void tune_socket(boost::asio::ip::tcp::socket& s, const socket_tuning& t);
+
+// Delay between two connection attempts
+const std::chrono::milliseconds connect_stagger{ 250 };
+
+using connect_handler = std::function<void(const boost::system::error_code& ec,
+                                           boost::asio::ip::tcp::socket s)>;
+// Abort a connection in progress: its handler gets operation_aborted,
+// unless already called. Safe from any thread.
+using connect_canceller = std::function<void()>;
+
+// Happy eyeballs: try endpoints in order, starting the next attempt after
+// stagger or as soon as the previous one fails, and keep the first
+// connection established. handler gets it, or the last error once every
+// attempt failed, on ex. Each socket is tuned with tuning first.
+connect_canceller
+async_happy_connect(const boost::asio::any_io_executor& ex,
+                    const endpoints_t& endpoints, connect_handler h,
+                    std::chrono::milliseconds stagger = connect_stagger,
+                    const socket_tuning& tuning = socket_tuning());
+// Same, blocking, connecting s. Throws on failure, ssh_timeout if not
+// connected by deadline.
+void happy_connect(boost::asio::ip::tcp::socket& s,
+                   const endpoints_t& endpoints,
+                   std::chrono::milliseconds stagger = connect_stagger,
+                   std::chrono::steady_clock::time_point deadline =
+                   std::chrono::steady_clock::time_point::max(),
+                   const socket_tuning& tuning = socket_tuning());
+
+#endif// TEST_NET_HPP_INCLUDED
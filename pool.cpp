@@ -0,0 +1,178 @@
+#include <algorithm>
+
+#include "pool.hpp"
+#include "ssh_async.hpp"
+#include "test.hpp"
+
+#include "log.hpp"
+
+using clock_type = std::chrono::steady_clock;
+
+session_pool::session_pool() : session_pool(options{}) {}
+
+session_pool::session_pool(const options& o) : opts(o) {}
+
+session_pool::~session_pool() {
+  std::lock_guard _lock(m);
+  hosts.clear();
+}
+
+session_pool::lease& session_pool::lease::operator=(lease&& from) {
+  if (this != &from) {
+    lease old(std::move(*this));
+    pool = from.pool;
+    host = std::move(from.host);
+    key = std::move(from.key);
+    conn = std::move(from.conn);
+    rc_ = from.rc_;
+    reuse = from.reuse;
+  }
+  return *this;
+}
+
+session_pool::lease::~lease() {
+  if (pool && conn)
+    pool->release(host, key, std::move(conn), reuse && rc_ == 0);
+}
+
+session_pool::lease session_pool::checkout(const remote_t& r,
+                                           const key_pair& key,
+                                           const char* keypass) {
+  lease l;
+  l.pool = this;
+  l.host = r.host + ':' + r.port;
+  // Identity by digest: no copy of the key material
+  key_id id = key.id();
+  l.key = r.username + '\n';
+  l.key.append(reinterpret_cast<const char*>(id.data()), id.size());
+  std::unique_ptr<ssh_conn> dropped;
+  {
+    std::unique_lock _lock(m);
+    host_state& h = hosts[l.host];
+    for (;;) {
+      auto it = h.idle.find(l.key);
+      if (it != h.idle.end() && !it->second.empty()) {
+        l.conn = std::move(it->second.back().conn);
+        it->second.pop_back();
+        LOG(debug) << "Reusing pooled session to " << l.host;
+        return l;
+      }
+      if (h.open < opts.max_per_host)
+        break;
+      // Make room by dropping an idle session of another identity
+      auto other = std::find_if(h.idle.begin(), h.idle.end(),
+                                [](const auto& i) { return !i.second.empty(); });
+      if (other != h.idle.end()) {
+        dropped = std::move(other->second.front().conn);
+        other->second.erase(other->second.begin());
+        --h.open;
+        break;
+      }
+      cv.wait(_lock);
+    }
+    ++h.open;
+  }
+  dropped.reset();
+  try {
+    l.conn = std::make_unique<ssh_conn>(io);
+    session_deadline d(r.timeouts);
+    ssh_connect(l.conn->session, l.conn->s, r, d);
+    auto _timer = d.arm(l.conn->s, r.timeouts.auth);
+    l.rc_ = d.result(auth_pukey_mem(l.conn->session, l.conn->s, r.username,
+                                    key, keypass));
+  } catch (...) {
+    release(l.host, l.key, std::move(l.conn), false);
+    throw;
+  }
+  if (opts.keepalive.count())
+    libssh2_keepalive_config(l.conn->session, 1, opts.keepalive.count());
+  return l;
+}
+
+void session_pool::release(const std::string& host, const std::string& key,
+                           std::unique_ptr<ssh_conn> conn, bool reuse) {
+  {
+    std::lock_guard _lock(m);
+    host_state& h = hosts[host];
+    if (reuse)
+      h.idle[key].push_back(idle_conn{ std::move(conn), clock_type::now() });
+    else
+      --h.open;
+  }
+  cv.notify_all();
+  // conn (if not pooled) is closed here, outside the lock
+}
+
+void session_pool::maintain() {
+  struct checked {
+    const std::string* host;
+    const std::string* key;
+    idle_conn c;
+  };
+  std::vector<std::unique_ptr<ssh_conn>> closing;
+  // Idle sessions taken out for a keepalive, sent without the lock: a
+  // slow host must not hold up checkouts for the others
+  std::vector<checked> alive;
+  {
+    std::lock_guard _lock(m);
+    auto now = clock_type::now();
+    for (auto& [host, h] : hosts) {
+      for (auto& [key, conns] : h.idle) {
+        for (auto& c : conns) {
+          if (now - c.since > opts.idle_timeout) {
+            closing.push_back(std::move(c.conn));
+            --h.open;
+          } else if (opts.keepalive.count()) {
+            alive.push_back(checked{ &host, &key, std::move(c) });
+          }
+        }
+        conns.erase(std::remove_if(conns.begin(), conns.end(),
+                                   [](const auto& c) { return !c.conn; }),
+                    conns.end());
+      }
+    }
+  }
+  for (auto& a : alive) {
+    int seconds_to_next;
+    int rc = libssh2_keepalive_send(a.c.conn->session, &seconds_to_next);
+    if (rc && rc != LIBSSH2_ERROR_EAGAIN) {
+      LOG(debug) << "Keepalive to " << *a.host << " failed: "
+                 << ssh2_err(a.c.conn->session);
+      closing.push_back(std::move(a.c.conn));
+    }
+  }
+  if (!alive.empty()) {
+    std::lock_guard _lock(m);
+    // Back in front of those released meanwhile, which are more recent
+    for (auto a = alive.rbegin(); a != alive.rend(); ++a) {
+      host_state& h = hosts[*a->host];
+      if (!a->c.conn) {
+        --h.open;
+        continue;
+      }
+      auto& conns = h.idle[*a->key];
+      conns.insert(conns.begin(), std::move(a->c));
+    }
+  }
+  // Checkouts may have found nothing idle while the sessions were out, or
+  // have waited for room freed by the closed ones
+  if (!alive.empty() || !closing.empty())
+    cv.notify_all();
+}
+
+size_t session_pool::idle() const {
+  std::lock_guard _lock(m);
+  size_t n = 0;
+  for (const auto& h : hosts)
+    for (const auto& i : h.second.idle)
+      n += i.second.size();
+  return n;
+}
+
+size_t session_pool::open() const {
+  std::lock_guard _lock(m);
+  size_t n = 0;
+  for (const auto& h : hosts)
+    n += h.second.open;
+  return n;
+}
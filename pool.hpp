@@ -0,0 +1,92 @@
+#if !defined TEST_POOL_HPP_INCLUDED
+#define TEST_POOL_HPP_INCLUDED
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ssh.hpp"
+
+// Connected, host-checked and authenticated sessions, kept for reuse.
+// Sessions are keyed by remote host, port, username and public key, so a
+// checkout for a known (remote, identity) skips handshake and auth.
+// The pool must outlive the leases it hands out.
+class session_pool {
+public:
+  struct options {
+    // open sessions (idle or checked out) per host:port
+    size_t max_per_host = 4;
+    // idle sessions older than this are closed by maintain()
+    std::chrono::seconds idle_timeout{ 300 };
+    // keepalive interval for idle sessions, 0 to disable
+    std::chrono::seconds keepalive{ 30 };
+  };
+
+  class lease;
+
+  session_pool();
+  explicit session_pool(const options& opts);
+  session_pool(const session_pool&) = delete;
+  ~session_pool();
+
+  // Get an authenticated session for r, opening one if none is idle.
+  // Waits while max_per_host sessions are already open for this host.
+  // Throws if the connection cannot be established; an authentication
+  // failure is reported by lease::rc().
+  lease checkout(const remote_t& r, const key_pair& key,
+                 const char* keypass);
+
+  // Close idle sessions past idle_timeout, send keepalives to the others
+  void maintain();
+
+  size_t idle() const;
+  size_t open() const;
+
+private:
+  struct idle_conn {
+    std::unique_ptr<ssh_conn> conn;
+    std::chrono::steady_clock::time_point since;
+  };
+  struct host_state {
+    size_t open = 0;
+    // idle sessions by identity key, most recently used last
+    std::map<std::string, std::vector<idle_conn>> idle;
+  };
+
+  void release(const std::string& host, const std::string& key,
+               std::unique_ptr<ssh_conn> conn, bool reuse);
+
+  options opts;
+  boost::asio::io_context io;
+  mutable std::mutex m;
+  std::condition_variable cv;
+  std::map<std::string, host_state> hosts;
+};
+
+// A checked out session, returned to the pool on destruction
+class session_pool::lease {
+  friend class session_pool;
+  session_pool* pool = nullptr;
+  std::string host, key;
+  std::unique_ptr<ssh_conn> conn;
+  int rc_ = 0;
+  bool reuse = true;
+public:
+  lease() = default;
+  lease(lease&&) = default;
+  lease& operator=(lease&& from);
+  ~lease();
+  // libssh2 authentication result, the session is usable only if 0
+  int rc() const { return rc_; }
+  explicit operator bool() const { return conn && rc_ == 0; }
+  ssh_conn* operator->() const { return conn.get(); }
+  ssh_conn& operator*() const { return *conn; }
+  // Close the session instead of returning it, e.g. after an I/O error
+  void discard() { reuse = false; }
+};
+
+#endif// TEST_POOL_HPP_INCLUDED
@@ -0,0 +1,289 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+#include <boost/align/aligned_alloc.hpp>
+
+#include "sftp.hpp"
+#include "ssh.hpp"
+#include "ssh_async.hpp"
+#include "test.hpp"
+#include "utils.hpp"
+
+#include "log.hpp"
+
+using clock_type = std::chrono::steady_clock;
+
+sftp_session::sftp_session(LIBSSH2_SESSION *session_,
+                           boost::asio::ip::tcp::socket& s_)
+  : session(session_), s(s_) {
+  while (!(sftp = libssh2_sftp_init(session)) &&
+         libssh2_session_last_errno(session) == LIBSSH2_ERROR_EAGAIN)
+    ssh2_wait(session, s);
+  if (!sftp)
+    THROW("Cannot start SFTP: " + ssh2_err(session));
+}
+
+sftp_session::~sftp_session() {
+  int rc = ssh2_retry(session, s, [this] {
+    return libssh2_sftp_shutdown(sftp);
+  });
+  if (rc)
+    LOG(debug) << "SFTP shutdown failed: " << ssh2_err(session);
+}
+
+namespace {
+
+std::string sftp_err(LIBSSH2_SESSION *session, LIBSSH2_SFTP *sftp) {
+  if (libssh2_session_last_errno(session) != LIBSSH2_ERROR_SFTP_PROTOCOL)
+    return ssh2_err(session);
+  return " (SFTP status " + std::to_string(libssh2_sftp_last_error(sftp)) +
+    ")";
+}
+
+// One file being moved. step() does what can be done without blocking:
+// it returns LIBSSH2_ERROR_EAGAIN when waiting for the socket, 0
+// otherwise, and throws on failure.
+struct transfer_op {
+  enum class state { opening, moving, closing, done };
+
+  sftp_transfer& t;
+  LIBSSH2_SESSION *session;
+  LIBSSH2_SFTP *sftp;
+  const sftp_options& opts;
+  LIBSSH2_SFTP_HANDLE *h = nullptr;
+  state st = state::opening;
+  clock_type::time_point start = clock_type::now();
+
+  transfer_op(sftp_transfer& t_, LIBSSH2_SESSION *session_,
+              LIBSSH2_SFTP *sftp_, const sftp_options& opts_)
+    : t(t_), session(session_), sftp(sftp_), opts(opts_) {
+    t.bytes = 0;
+    t.error.clear();
+  }
+  virtual ~transfer_op() {}
+  virtual int step() = 0;
+
+  int open(unsigned long flags) {
+    h = libssh2_sftp_open_ex(sftp, t.remote.data(),
+                             unsigned(t.remote.size()), flags, opts.mode,
+                             LIBSSH2_SFTP_OPENFILE);
+    if (h) {
+      st = state::moving;
+      return 0;
+    }
+    if (libssh2_session_last_errno(session) == LIBSSH2_ERROR_EAGAIN)
+      return LIBSSH2_ERROR_EAGAIN;
+    THROW("Cannot open " + t.remote + sftp_err(session, sftp));
+  }
+
+  int close() {
+    int rc = libssh2_sftp_close_handle(h);
+    if (rc == LIBSSH2_ERROR_EAGAIN)
+      return rc;
+    h = nullptr;
+    if (rc)
+      THROW("Cannot close " + t.remote + sftp_err(session, sftp));
+    st = state::done;
+    return 0;
+  }
+};
+
+struct upload_op : transfer_op {
+  mapped_file src;
+  std::string_view data;
+  size_t off = 0;
+
+  upload_op(sftp_transfer& t, LIBSSH2_SESSION *session, LIBSSH2_SFTP *sftp,
+            const sftp_options& opts)
+    : transfer_op(t, session, sftp, opts), src(t.local) {
+    src.sequential();
+    data = src.view();
+  }
+
+  int step() override {
+    switch (st) {
+      case state::opening:
+        return open(LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT |
+                    LIBSSH2_FXF_TRUNC);
+      case state::moving: {
+        if (off == data.size()) {
+          st = state::closing;
+          return 0;
+        }
+        // Straight from the mapping; libssh2 wants the same data again
+        // after EAGAIN, which is what off (acknowledged bytes) gives
+        ssize_t rc = libssh2_sftp_write(h, data.data() + off,
+                                        std::min(opts.window,
+                                                 data.size() - off));
+        if (rc == LIBSSH2_ERROR_EAGAIN)
+          return int(rc);
+        if (rc < 0)
+          THROW("Cannot write " + t.remote + sftp_err(session, sftp));
+        off += rc;
+        t.bytes = off;
+        return 0;
+      }
+      case state::closing:
+        return close();
+      case state::done:
+        break;
+    }
+    return 0;
+  }
+};
+
+// Buffer of whole pages, for large aligned writes into the file system
+struct page_buffer {
+  static const size_t page = 4096;
+  size_t size;
+  std::unique_ptr<char, void (*)(void*)> buf;
+  explicit page_buffer(size_t n)
+    : size((std::max<size_t>(n, 1) + page - 1) / page * page),
+      buf(static_cast<char*>(boost::alignment::aligned_alloc(page, size)),
+          boost::alignment::aligned_free) {
+    if (!buf)
+      throw std::bad_alloc();
+  }
+  char* data() { return buf.get(); }
+};
+
+struct download_op : transfer_op {
+  int fd;
+  page_buffer buf;
+  size_t fill = 0;
+
+  download_op(sftp_transfer& t, LIBSSH2_SESSION *session,
+              LIBSSH2_SFTP *sftp, const sftp_options& opts)
+    : transfer_op(t, session, sftp, opts), buf(opts.window) {
+    fd = ::open(t.local.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                int(opts.mode));
+    if (fd < 0)
+      THROW("Cannot create " + t.local.string() + ": " + strerror(errno));
+  }
+  ~download_op() {
+    ::close(fd);
+    if (st != state::done)
+      unlink(t.local.c_str());
+  }
+
+  void flush() {
+    write_all(fd, buf.data(), fill);
+    fill = 0;
+  }
+
+  int step() override {
+    switch (st) {
+      case state::opening:
+        return open(LIBSSH2_FXF_READ);
+      case state::moving: {
+        // A large buffer lets libssh2 read ahead that much
+        ssize_t rc = libssh2_sftp_read(h, buf.data() + fill,
+                                       buf.size - fill);
+        if (rc == LIBSSH2_ERROR_EAGAIN)
+          return int(rc);
+        if (rc < 0)
+          THROW("Cannot read " + t.remote + sftp_err(session, sftp));
+        fill += rc;
+        t.bytes += rc;
+        if (!rc || fill == buf.size)
+          flush();
+        if (!rc)
+          st = state::closing;
+        return 0;
+      }
+      case state::closing:
+        return close();
+      case state::done:
+        break;
+    }
+    return 0;
+  }
+};
+
+}
+
+size_t sftp_session::run(std::vector<sftp_transfer>& files,
+                         const sftp_options& opts, bool upload) {
+  // Nothing would ever move
+  if (!opts.window)
+    THROW("SFTP window must not be 0");
+  std::vector<std::unique_ptr<transfer_op>> active;
+  size_t next = 0, cur = 0, failed = 0;
+  for (;;) {
+    while (active.size() < std::max<size_t>(opts.parallel, 1) &&
+           next < files.size()) {
+      sftp_transfer& t = files[next++];
+      try {
+        if (upload)
+          active.push_back(std::make_unique<upload_op>(t, session, sftp,
+                                                       opts));
+        else
+          active.push_back(std::make_unique<download_op>(t, session, sftp,
+                                                         opts));
+      } catch (const std::exception& e) {
+        t.error = e.what();
+        ++failed;
+      }
+    }
+    if (active.empty())
+      break;
+    cur %= active.size();
+    transfer_op& op = *active[cur];
+    int rc;
+    try {
+      rc = op.step();
+    } catch (const std::exception& e) {
+      op.t.error = e.what();
+      ++failed;
+      if (op.h)
+        ssh2_retry(session, s, [&op] {
+          return libssh2_sftp_close_handle(op.h);
+        });
+      active.erase(active.begin() + cur);
+      continue;
+    }
+    if (rc == LIBSSH2_ERROR_EAGAIN) {
+      // libssh2 keeps the state of an interrupted call per SFTP session,
+      // not per handle: this transfer must be resumed before any other
+      ssh2_wait(session, s);
+      continue;
+    }
+    op.t.elapsed = std::chrono::duration_cast<std::chrono::microseconds>
+      (clock_type::now() - op.start);
+    if (op.st == transfer_op::state::done) {
+      LOG(debug) << (upload ? "Uploaded " : "Downloaded ") << op.t.remote
+                 << ": " << op.t.bytes << " bytes in "
+                 << op.t.elapsed.count() << "us";
+      active.erase(active.begin() + cur);
+      continue;
+    }
+    // Requests of this file are in flight: move on to the next one
+    ++cur;
+  }
+  return failed;
+}
+
+void sftp_session::remove(const std::string& path) {
+  int rc = ssh2_retry(session, s, [&] {
+    return libssh2_sftp_unlink_ex(sftp, path.data(), unsigned(path.size()));
+  });
+  if (rc)
+    THROW("Cannot remove " + path + sftp_err(session, sftp));
+}
+
+std::string sftp_session::last_error() const {
+  return sftp_err(session, sftp);
+}
+
+size_t sftp_session::upload(std::vector<sftp_transfer>& files,
+                            const sftp_options& opts) {
+  return run(files, opts, true);
+}
+
+size_t sftp_session::download(std::vector<sftp_transfer>& files,
+                              const sftp_options& opts) {
+  return run(files, opts, false);
+}
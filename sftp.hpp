@@ -0,0 +1,65 @@
+#if !defined TEST_SFTP_HPP_INCLUDED
+#define TEST_SFTP_HPP_INCLUDED
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+#include <libssh2.h>
+#include <libssh2_sftp.h>
+
+// One file to copy, and how it went
+struct sftp_transfer {
+  boost::filesystem::path local;
+  std::string remote;
+  // bytes moved so far
+  uint64_t bytes = 0;
+  // why the transfer failed, empty on success
+  std::string error;
+  std::chrono::microseconds elapsed{ 0 };
+};
+
+struct sftp_options {
+  // Bytes handed to libssh2 per read or write: it splits them into SFTP
+  // requests kept in flight together, so this should cover the
+  // bandwidth-delay product of the link. Not 0.
+  size_t window = 2 << 20;
+  // files moved at once
+  size_t parallel = 4;
+  // permissions of uploaded and downloaded files
+  long mode = 0644;
+};
+
+// SFTP over an authenticated session. Many files are moved at once, each
+// with a window of requests in flight, so that throughput is not capped
+// at one request per round-trip.
+class sftp_session {
+  LIBSSH2_SESSION *session;
+  boost::asio::ip::tcp::socket& s;
+  LIBSSH2_SFTP *sftp = nullptr;
+  size_t run(std::vector<sftp_transfer>& files, const sftp_options& opts,
+             bool upload);
+public:
+  // Start the SFTP subsystem; throws on failure
+  sftp_session(LIBSSH2_SESSION *session, boost::asio::ip::tcp::socket& s);
+  sftp_session(const sftp_session&) = delete;
+  ~sftp_session();
+
+  // Copy each local file (memory-mapped) to its remote path. Returns the
+  // count of failed transfers; see their error.
+  size_t upload(std::vector<sftp_transfer>& files,
+                const sftp_options& opts = sftp_options());
+  // Copy each remote file to its local path. Returns the count of failed
+  // transfers, whose partial local files are removed.
+  size_t download(std::vector<sftp_transfer>& files,
+                  const sftp_options& opts = sftp_options());
+
+  // Remove a remote file; throws on failure
+  void remove(const std::string& path);
+
+  // Error of the last failed SFTP call
+  std::string last_error() const;
+};
+
+#endif// TEST_SFTP_HPP_INCLUDED
@@ -1,14 +1,21 @@
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 #include <fstream>
+#include <mutex>
 #include <thread>
 #include <boost/asio.hpp>
 
+#include "key_store.hpp"
+#include "lru.hpp"
+#include "metrics.hpp"
+#include "net.hpp"
 #include "ssh.hpp"
+#include "ssh_async.hpp"
 #include "test.hpp"
 #include "utils.hpp"
 
-#include <boost/log/trivial.hpp>
+#include "log.hpp"
 
 remote_t remote(getenv("TEST_HOST"), getenv("TEST_PORT"), getenv("TEST_USER"));
 
@@ -18,31 +25,26 @@ remote_t::remote_t(const char* h, const char* p, const char* u) {
   username = u ? u : "test";
 }
 
-static void write(int fd, const std::string& data) {
-  ssize_t rc = ::write(fd, data.data(), data.size());
-  if (rc < data.size()) {
-    int count = 0;
-    ssize_t wr = 0;
-    do {
-      if (rc < 0)
-        THROW("Cannot write into file");
-      wr += rc;
-      if (rc == 0 && ++count > 25) --rc;
-      rc = ::write(fd, data.data() + wr, data.size() - wr);
-    } while (rc < data.size() - wr);
-  }
-  ::write(fd, "\n", 1);
-  ::close(fd);
+static void write_key(int fd, std::string_view data) {
+  autofn _close([fd] { ::close(fd); });
+  write_all(fd, data.data(), data.size());
+  write_all(fd, "\n", 1);
 }
 
-// If libssh2 is not built against openssl,
-// libssh2_userauth_publickey_frommemory fails, therefore we have to write
-// key material in tempfiles and use libssh2_userauth_publickey_fromfile
-static int _auth_pukey_mem2file(LIBSSH2_SESSION *session,
-                                const std::string& username,
-                                const std::string& pubkeydata,
-                                const std::string& keydata,
-                                const char* keypass) {
+key_tmpfiles::key_tmpfiles(const key_pair& key) {
+#if defined HAVE_MEMFD_CREATE
+  try {
+    // libssh2 reads keys by path: /proc/self/fd/N keeps them off disk
+    mpub = memfile("ssh-key.pub", { key.pub(), "\n" });
+    mpriv = memfile("ssh-key", { key.priv(), "\n" });
+    return;
+  } catch (const std::exception&) {
+    // Both halves or neither: a public key memfd made before the private
+    // one failed is closed, and both go to disk
+    mpub = memfile();
+    LOG(debug) << "No in-memory files, using temporary files";
+  }
+#endif
   using namespace boost::filesystem;
   std::string base = (temp_directory_path() /
                       unique_path("ssh-tmp-key-%%%%-%%%%-%%%%-%%%%.XXXXXX"))
@@ -54,99 +56,204 @@ static int _auth_pukey_mem2file(LIBSSH2_SESSION *session,
 #else
   std::string pub_{ base + ".pub" }, priv_{ base };
 #endif
-  BOOST_LOG_TRIVIAL(debug) << "Writing key material into "
-                           << pub_ << " & " << priv_;
-  unlinkable pubkey(pub_), privkey(priv_);
+  LOG(debug) << "Writing key material into "
+             << pub_ << " & " << priv_;
+  upub = unlinkable(pub_);
+  upriv = unlinkable(priv_);
 #if defined HAVE_MKSTEMP
-  write(pub_fd, pubkeydata);
-  write(priv_fd, keydata);
+  write_key(pub_fd, key.pub());
+  write_key(priv_fd, key.priv());
 #else
-  std::ofstream{ pub_ } << pubkeydata << std::endl;
-  std::ofstream{ priv_ } << keydata << std::endl;
+  std::ofstream{ pub_ } << key.pub() << std::endl;
+  std::ofstream{ priv_ } << key.priv() << std::endl;
 #endif
-  int rc;
-  do {
-    rc = libssh2_userauth_publickey_fromfile(session, username.c_str(),
-                                             pubkey.fn().c_str(),
-                                             privkey.fn().c_str(),
-                                             keypass
-      );
-  } while (rc == LIBSSH2_ERROR_EAGAIN);
-  debug_rc(rc);
-  return rc;
 }
 
-static int auth_pukey_mem(LIBSSH2_SESSION *session, const std::string& username,
-                          const std::string& pubkeydata,
-                          const std::string& keydata,
-                          const char* keypass) {
-  BOOST_LOG_TRIVIAL(debug) << "Using provided key data for user "
-                           << username;
+namespace {
+// Cached in-memory key files by SHA-256 of the key pair
+const size_t key_tmpfiles_max = 64;
+std::mutex key_tmpfiles_m;
+lru_cache<key_id, std::shared_ptr<const key_tmpfiles>, key_id_hash>
+key_tmpfiles_cache(key_tmpfiles_max);
+}
+
+std::shared_ptr<const key_tmpfiles>
+cached_key_tmpfiles(const key_pair& key) {
+  key_id id = key.id();
+
+  std::lock_guard _lock(key_tmpfiles_m);
+  if (auto files = key_tmpfiles_cache.get(id))
+    return *files;
+  auto files = std::make_shared<const key_tmpfiles>(key);
+  // Private keys are not left on disk past the authentication
+  if (files->in_memory())
+    key_tmpfiles_cache.put(id, files);
+  return files;
+}
+
+void clear_key_tmpfiles() {
+  std::lock_guard _lock(key_tmpfiles_m);
+  key_tmpfiles_cache.clear();
+}
+
+bool ssh2_frommemory_supported() {
 #if defined HAVE_LIBSSH2_CRYPTOENGINE_API
-  if (libssh2_crypto_engine() != libssh2_crypto_engine_t::libssh2_openssl)
-    return _auth_pukey_mem2file(session, username, pubkeydata, keydata,
-                                keypass);
+  return libssh2_crypto_engine() == libssh2_crypto_engine_t::libssh2_openssl;
+#else
+  return true;
 #endif
-  bool first_log = true;
-  int rc;
-  do {
-    if (first_log) {
-      first_log = false;
-      BOOST_LOG_TRIVIAL(trace) << "pubkey: " << sview(pubkeydata)
-                               << " - privkey: " << sview(keydata);
-    }
-    rc = libssh2_userauth_publickey_frommemory(session,
-                                               username.c_str(),
-                                               username.size(),
-                                               pubkeydata.data(),
-                                               pubkeydata.size(),
-                                               keydata.data(),
-                                               keydata.size(),
+}
+
+// If libssh2 is not built against openssl,
+// libssh2_userauth_publickey_frommemory fails, therefore we have to write
+// key material in tempfiles and use libssh2_userauth_publickey_fromfile
+static int _auth_pukey_mem2file(LIBSSH2_SESSION *session,
+                                boost::asio::ip::tcp::socket& s,
+                                const std::string& username,
+                                const key_pair& key,
+                                const char* keypass) {
+  auto files = cached_key_tmpfiles(key);
+  int rc = ssh2_retry(session, s, [&] {
+    return libssh2_userauth_publickey_fromfile(session, username.c_str(),
+                                               files->pub().c_str(),
+                                               files->priv().c_str(),
                                                keypass);
-  } while (rc == LIBSSH2_ERROR_EAGAIN);
+  });
+  debug_rc(rc);
+  return rc;
+}
+
+int auth_pukey_mem(LIBSSH2_SESSION *session,
+                   boost::asio::ip::tcp::socket& s,
+                   const std::string& username, const key_pair& key,
+                   const char* keypass) {
+  LOG(debug) << "Using provided key data for user "
+             << username;
+  phase_timer _timer(phase::auth);
+  if (!ssh2_frommemory_supported()) {
+    int rc = _auth_pukey_mem2file(session, s, username, key, keypass);
+    record_rc(rc);
+    return rc;
+  }
+  LOG(trace) << "pubkey: " << sview(key.pub())
+             << " - privkey: " << sview(key.priv());
+  // Encrypted keys are decrypted once and cached, not on each auth
+  unlocked_key priv(key.priv(), keypass);
+  if (priv.wrong_pass) {
+    // What libssh2 would return, without its own KDF run
+    record_rc(LIBSSH2_ERROR_PUBLICKEY_UNVERIFIED);
+    return LIBSSH2_ERROR_PUBLICKEY_UNVERIFIED;
+  }
+  int rc = ssh2_retry(session, s, [&] {
+    return libssh2_userauth_publickey_frommemory(session,
+                                                 username.c_str(),
+                                                 username.size(),
+                                                 key.pub().data(),
+                                                 key.pub().size(),
+                                                 priv.data.data(),
+                                                 priv.data.size(),
+                                                 priv.pass);
+  });
   debug_rc(rc);
 #if !defined HAVE_LIBSSH2_CRYPTOENGINE_API
   // We don't know if openssl is built in or not. If not, we must
   // write keys into temporary files
   if (rc == LIBSSH2_ERROR_PUBLICKEY_UNVERIFIED)
-    rc = _auth_pukey_mem2file(session, username, pubkeydata, keydata,
-                              keypass);
+    rc = _auth_pukey_mem2file(session, s, username, key, keypass);
 #endif
+  record_rc(rc);
   // Do not throw, as we want to test return value
   //if (rc)
   //THROW("Authentication by public key failed: " + ssh2_err(session));
   return rc;
 }
 
-int test_pubkey(const std::string& pubkeydata, const std::string& keydata,
-                const char* keypass) {
+void ssh_connect(LIBSSH2_SESSION *session, boost::asio::ip::tcp::socket& s,
+                 const remote_t& r) {
+  session_deadline d(r.timeouts);
+  ssh_connect(session, s, r, d);
+}
+
+void ssh_connect(LIBSSH2_SESSION *session, boost::asio::ip::tcp::socket& s,
+                 const remote_t& r, session_deadline& d) {
+  set_method_prefs(session, r.methods);
+  auto start = std::chrono::steady_clock::now();
+  // getaddrinfo cannot be interrupted: resolving counts in the total only
+  auto endpoints = resolve_cache::global().resolve(s.get_executor(), r.host,
+                                                   r.port);
+  record_since(phase::resolve, start);
+  happy_connect(s, endpoints, connect_stagger,
+                d.phase_end(d.timeouts().connect), r.tuning);
+  record_since(phase::connect, start);
+  int rc;
+  {
+    auto _timer = d.arm(s, d.timeouts().handshake);
+    rc = d.result(ssh2_retry(session, s, [&] {
+      return libssh2_session_handshake(session, s.native_handle());
+    }));
+  }
+  record_since(phase::handshake, start);
+  if (rc) {
+    record_rc(rc);
+    if (rc == LIBSSH2_ERROR_SOCKET_TIMEOUT)
+      throw ssh_timeout("SSH handshake timed out");
+    THROW("Failure establishing SSH session: " + ssh2_err(session));
+  }
+#if defined TEST_WITH_KH_FP
+  _check_kh_fp(session, r);
+#endif
+}
+
+void ssh_disconnect(LIBSSH2_SESSION *session,
+                    boost::asio::ip::tcp::socket& s) {
+  if (s.is_open()) {
+    int rc = ssh2_retry(session, s, [&] {
+      return libssh2_session_disconnect(session, "Normal Shutdown");
+    });
+    if (rc)
+      LOG(debug) << "Disconnect failed: " << ssh2_err(session);
+  }
+}
+
+ssh_conn::ssh_conn(boost::asio::io_context& io)
+  : s(io), session(make_session()) {}
+
+ssh_conn::~ssh_conn() {
+  ssh_disconnect(session, s);
+  libssh2_session_free(session);
+  boost::system::error_code ec;
+  s.close(ec);
+}
+
+int test_pubkey(const key_pair& key, const char* keypass) {
   LIBSSH2_SESSION *session = make_session();
+  auto_del<LIBSSH2_SESSION, int, libssh2_session_free> _session(session);
   libssh2_trace(session,
                 LIBSSH2_TRACE_KEX | LIBSSH2_TRACE_PUBLICKEY |
                 LIBSSH2_TRACE_ERROR);
-  return _test_pubkey(session, pubkeydata, keydata, keypass);
+  return _test_pubkey(session, key, keypass);
 }
 
-#if defined TEST_WITH_KH_FP
-void _check_kh_fp(LIBSSH2_SESSION *session);
-#endif
-
-int _test_pubkey(LIBSSH2_SESSION *session, const std::string& pubkeydata,
-                 const std::string& keydata, const char* keypass) {
-  using tcp = boost::asio::ip::tcp;
+int _test_pubkey(LIBSSH2_SESSION *session, const key_pair& key,
+                 const char* keypass) {
   boost::asio::io_context io_context;
-  tcp::resolver r(io_context);
-  tcp::socket s(io_context);
-  boost::asio::connect(s, r.resolve(remote.host, remote.port));
+  boost::asio::ip::tcp::socket s(io_context);
   auto_close_sock _s(s);
-  
-  ssize_t rc;
-  while ((rc = libssh2_session_handshake(session, s.native_handle())) == LIBSSH2_ERROR_EAGAIN);
-  if (rc)
-    THROW("Failure establishing SSH session: " + ssh2_err(session));
-#if defined TEST_WITH_KH_FP
-  _check_kh_fp(session);
-#endif
+  session_deadline d(remote.timeouts);
+  try {
+    ssh_connect(session, s, remote, d);
+  } catch (const ssh_timeout& e) {
+    LOG(debug) << e.what();
+    return LIBSSH2_ERROR_SOCKET_TIMEOUT;
+  }
   // Test pubkey function
-  return auth_pukey_mem(session, remote.username, pubkeydata, keydata, keypass);
+  int rc;
+  {
+    auto _timer = d.arm(s, remote.timeouts.auth);
+    rc = d.result(auth_pukey_mem(session, s, remote.username, key, keypass));
+  }
+  // The socket is shut down past a time limit
+  if (!d.expired())
+    ssh_disconnect(session, s);
+  return rc;
 }
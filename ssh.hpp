@@ -1,24 +1,76 @@
 #if !defined TEST_SSH_HPP_INCLUDED
 #define TEST_SSH_HPP_INCLUDED
 
+#include <memory>
 #include <libssh2.h>
 
+#include "deadline.hpp"
+#include "key.hpp"
+#include "methods.hpp"
+#include "net.hpp"
+#include "utils.hpp"
+
 LIBSSH2_SESSION *make_session(void);
 
-int test_pubkey(const std::string& pubkeydata, const std::string& keydata,
-                const char* keypass);
-int _test_pubkey(LIBSSH2_SESSION *session, const std::string& pubkeydata,
-                 const std::string& keydata, const char* keypass);
+int test_pubkey(const key_pair& key, const char* keypass);
+int _test_pubkey(LIBSSH2_SESSION *session, const key_pair& key,
+                 const char* keypass);
+// Same, borrowing the key material for the call
+inline int test_pubkey(std::string_view pubkeydata, std::string_view keydata,
+                       const char* keypass) {
+  return test_pubkey(key_pair::borrow(pubkeydata, keydata), keypass);
+}
+inline int _test_pubkey(LIBSSH2_SESSION *session, std::string_view pubkeydata,
+                        std::string_view keydata, const char* keypass) {
+  return _test_pubkey(session, key_pair::borrow(pubkeydata, keydata),
+                      keypass);
+}
 
 struct remote_t {
   std::string host, port, username;
   bool check_host = true;
   bool allow_unknown = false;
+  ssh_timeouts timeouts;
+  method_prefs methods = method_profile("auto");
+  socket_tuning tuning;
   remote_t(const char* h, const char* p, const char* u);
   int portn() const { return atoi(port.c_str()); }
 };
 extern remote_t remote;
 
+// Check the session host key against known_hosts files, throws on mismatch
+void _check_kh_fp(LIBSSH2_SESSION *session, const remote_t& r = remote);
+
+// false if libssh2_userauth_publickey_frommemory is known not to work
+// with the crypto backend libssh2 is built against
+bool ssh2_frommemory_supported();
+
+// Key material exposed as files, for crypto backends where
+// libssh2_userauth_publickey_frommemory fails. In-memory files are used
+// when the system has them, temporary files otherwise; either way they
+// are gone with the instance.
+class key_tmpfiles {
+  memfile mpub, mpriv;
+  unlinkable upub{ "" }, upriv{ "" };
+public:
+  explicit key_tmpfiles(const key_pair& key);
+  const std::string& pub() const {
+    return mpub.fn().empty() ? upub.fn() : mpub.fn();
+  }
+  const std::string& priv() const {
+    return mpriv.fn().empty() ? upriv.fn() : mpriv.fn();
+  }
+  // Both files are memfds, nothing was written to disk
+  bool in_memory() const { return !mpriv.fn().empty(); }
+};
+
+// key_tmpfiles for a key pair. In-memory ones are created on first use and
+// shared with later sessions using the same key; files on disk are not
+// kept, but removed once the caller drops them.
+std::shared_ptr<const key_tmpfiles> cached_key_tmpfiles(const key_pair& key);
+// Release all cached key_tmpfiles not currently in use
+void clear_key_tmpfiles();
+
 std::string ssh2_err(LIBSSH2_SESSION* session);
 
 static inline const std::string known_retvals(int rc) {
@@ -38,6 +90,32 @@ static inline const std::string known_retvals(int rc) {
   return std::to_string(rc);
 }
 
+// Resolve r and connect s to it, then run the SSH handshake (and host key
+// check) on session, within r.timeouts. Throws on failure, ssh_timeout
+// past a time limit.
+void ssh_connect(LIBSSH2_SESSION *session, boost::asio::ip::tcp::socket& s,
+                 const remote_t& r);
+// Same, within the limits of d
+void ssh_connect(LIBSSH2_SESSION *session, boost::asio::ip::tcp::socket& s,
+                 const remote_t& r, session_deadline& d);
+// Authenticate username by public key over a connected session
+int auth_pukey_mem(LIBSSH2_SESSION *session, boost::asio::ip::tcp::socket& s,
+                   const std::string& username, const key_pair& key,
+                   const char* keypass);
+// Politely end the SSH session, if the socket is still open
+void ssh_disconnect(LIBSSH2_SESSION *session,
+                    boost::asio::ip::tcp::socket& s);
+
+// A session and the connection it runs over; the session is disconnected
+// and freed with the instance
+struct ssh_conn {
+  boost::asio::ip::tcp::socket s;
+  LIBSSH2_SESSION *session;
+  explicit ssh_conn(boost::asio::io_context& io);
+  ssh_conn(const ssh_conn&) = delete;
+  ~ssh_conn();
+};
+
 // print human-readable rc in debug log
 void debug_rc(int rc);
 
@@ -0,0 +1,242 @@
+#include <memory>
+#include <boost/asio.hpp>
+
+#include "key_store.hpp"
+#include "metrics.hpp"
+#include "net.hpp"
+#include "ssh_async.hpp"
+#include "test.hpp"
+
+#include "log.hpp"
+
+using tcp = boost::asio::ip::tcp;
+
+boost::asio::socket_base::wait_type ssh2_wait_type(LIBSSH2_SESSION *session) {
+  // A stalled send must drain first; otherwise libssh2 waits for data
+  if (libssh2_session_block_directions(session) &
+      LIBSSH2_SESSION_BLOCK_OUTBOUND)
+    return tcp::socket::wait_write;
+  if (auto t = ssh2_transport::of(session))
+    if (t->stalled())
+      return tcp::socket::wait_write;
+  return tcp::socket::wait_read;
+}
+
+void ssh2_wait(LIBSSH2_SESSION *session, tcp::socket& s) {
+  io_batch::flush_all();
+  boost::system::error_code ec;
+  s.wait(ssh2_wait_type(session), ec);
+  if (ec)
+    LOG(debug) << "Waiting on socket: " << ec.message();
+}
+
+namespace {
+
+// State of one async_test_pubkey call, kept alive by the pending handlers.
+// Everything runs on strand: the io_context may be run by several threads,
+// and the expiry must not race with the step in progress.
+struct async_auth : std::enable_shared_from_this<async_auth> {
+  boost::asio::strand<boost::asio::io_context::executor_type> strand;
+  tcp::resolver resolver;
+  tcp::socket s;
+  remote_t r;
+  key_pair key;
+  const char* keypass;
+  auth_handler handler;
+  LIBSSH2_SESSION *session = nullptr;
+  std::shared_ptr<const key_tmpfiles> files;
+  // start of the current phase
+  std::chrono::steady_clock::time_point phase_start;
+  // end of the whole call, and time limit of the current phase
+  timer_wheel::clock_type::time_point end;
+  timer_wheel::timer deadline;
+  bool timed_out = false;
+  connect_canceller cancel_connect;
+
+  async_auth(boost::asio::io_context& io, const remote_t& r_,
+             key_pair k, const char* pass, auth_handler h)
+    : strand(boost::asio::make_strand(io)), resolver(strand), s(strand),
+      r(r_), key(std::move(k)), keypass(pass),
+      handler(std::move(h)),
+      end(r.timeouts.total.count() ?
+          timer_wheel::clock_type::now() + r.timeouts.total :
+          timer_wheel::clock_type::time_point::max()) {}
+
+  ~async_auth() {
+    boost::system::error_code ec;
+    s.close(ec);
+    if (session)
+      libssh2_session_free(session);
+  }
+
+  // Limit the phase starting now to limit (0: no limit but the total one)
+  void arm(std::chrono::milliseconds limit) {
+    auto when = end;
+    if (limit.count())
+      when = std::min(when, timer_wheel::clock_type::now() + limit);
+    // The wheel thread only hands the expiry over to the strand
+    deadline = timer_wheel::global().schedule(
+      when, [weak = weak_from_this(), strand = strand] {
+        boost::asio::post(strand, [weak] {
+          if (auto self = weak.lock())
+            self->expire();
+        });
+      });
+  }
+
+  // Abort whatever is in progress: its handler sees an error, which is
+  // then reported as a timeout
+  void expire() {
+    if (!handler)
+      return;
+    LOG(debug) << "Time limit reached for " << r.host;
+    timed_out = true;
+    resolver.cancel();
+    if (cancel_connect)
+      cancel_connect();
+    boost::system::error_code ec;
+    s.close(ec);
+  }
+
+  void fail(std::exception_ptr e) {
+    deadline.cancel();
+    auto h = std::move(handler);
+    if (timed_out)
+      return h(LIBSSH2_ERROR_SOCKET_TIMEOUT, nullptr);
+    h(0, e);
+  }
+
+  void done(int rc) {
+    deadline.cancel();
+    if (rc && timed_out)
+      rc = LIBSSH2_ERROR_SOCKET_TIMEOUT;
+    record_since(phase::auth, phase_start);
+    record_rc(rc);
+    debug_rc(rc);
+    auto h = std::move(handler);
+    h(rc, nullptr);
+  }
+
+  // Run f, reporting any exception it throws to the handler
+  template <typename F> void guard(F f) {
+    try {
+      f();
+    } catch (...) {
+      fail(std::current_exception());
+    }
+  }
+
+  void start() {
+    guard([this] {
+      session = make_session();
+      set_method_prefs(session, r.methods);
+    });
+    // Already reported
+    if (!handler)
+      return;
+    phase_start = std::chrono::steady_clock::now();
+    arm(r.timeouts.connect);
+    resolve_cache::global().async_resolve(
+      resolver, r.host, r.port,
+      [self = shared_from_this()](const boost::system::error_code& ec,
+                                  endpoints_t endpoints) {
+        record_since(phase::resolve, self->phase_start);
+        if (ec)
+          return self->guard([&] { THROW("Cannot resolve " + self->r.host +
+                                         ": " + ec.message()); });
+        self->connect(endpoints);
+      });
+  }
+
+  void connect(const endpoints_t& endpoints) {
+    cancel_connect = async_happy_connect(
+      strand, endpoints,
+      [self = shared_from_this()](const boost::system::error_code& ec,
+                                  tcp::socket connected) {
+        self->cancel_connect = nullptr;
+        record_since(phase::connect, self->phase_start);
+        if (ec)
+          return self->guard([&] { THROW("Cannot connect to " + self->r.host +
+                                         ": " + ec.message()); });
+        // Adopted rather than moved in, so that s stays on the strand
+        self->guard([&] {
+          auto protocol = connected.local_endpoint().protocol();
+          self->s.assign(protocol, connected.release());
+        });
+        if (!self->handler)
+          return;
+        self->arm(self->r.timeouts.handshake);
+        self->handshake();
+      }, connect_stagger, r.tuning);
+  }
+
+  void handshake() {
+    auto self = shared_from_this();
+    async_ssh2(session, s, [self] {
+      return libssh2_session_handshake(self->session, self->s.native_handle());
+    }, [self](int rc) {
+      record_since(phase::handshake, self->phase_start);
+      if (rc)
+        record_rc(rc);
+      self->guard([&] {
+        if (rc)
+          THROW("Failure establishing SSH session: " +
+                ssh2_err(self->session));
+#if defined TEST_WITH_KH_FP
+        _check_kh_fp(self->session, self->r);
+#endif
+        self->phase_start = std::chrono::steady_clock::now();
+        self->arm(self->r.timeouts.auth);
+        self->auth();
+      });
+    });
+  }
+
+  void auth() {
+    LOG(debug) << "Using provided key data for user "
+               << r.username;
+    if (!ssh2_frommemory_supported())
+      return auth_file();
+    auto self = shared_from_this();
+    auto priv = std::make_shared<unlocked_key>(key.priv(), keypass);
+    if (priv->wrong_pass)
+      return done(LIBSSH2_ERROR_PUBLICKEY_UNVERIFIED);
+    async_ssh2(session, s, [self, priv] {
+      return libssh2_userauth_publickey_frommemory(
+        self->session,
+        self->r.username.c_str(), self->r.username.size(),
+        self->key.pub().data(), self->key.pub().size(),
+        priv->data.data(), priv->data.size(), priv->pass);
+    }, [self](int rc) {
+#if !defined HAVE_LIBSSH2_CRYPTOENGINE_API
+      if (rc == LIBSSH2_ERROR_PUBLICKEY_UNVERIFIED)
+        return self->guard([&] { self->auth_file(); });
+#endif
+      self->done(rc);
+    });
+  }
+
+  void auth_file() {
+    files = cached_key_tmpfiles(key);
+    auto self = shared_from_this();
+    async_ssh2(session, s, [self] {
+      return libssh2_userauth_publickey_fromfile(
+        self->session, self->r.username.c_str(),
+        self->files->pub().c_str(), self->files->priv().c_str(),
+        self->keypass);
+    }, [self](int rc) {
+      self->files.reset();
+      self->done(rc);
+    });
+  }
+};
+
+}
+
+void async_test_pubkey(boost::asio::io_context& io, const remote_t& r,
+                       key_pair key, const char* keypass,
+                       auth_handler handler) {
+  auto op = std::make_shared<async_auth>(io, r, std::move(key), keypass,
+                                        std::move(handler));
+  boost::asio::dispatch(op->strand, [op] { op->start(); });
+}
@@ -0,0 +1,84 @@
+#if !defined TEST_SSH_ASYNC_HPP_INCLUDED
+#define TEST_SSH_ASYNC_HPP_INCLUDED
+
+#include <exception>
+#include <functional>
+#include <string>
+#include <boost/asio.hpp>
+
+#include "ssh.hpp"
+#include "transport.hpp"
+
+// Wait (without spinning) until the socket is ready in the direction
+// libssh2 reported being blocked on, once the output held back by an
+// io_batch on this thread is written
+void ssh2_wait(LIBSSH2_SESSION *session, boost::asio::ip::tcp::socket& s);
+
+// Call a non-blocking libssh2 function until it stops returning EAGAIN.
+// The packets of each call are written together.
+template <typename Op>
+int ssh2_retry(LIBSSH2_SESSION *session, boost::asio::ip::tcp::socket& s,
+               Op op) {
+  for (;;) {
+    int rc;
+    {
+      io_batch _batch;
+      rc = op();
+    }
+    if (rc != LIBSSH2_ERROR_EAGAIN)
+      return rc;
+    ssh2_wait(session, s);
+  }
+}
+
+// Socket readiness libssh2 is waiting for, or room for output the
+// session transport holds back
+boost::asio::socket_base::wait_type ssh2_wait_type(LIBSSH2_SESSION *session);
+
+// Asynchronous ssh2_retry: handler(rc) is invoked once op returns anything
+// else than EAGAIN. A socket error while waiting is reported as
+// LIBSSH2_ERROR_SOCKET_RECV.
+template <typename Op, typename Handler>
+void async_ssh2(LIBSSH2_SESSION *session, boost::asio::ip::tcp::socket& s,
+                Op op, Handler handler) {
+  int rc;
+  {
+    io_batch _batch;
+    rc = op();
+  }
+  if (rc != LIBSSH2_ERROR_EAGAIN)
+    return handler(rc);
+  // What to wait for is known once the output held back is written
+  io_batch::after_flush([session, &s, op = std::move(op),
+                         handler = std::move(handler)]() mutable {
+    s.async_wait(ssh2_wait_type(session),
+                 [session, &s, op = std::move(op),
+                  handler = std::move(handler)]
+                 (const boost::system::error_code& ec) mutable {
+                   if (ec)
+                     return handler(int(LIBSSH2_ERROR_SOCKET_RECV));
+                   async_ssh2(session, s, std::move(op), std::move(handler));
+                 });
+  });
+}
+
+// Called once per async_test_pubkey: rc is the authentication result, or
+// error is set if the session could not be established
+using auth_handler = std::function<void(int rc, std::exception_ptr error)>;
+
+// Resolve, connect, handshake, check host key and authenticate by public
+// key, all driven by io. Many calls can share one io_context, and the
+// key material of key.
+void async_test_pubkey(boost::asio::io_context& io, const remote_t& r,
+                       key_pair key, const char* keypass,
+                       auth_handler handler);
+// Same, with a copy of the key material
+inline void async_test_pubkey(boost::asio::io_context& io, const remote_t& r,
+                              std::string_view pubkeydata,
+                              std::string_view keydata, const char* keypass,
+                              auth_handler handler) {
+  async_test_pubkey(io, r, key_pair(pubkeydata, keydata), keypass,
+                    std::move(handler));
+}
+
+#endif// TEST_SSH_ASYNC_HPP_INCLUDED
@@ -4,37 +4,53 @@
 #include <thread>
 #include <boost/asio.hpp>
 
+#include "arena.hpp"
+#include "known_hosts.hpp"
+#include "metrics.hpp"
 #include "ssh.hpp"
+#include "transport.hpp"
 #include "test.hpp"
 #include "utils.hpp"
 
-#include <boost/log/trivial.hpp>
+#include "log.hpp"
 
 using namespace boost::filesystem;
 
-static bool sshInit = false;
-static std::mutex sMutex;
-LIBSSH2_SESSION *make_session(void) {
-  if (!sshInit) {
-    std::lock_guard _lock(sMutex);
-    if (!sshInit) {
-      int rc;
+namespace {
+
+// Process-wide libssh2 (and Winsock) setup, done once by the first
+// session; a failure is thrown again on the next attempt
+struct ssh2_library {
+  ssh2_library() {
+    int rc;
 #if defined _WIN32 || defined _WIN64
-      WSADATA wsadata;
+    WSADATA wsadata;
 
-      rc = WSAStartup(MAKEWORD(2, 0), &wsadata);
-      if (rc != 0)
-        THROW("WSAStartup failed with error: " + std::to_string(rc));
+    rc = WSAStartup(MAKEWORD(2, 0), &wsadata);
+    if (rc != 0)
+      THROW("WSAStartup failed with error: " + std::to_string(rc));
 #endif
-      rc = libssh2_init(0);
-      if (rc != 0)
-        THROW("libssh2 initialization failed: " + std::to_string(rc));
-      sshInit = true;
-    }
+    rc = libssh2_init(0);
+    if (rc != 0)
+      THROW("libssh2 initialization failed: " + std::to_string(rc));
   }
-  LIBSSH2_SESSION* session = libssh2_session_init();
+};
+
+}
+
+LIBSSH2_SESSION *make_session(void) {
+  static ssh2_library library;
+  // Allocations of the session stay within its own arena
+  LIBSSH2_SESSION* session = session_arena::init_session();
   if (!session)
     THROW("session initialization failed");
+  // Socket writes can be batched (see io_batch)
+  try {
+    ssh2_transport::install(session);
+  } catch (...) {
+    libssh2_session_free(session);
+    throw;
+  }
   // tell libssh2 we want it all done non-blocking
   libssh2_session_set_blocking(session, 0);
   return session;
@@ -75,63 +91,37 @@ static std::string type2string(int type) {
   return std::to_string(type);
 }
 
-void _check_kh_fp(LIBSSH2_SESSION *session) {
-  LIBSSH2_KNOWNHOSTS* nh = libssh2_knownhost_init(session);
-  if (!nh)
-    THROW("Cannot init knownhost");
-  auto_del<LIBSSH2_KNOWNHOSTS, void, libssh2_knownhost_free> _nh(nh);
-
-  // read all hosts from here
-  path kh_file = home() / ".ssh" / "known_hosts";
-  if (exists(kh_file))
-    libssh2_knownhost_readfile(nh, kh_file.string().c_str(),
-                               LIBSSH2_KNOWNHOST_FILE_OPENSSH);
-  kh_file = home() / ".ssh" / "known_hosts2";
-  if (exists(kh_file))
-    libssh2_knownhost_readfile(nh, kh_file.string().c_str(),
-                               LIBSSH2_KNOWNHOST_FILE_OPENSSH);
-#if !defined _WIN32 && !defined _WIN64
-  kh_file = "/etc/ssh/ssh_known_hosts";
-  if (exists(kh_file))
-    libssh2_knownhost_readfile(nh, kh_file.string().c_str(),
-                               LIBSSH2_KNOWNHOST_FILE_OPENSSH);
-  kh_file = "/etc/ssh/ssh_known_hosts2";
-  if (exists(kh_file))
-    libssh2_knownhost_readfile(nh, kh_file.string().c_str(),
-                               LIBSSH2_KNOWNHOST_FILE_OPENSSH);
-#endif
+void _check_kh_fp(LIBSSH2_SESSION *session, const remote_t& r) {
+  phase_timer _timer(phase::hostkey);
+  // known_hosts files are parsed once and shared by all sessions
+  auto kh = known_hosts_store::get();
 
   size_t len = 0;
   int type;
   const char *fingerprint = libssh2_session_hostkey(session, &len, &type);
   if (!fingerprint)
     THROW("Cannot get fingerprint: " + ssh2_err(session));
-  BOOST_LOG_TRIVIAL(trace) << "fingerprint type " << type2string(type)
-                           << ": " << base64dump(fingerprint, len);
-  struct libssh2_knownhost *host;
-  int check = libssh2_knownhost_checkp(nh, remote.host.c_str(), remote.portn(),
-                                       fingerprint, len,
-                                       LIBSSH2_KNOWNHOST_TYPE_PLAIN|LIBSSH2_KNOWNHOST_KEYENC_RAW,
-                                       &host);
-  // At this point, we could verify that 'check' tells us the key is fine or bail out.
-  BOOST_LOG_TRIVIAL(trace) << "libssh2_knownhost_checkp returned " << check;
-  if (remote.check_host) {
+  LOG(trace) << "fingerprint type " << type2string(type)
+             << ": " << base64dump(fingerprint, len);
+  int check = kh->check(r.host, r.portn(), fingerprint, len);
+  LOG(trace) << "known hosts check returned " << check;
+  if (r.check_host) {
     switch (check) {
       case LIBSSH2_KNOWNHOST_CHECK_FAILURE:
         THROW("Cannot check host against known hosts");
       case LIBSSH2_KNOWNHOST_CHECK_NOTFOUND:
-        if (!remote.allow_unknown)
+        if (!r.allow_unknown)
           THROW("Unknown host fingerprint");
         else
-          BOOST_LOG_TRIVIAL(debug) << "Unknown host fingerprint, ignoring";
+          LOG(debug) << "Unknown host fingerprint, ignoring";
         break;
       case LIBSSH2_KNOWNHOST_CHECK_MISMATCH:
-        BOOST_LOG_TRIVIAL(info) << "You may need to run `ssh-keyscan "
-                                << "-t <type> >> ~/.ssh/known_hosts "
-                                << remote.host << "` to allow key";
+        LOG(info) << "You may need to run `ssh-keyscan "
+                  << "-t <type> >> ~/.ssh/known_hosts "
+                  << r.host << "` to allow key";
         THROW("Host fingerprint mismatch!");
       case LIBSSH2_KNOWNHOST_CHECK_MATCH:
-        BOOST_LOG_TRIVIAL(debug) << "Host key matches with known_hosts";
+        LOG(debug) << "Host key matches with known_hosts";
     }
   }
 }
@@ -139,19 +129,19 @@ void _check_kh_fp(LIBSSH2_SESSION *session) {
 void debug_rc(int rc) {
   switch (rc) {
     case LIBSSH2_ERROR_AUTHENTICATION_FAILED:
-      BOOST_LOG_TRIVIAL(debug) << "LIBSSH2_ERROR_AUTHENTICATION_FAILED";
+      LOG(debug) << "LIBSSH2_ERROR_AUTHENTICATION_FAILED";
       break;
     case LIBSSH2_ERROR_PUBLICKEY_UNVERIFIED:
-      BOOST_LOG_TRIVIAL(debug) << "LIBSSH2_ERROR_PUBLICKEY_UNVERIFIED";
+      LOG(debug) << "LIBSSH2_ERROR_PUBLICKEY_UNVERIFIED";
       break;
     case LIBSSH2_ERROR_ALLOC:
-      BOOST_LOG_TRIVIAL(debug) << "LIBSSH2_ERROR_ALLOC";
+      LOG(debug) << "LIBSSH2_ERROR_ALLOC";
       break;
     case LIBSSH2_ERROR_SOCKET_SEND:
-      BOOST_LOG_TRIVIAL(debug) << "LIBSSH2_ERROR_SOCKET_SEND";
+      LOG(debug) << "LIBSSH2_ERROR_SOCKET_SEND";
         break;
     case LIBSSH2_ERROR_SOCKET_TIMEOUT:
-      BOOST_LOG_TRIVIAL(debug) << "LIBSSH2_ERROR_SOCKET_TIMEOUT";
+      LOG(debug) << "LIBSSH2_ERROR_SOCKET_TIMEOUT";
       break;
     default: break;
   }
@@ -0,0 +1,437 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "arena.hpp"
+#include "test.hpp"
+#include "transport.hpp"
+
+#if defined HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "log.hpp"
+
+namespace {
+
+#if defined HAVE_IO_URING
+// Just enough io_uring to submit a batch of sends and reap their results,
+// without liburing
+class uring {
+  int fd = -1;
+  void* sq_map = MAP_FAILED;
+  size_t sq_len = 0;
+  void* cq_map = MAP_FAILED;
+  size_t cq_len = 0;
+  io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+  size_t sqes_len = 0;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  io_uring_cqe* cqes;
+
+  template <typename T> T* at(void* map, unsigned off) {
+    return reinterpret_cast<T*>(static_cast<char*>(map) + off);
+  }
+
+public:
+  struct send_op {
+    int fd;
+    const char* data;
+    size_t len;
+    // bytes sent or -errno, as from send(2)
+    int res;
+  };
+  // submission queue size, 0 if io_uring cannot be used
+  unsigned entries = 0;
+
+  explicit uring(unsigned n) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    fd = int(syscall(__NR_io_uring_setup, n, &p));
+    if (fd < 0) {
+      LOG(debug) << "io_uring unavailable: " << strerror(errno);
+      return;
+    }
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+      sq_len = cq_len = std::max(sq_len, cq_len);
+    sq_map = mmap(nullptr, sq_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_map == MAP_FAILED)
+      return;
+    cq_map = single ? sq_map :
+      mmap(nullptr, cq_len, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq_map == MAP_FAILED)
+      return;
+    sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe*>(
+      mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+    if (sqes == MAP_FAILED)
+      return;
+    sq_tail = at<unsigned>(sq_map, p.sq_off.tail);
+    sq_mask = at<unsigned>(sq_map, p.sq_off.ring_mask);
+    sq_array = at<unsigned>(sq_map, p.sq_off.array);
+    cq_head = at<unsigned>(cq_map, p.cq_off.head);
+    cq_tail = at<unsigned>(cq_map, p.cq_off.tail);
+    cq_mask = at<unsigned>(cq_map, p.cq_off.ring_mask);
+    cqes = at<io_uring_cqe>(cq_map, p.cq_off.cqes);
+    entries = p.sq_entries;
+  }
+  uring(const uring&) = delete;
+
+  ~uring() {
+    if (sqes != MAP_FAILED)
+      munmap(sqes, sqes_len);
+    if (cq_map != MAP_FAILED && cq_map != sq_map)
+      munmap(cq_map, cq_len);
+    if (sq_map != MAP_FAILED)
+      munmap(sq_map, sq_len);
+    if (fd >= 0)
+      ::close(fd);
+  }
+
+  // Submit up to entries sends at once, none waiting for socket room, and
+  // wait for all their results. false if the ring failed, which is then
+  // unusable: ops were not or partly run.
+  bool send(send_op* ops, unsigned n) {
+    unsigned tail = *sq_tail;
+    for (unsigned i = 0; i < n; ++i, ++tail) {
+      unsigned idx = tail & *sq_mask;
+      io_uring_sqe& e = sqes[idx];
+      memset(&e, 0, sizeof(e));
+      e.opcode = IORING_OP_SEND;
+      e.fd = ops[i].fd;
+      e.addr = reinterpret_cast<uintptr_t>(ops[i].data);
+      e.len = unsigned(std::min<size_t>(ops[i].len, 1u << 30));
+      e.msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+      e.user_data = i;
+      sq_array[idx] = idx;
+    }
+    __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+    unsigned submit = n, reaped = 0;
+    while (reaped < n) {
+      int rc = int(syscall(__NR_io_uring_enter, fd, submit, n - reaped,
+                           IORING_ENTER_GETEVENTS, nullptr, 0));
+      if (rc < 0 && errno != EINTR) {
+        LOG(warning) << "io_uring_enter failed: " << strerror(errno);
+        entries = 0;
+        return false;
+      }
+      if (rc > 0)
+        submit -= std::min(submit, unsigned(rc));
+      unsigned head = *cq_head;
+      unsigned end = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+      for (; head != end; ++head, ++reaped) {
+        const io_uring_cqe& c = cqes[head & *cq_mask];
+        ops[c.user_data].res = c.res;
+      }
+      __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+    return true;
+  }
+};
+#endif
+
+struct batch_state {
+  unsigned depth = 0;
+  // transports holding output back; the same one may appear twice
+  std::vector<std::shared_ptr<ssh2_transport>> queued;
+  std::vector<std::function<void()>> after;
+  size_t syscalls = 0;
+#if defined HAVE_IO_URING
+  std::unique_ptr<uring> ring;
+  bool ring_tried = false;
+#endif
+};
+thread_local batch_state batch;
+
+#if defined HAVE_IO_URING
+uring* thread_ring() {
+  if (!batch.ring_tried) {
+    batch.ring_tried = true;
+    batch.ring = std::make_unique<uring>(64);
+  }
+  return batch.ring && batch.ring->entries ? batch.ring.get() : nullptr;
+}
+#endif
+
+ssize_t send_cb(libssh2_socket_t fd, const void* buf, size_t len, int flags,
+                void** abstract) {
+  return static_cast<session_arena*>(*abstract)->transport->send(fd, buf, len,
+                                                                 flags);
+}
+
+ssize_t recv_cb(libssh2_socket_t fd, void* buf, size_t len, int flags,
+                void** abstract) {
+  return static_cast<session_arena*>(*abstract)->transport->recv(fd, buf, len,
+                                                                 flags);
+}
+
+template <typename F> void set_callback(LIBSSH2_SESSION *session, int type,
+                                        F* f) {
+#if LIBSSH2_VERSION_NUM >= 0x010b01
+  libssh2_session_callback_set2(session, type,
+                                reinterpret_cast<libssh2_cb_generic*>(f));
+#else
+  libssh2_session_callback_set(session, type, reinterpret_cast<void*>(f));
+#endif
+}
+
+}
+
+void ssh2_transport::install(LIBSSH2_SESSION *session) {
+  session_arena::of(session).transport = std::make_shared<ssh2_transport>();
+  set_callback(session, LIBSSH2_CALLBACK_SEND, send_cb);
+  set_callback(session, LIBSSH2_CALLBACK_RECV, recv_cb);
+}
+
+ssh2_transport* ssh2_transport::of(LIBSSH2_SESSION *session) {
+  return session_arena::of(session).transport.get();
+}
+
+ssize_t ssh2_transport::send_now(const void* buf, size_t len, int flags) {
+  ++batch.syscalls;
+  ssize_t n = ::send(fd, buf, len, flags | MSG_NOSIGNAL);
+  return n < 0 ? -errno : n;
+}
+
+void ssh2_transport::written(size_t n) {
+  sent += n;
+  if (sent == out.size()) {
+    out.clear();
+    sent = 0;
+  }
+}
+
+void ssh2_transport::queue() {
+  if (queued_in == &batch)
+    return;
+  queued_in = &batch;
+  batch.queued.push_back(shared_from_this());
+}
+
+ssize_t ssh2_transport::send(int s, const void* buf, size_t len, int flags) {
+  std::lock_guard _lock(m);
+  fd = s;
+  if (closed)
+    return -EBADF;
+  if (error)
+    return -error;
+  bool hold = io_batch::active();
+  if (!pending_locked() && (!hold || len > max_pending))
+    return send_now(buf, len, flags);
+  if (pending_locked() + len > max_pending) {
+    flush_locked();
+    if (error)
+      return -error;
+    if (!pending_locked() && len > max_pending)
+      return send_now(buf, len, flags);
+    if (pending_locked() + len > max_pending)
+      return -EAGAIN;
+  }
+  if (sent > out.size() / 2) {
+    out.erase(0, sent);
+    sent = 0;
+  }
+  if (!pending_locked())
+    fresh = true;
+  out.append(static_cast<const char*>(buf), len);
+  if (hold)
+    queue();
+  else
+    flush_locked();
+  return ssize_t(len);
+}
+
+ssize_t ssh2_transport::recv(int s, void* buf, size_t len, int flags) {
+  std::lock_guard _lock(m);
+  fd = s;
+  if (closed)
+    return -EBADF;
+  if (pending_locked()) {
+    // Nothing can answer output that never left: no need to ask
+    if (fresh && io_batch::active()) {
+      queue();
+      return -EAGAIN;
+    }
+    flush_locked();
+  }
+  if (error)
+    return -error;
+  ssize_t n = ::recv(fd, buf, len, flags);
+  return n < 0 ? -errno : n;
+}
+
+size_t ssh2_transport::pending() const {
+  std::lock_guard _lock(m);
+  return pending_locked();
+}
+
+bool ssh2_transport::stalled() const {
+  std::lock_guard _lock(m);
+  return pending_locked() && !fresh;
+}
+
+void ssh2_transport::flush() {
+  std::lock_guard _lock(m);
+  flush_locked();
+}
+
+void ssh2_transport::flush_locked() {
+  fresh = false;
+  while (!closed && !error && pending_locked()) {
+    ssize_t n = send_now(out.data() + sent, pending_locked(), MSG_DONTWAIT);
+    if (n == -EINTR)
+      continue;
+    if (n < 0) {
+      if (n != -EAGAIN && n != -EWOULDBLOCK)
+        error = int(-n);
+      break;
+    }
+    written(size_t(n));
+  }
+}
+
+void ssh2_transport::close() {
+  std::lock_guard _lock(m);
+  closed = true;
+  out.clear();
+  sent = 0;
+}
+
+io_batch::io_batch() {
+  ++batch.depth;
+}
+
+io_batch::~io_batch() {
+  if (--batch.depth == 0)
+    flush_all();
+}
+
+bool io_batch::active() {
+  return batch.depth != 0;
+}
+
+void io_batch::write_queued() {
+  if (batch.queued.empty())
+    return;
+  auto queued = std::move(batch.queued);
+  batch.queued.clear();
+  std::sort(queued.begin(), queued.end());
+  queued.erase(std::unique(queued.begin(), queued.end()), queued.end());
+  // Locked in address order: flushes on other threads may hold some
+  std::vector<std::unique_lock<std::mutex>> locks;
+  locks.reserve(queued.size());
+  for (const auto& t : queued) {
+    locks.emplace_back(t->m);
+    if (t->queued_in == &batch)
+      t->queued_in = nullptr;
+  }
+#if defined HAVE_IO_URING
+  if (uring* ring = thread_ring()) {
+    std::vector<uring::send_op> ops;
+    std::vector<ssh2_transport*> owners;
+    auto submit = [&] {
+      if (ops.empty())
+        return true;
+      ++batch.syscalls;
+      if (!ring->send(ops.data(), unsigned(ops.size())))
+        return false;
+      for (size_t i = 0; i < ops.size(); ++i) {
+        ssh2_transport* t = owners[i];
+        int res = ops[i].res;
+        if (res >= 0)
+          t->written(size_t(res));
+        else if (res == -EINVAL) {
+          // Kernel without IORING_OP_SEND: no use trying the ring again
+          ring->entries = 0;
+          t->flush_locked();
+        }
+        else if (res != -EAGAIN && res != -EWOULDBLOCK && res != -EINTR)
+          t->error = -res;
+      }
+      ops.clear();
+      owners.clear();
+      return true;
+    };
+    bool ok = true;
+    for (const auto& t : queued) {
+      t->fresh = false;
+      if (t->closed || t->error || !t->pending_locked())
+        continue;
+      if (!ring->entries) {
+        t->flush_locked();
+        continue;
+      }
+      ops.push_back(uring::send_op{ t->fd, t->out.data() + t->sent,
+                                    t->pending_locked(), 0 });
+      owners.push_back(t.get());
+      if (ops.size() == ring->entries && !(ok = submit()))
+        break;
+    }
+    if (ok && submit())
+      return;
+    // The ring broke midway: what it sent is unknown, drop that output
+    for (auto* t : owners)
+      t->error = EIO;
+    for (const auto& t : queued)
+      t->flush_locked();
+    return;
+  }
+#endif
+  for (const auto& t : queued)
+    t->flush_locked();
+}
+
+void io_batch::flush_all() {
+  write_queued();
+  while (!batch.after.empty()) {
+    auto after = std::move(batch.after);
+    batch.after.clear();
+    for (auto& f : after)
+      f();
+  }
+}
+
+void io_batch::after_flush(std::function<void()> f) {
+  if (!active())
+    return f();
+  batch.after.push_back(std::move(f));
+}
+
+bool io_batch::uses_uring() {
+#if defined HAVE_IO_URING
+  return thread_ring() != nullptr;
+#else
+  return false;
+#endif
+}
+
+void io_batch::enable_uring(bool on) {
+#if defined HAVE_IO_URING
+  batch.ring_tried = !on;
+  batch.ring.reset();
+#endif
+}
+
+size_t io_batch::syscalls() {
+  return batch.syscalls;
+}
+
+void run_batched(boost::asio::io_context& io) {
+  for (;;) {
+    io_batch _batch;
+    if (!io.run_one())
+      break;
+    io.poll();
+  }
+}
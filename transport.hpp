@@ -0,0 +1,98 @@
+#if !defined TEST_TRANSPORT_HPP_INCLUDED
+#define TEST_TRANSPORT_HPP_INCLUDED
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <boost/asio.hpp>
+#include <libssh2.h>
+
+// Socket I/O of one libssh2 session, installed through the send and recv
+// callbacks. Outside of an io_batch, bytes go straight to the socket as
+// libssh2 would send them. Within one, output is held back and written
+// when the batch ends, together with that of the other sessions.
+class ssh2_transport : public std::enable_shared_from_this<ssh2_transport> {
+  friend class io_batch;
+  mutable std::mutex m;
+  int fd = -1;
+  // output accepted from libssh2, written up to sent
+  std::string out;
+  size_t sent = 0;
+  // no write of the pending output was tried yet: the peer cannot have
+  // answered it
+  bool fresh = false;
+  // errno of a failed write, reported by the next call
+  int error = 0;
+  bool closed = false;
+  // batch of the thread that queued the transport last
+  const void* queued_in = nullptr;
+  size_t pending_locked() const { return out.size() - sent; }
+  ssize_t send_now(const void* buf, size_t len, int flags);
+  void flush_locked();
+  void written(size_t n);
+  void queue();
+public:
+  // Output held back at most; libssh2 gets EAGAIN past it
+  static const size_t max_pending = 1 << 20;
+
+  ssh2_transport() = default;
+  ssh2_transport(const ssh2_transport&) = delete;
+
+  // Route the socket I/O of session (made by make_session) through a new
+  // transport, released with the session
+  static void install(LIBSSH2_SESSION *session);
+  // Transport of session, nullptr if none was installed
+  static ssh2_transport* of(LIBSSH2_SESSION *session);
+
+  // libssh2 callback semantics: bytes moved or -errno
+  ssize_t send(int fd, const void* buf, size_t len, int flags);
+  ssize_t recv(int fd, void* buf, size_t len, int flags);
+  // Output accepted but not written yet
+  size_t pending() const;
+  // Output left over by a write the socket did not take whole
+  bool stalled() const;
+  // Write pending output, as far as the socket takes it without blocking
+  void flush();
+  // Drop pending output and refuse any further I/O: the socket may be
+  // closed and its descriptor reused
+  void close();
+};
+
+// While an instance lives on a thread, sessions used on this thread hold
+// their output back. The outermost instance writes it all when it goes:
+// in one io_uring submission for every session when the kernel has
+// io_uring, with one send per session otherwise. Waiting on a socket in
+// the meantime must be preceded by flush_all().
+class io_batch {
+public:
+  io_batch();
+  io_batch(const io_batch&) = delete;
+  ~io_batch();
+
+  // Whether an io_batch lives on this thread
+  static bool active();
+  // Write the output held back on this thread now, then run the
+  // after_flush callbacks
+  static void flush_all();
+  // Run f once the output held back on this thread is written: now if no
+  // io_batch is active
+  static void after_flush(std::function<void()> f);
+  // Whether flushes on this thread go through io_uring
+  static bool uses_uring();
+  // Allow io_uring for flushes on this thread (the default), or make one
+  // send per session, e.g. to compare
+  static void enable_uring(bool on);
+  // Socket writes (system calls) made by transports on this thread
+  static size_t syscalls();
+
+private:
+  static void write_queued();
+};
+
+// io.run(), writing the output of all handlers ready at once together
+// before waiting for more
+void run_batched(boost::asio::io_context& io);
+
+#endif// TEST_TRANSPORT_HPP_INCLUDED
@@ -0,0 +1,507 @@
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <vector>
+
+#include "lines.hpp"
+#include "ssh.hpp"
+#include "ssh_async.hpp"
+#include "test.hpp"
+#include "tunnel.hpp"
+
+#include "log.hpp"
+
+using boost::asio::ip::tcp;
+using clock_type = std::chrono::steady_clock;
+
+static double rate(uint64_t bytes, clock_type::duration elapsed) {
+  double s = std::chrono::duration<double>(elapsed).count();
+  return s > 0 ? bytes / s : 0;
+}
+
+double tunnel_stats::out_rate() const { return rate(bytes_out, elapsed); }
+double tunnel_stats::in_rate() const { return rate(bytes_in, elapsed); }
+
+namespace {
+
+void put_u32(std::string& m, uint32_t v) {
+  const char b[] = { char(v >> 24), char(v >> 16), char(v >> 8), char(v) };
+  m.append(b, sizeof(b));
+}
+
+void put_string(std::string& m, const std::string& s) {
+  put_u32(m, s.size());
+  m += s;
+}
+
+// Output a libssh2 call may add to the session transport: a full data
+// packet, with room to spare
+const size_t packet_room = 64 << 10;
+
+}
+
+// Everything the handlers work on, kept alive by them. All of it but the
+// counters is used from the thread running the io_context only.
+struct ssh_forwarder::state : std::enable_shared_from_this<state> {
+  // A forwarded port
+  struct tunnel {
+    tcp::acceptor acceptor;
+    std::string host;
+    unsigned short port;
+    clock_type::time_point start = clock_type::now();
+    std::atomic<uint64_t> accepted{ 0 }, open{ 0 }, failed{ 0 },
+      bytes_out{ 0 }, bytes_in{ 0 };
+    tunnel(boost::asio::io_context& io, const std::string& h,
+           unsigned short p) : acceptor(io), host(h), port(p) {}
+  };
+
+  // A forwarded connection. Data goes through two buffers of the pool,
+  // from the socket to the channel and back, without other copies.
+  struct relay {
+    std::shared_ptr<state> owner;
+    tunnel& t;
+    tcp::socket local;
+    // direct-tcpip request, the same while the channel is opened
+    std::string open_msg;
+    LIBSSH2_CHANNEL *channel = nullptr;
+    // read from local, written to the channel from up_off
+    char* up;
+    size_t up_len = 0, up_off = 0;
+    // read from the channel, being written to local
+    char* down;
+    bool reading = false, writing = false;
+    // local has sent everything, and the channel was told so
+    bool local_eof = false, eof_sent = false;
+    // the target has sent everything
+    bool remote_eof = false;
+    // to be dropped, with its channel
+    bool done = false;
+
+    relay(std::shared_ptr<state> o, tunnel& t_, tcp::socket s, char* u,
+          char* d)
+      : owner(std::move(o)), t(t_), local(std::move(s)), up(u), down(d) {}
+    relay(const relay&) = delete;
+    ~relay() {
+      owner->buffers.put(up);
+      owner->buffers.put(down);
+      --t.open;
+    }
+  };
+
+  LIBSSH2_SESSION *session;
+  tcp::socket& s;
+  const options opts;
+  buffer_pool buffers;
+  mutable std::mutex m;
+  // never shrinks, so that stats() can read it from other threads
+  std::vector<std::unique_ptr<tunnel>> tunnels;
+  // waiting for their channel; the session opens one at a time
+  std::deque<std::shared_ptr<relay>> opening;
+  std::list<std::shared_ptr<relay>> relays;
+  // channels of dropped relays, until libssh2 is done closing them
+  std::vector<LIBSSH2_CHANNEL*> freeing;
+  bool wait_read = false, wait_write = false;
+  // libssh2 is opening the channel of opening.front()
+  bool open_started = false;
+  // a pass stopped for lack of room in the session transport
+  bool congested = false;
+  bool closed = false;
+
+  state(LIBSSH2_SESSION *session_, tcp::socket& s_, const options& o)
+    : session(session_), s(s_), opts(o),
+      buffers(o.buffer_size, 2 * std::max<size_t>(o.max_connections, 1)) {}
+
+  // Whether the next libssh2 call can send without being refused: a
+  // refused send leaves a packet in libssh2 that must be resumed before
+  // any other, which relays sharing the session cannot ensure
+  bool room() const {
+    auto t = ssh2_transport::of(session);
+    return !t || t->pending() + packet_room <= ssh2_transport::max_pending;
+  }
+
+  void accept(tunnel& t) {
+    auto self = shared_from_this();
+    t.acceptor.async_accept([self, &t](const boost::system::error_code& ec,
+                                       tcp::socket sock) {
+      if (self->closed || ec == boost::asio::error::operation_aborted)
+        return;
+      if (ec)
+        LOG(warning) << "Accepting forwarded connection: " << ec.message();
+      else
+        self->start(t, std::move(sock));
+      self->accept(t);
+    });
+  }
+
+  void start(tunnel& t, tcp::socket sock) {
+    ++t.accepted;
+    char* up = buffers.get();
+    char* down = up ? buffers.get() : nullptr;
+    if (!down) {
+      if (up)
+        buffers.put(up);
+      ++t.failed;
+      LOG(warning) << "Refusing forwarded connection: "
+                   << opts.max_connections << " already open";
+      return;
+    }
+    ++t.open;
+    tune_socket(sock, opts.tuning);
+    boost::system::error_code ec;
+    auto peer = sock.remote_endpoint(ec);
+    auto r = std::make_shared<relay>(shared_from_this(), t, std::move(sock),
+                                     up, down);
+    put_string(r->open_msg, t.host);
+    put_u32(r->open_msg, t.port);
+    put_string(r->open_msg, peer.address().to_string());
+    put_u32(r->open_msg, peer.port());
+    opening.push_back(std::move(r));
+    pump();
+  }
+
+  // Drop r at the end of the pass, counting it as failed
+  void fail(relay& r, const std::string& why) {
+    if (r.done)
+      return;
+    LOG(debug) << "Forwarded connection to " << r.t.host << ':' << r.t.port
+               << ": " << why;
+    ++r.t.failed;
+    r.done = true;
+    boost::system::error_code ec;
+    r.local.close(ec);
+  }
+
+  void read_local(const std::shared_ptr<relay>& r) {
+    if (r->reading || r->local_eof || r->done)
+      return;
+    r->reading = true;
+    r->local.async_read_some(
+      boost::asio::buffer(r->up, opts.buffer_size),
+      [self = shared_from_this(), r](const boost::system::error_code& ec,
+                                     size_t n) {
+        r->reading = false;
+        if (self->closed || r->done)
+          return;
+        if (ec == boost::asio::error::eof)
+          r->local_eof = true;
+        else if (ec)
+          self->fail(*r, ec.message());
+        else
+          r->up_len = n;
+        self->pump();
+      });
+  }
+
+  void write_local(const std::shared_ptr<relay>& r, size_t n) {
+    r->writing = true;
+    boost::asio::async_write(
+      r->local, boost::asio::buffer(r->down, n),
+      [self = shared_from_this(), r](const boost::system::error_code& ec,
+                                     size_t) {
+        r->writing = false;
+        if (self->closed || r->done)
+          return;
+        if (ec)
+          self->fail(*r, ec.message());
+        self->pump();
+      });
+  }
+
+  // Open the channel of the first relay waiting for one: 0 when done,
+  // LIBSSH2_ERROR_EAGAIN if it has to be resumed
+  int open_channel() {
+    auto& r = opening.front();
+    r->channel = libssh2_channel_open_ex(
+      session, "direct-tcpip", sizeof("direct-tcpip") - 1, opts.window,
+      LIBSSH2_CHANNEL_PACKET_DEFAULT, r->open_msg.data(), r->open_msg.size());
+    if (!r->channel &&
+        libssh2_session_last_errno(session) == LIBSSH2_ERROR_EAGAIN) {
+      open_started = true;
+      return LIBSSH2_ERROR_EAGAIN;
+    }
+    open_started = false;
+    return 0;
+  }
+
+  void open_channels() {
+    while (!opening.empty()) {
+      auto r = opening.front();
+      // Once started, an open must be seen through: libssh2 resumes it
+      // whatever the next call asks for
+      if (!r->done || open_started) {
+        if (!room()) {
+          congested = true;
+          return;
+        }
+        if (open_channel() == LIBSSH2_ERROR_EAGAIN)
+          return;
+      }
+      opening.pop_front();
+      if (r->channel && r->done) {
+        freeing.push_back(r->channel);
+      } else if (r->channel) {
+        relays.push_back(r);
+        read_local(r);
+      } else if (!r->done) {
+        LOG(warning) << "Cannot forward to " << r->t.host << ':'
+                     << r->t.port << ": " << ssh2_err(session);
+        fail(*r, "channel refused");
+      }
+    }
+  }
+
+  // Move data from local to the channel; true if any was
+  bool write_channel(const std::shared_ptr<relay>& rp) {
+    relay& r = *rp;
+    bool moved = false;
+    while (r.up_off < r.up_len) {
+      if (!room()) {
+        congested = true;
+        return moved;
+      }
+      ssize_t n = libssh2_channel_write(r.channel, r.up + r.up_off,
+                                        r.up_len - r.up_off);
+      if (n == LIBSSH2_ERROR_EAGAIN)
+        return moved;
+      if (n < 0) {
+        fail(r, "Cannot write to channel: " + ssh2_err(session));
+        return moved;
+      }
+      r.up_off += n;
+      r.t.bytes_out += n;
+      moved = true;
+    }
+    r.up_off = r.up_len = 0;
+    if (!r.local_eof) {
+      read_local(rp);
+      return moved;
+    }
+    if (r.eof_sent)
+      return moved;
+    if (!room()) {
+      congested = true;
+      return moved;
+    }
+    int rc = libssh2_channel_send_eof(r.channel);
+    if (rc == LIBSSH2_ERROR_EAGAIN)
+      return moved;
+    if (rc) {
+      fail(r, "Cannot send EOF: " + ssh2_err(session));
+      return moved;
+    }
+    r.eof_sent = true;
+    return true;
+  }
+
+  // Whether data or the end of it waits in libssh2 for r
+  bool readable(relay& r) const {
+    return !r.writing && !r.remote_eof && !r.done &&
+      (libssh2_poll_channel_read(r.channel, 0) ||
+       libssh2_channel_eof(r.channel));
+  }
+
+  // Move data from the channel to local; true if any was
+  bool read_channel(const std::shared_ptr<relay>& r) {
+    // Reading may adjust the window
+    if (!room()) {
+      congested = true;
+      return false;
+    }
+    ssize_t n = libssh2_channel_read(r->channel, r->down, opts.buffer_size);
+    if (n == LIBSSH2_ERROR_EAGAIN)
+      return false;
+    if (n < 0) {
+      fail(*r, "Cannot read from channel: " + ssh2_err(session));
+      return false;
+    }
+    if (n == 0) {
+      r->remote_eof = true;
+      boost::system::error_code ec;
+      r->local.shutdown(tcp::socket::shutdown_send, ec);
+      return true;
+    }
+    r->t.bytes_in += n;
+    write_local(r, n);
+    return true;
+  }
+
+  void free_channels() {
+    for (auto it = freeing.begin(); it != freeing.end();) {
+      if (!room()) {
+        congested = true;
+        return;
+      }
+      if (libssh2_channel_free(*it) == LIBSSH2_ERROR_EAGAIN)
+        ++it;
+      else
+        it = freeing.erase(it);
+    }
+  }
+
+  // Move what can be moved without blocking, writing the packets of all
+  // relays together, then wait for the session socket
+  void pump() {
+    if (closed)
+      return;
+    {
+      io_batch _batch;
+      congested = false;
+      open_channels();
+      // The first read takes in whatever the socket has, for every
+      // channel; later ones only run for channels with something queued.
+      // Any call may take in more, so loop until nothing moves.
+      bool drained = false, moved;
+      int idle = 0;
+      do {
+        moved = false;
+        for (auto it = relays.begin(); it != relays.end() && !congested;) {
+          auto& r = *it;
+          if (!r->done)
+            moved |= write_channel(r);
+          if (!r->done && !r->writing && !r->remote_eof &&
+              (!drained || readable(*r))) {
+            drained = true;
+            moved |= read_channel(r);
+          }
+          if (r->local_eof && r->eof_sent && r->remote_eof && !r->writing)
+            r->done = true;
+          if (r->done) {
+            freeing.push_back(r->channel);
+            it = relays.erase(it);
+          } else
+            ++it;
+        }
+        if (!congested)
+          free_channels();
+        idle = moved ? 0 : idle + 1;
+      } while (!congested && idle < 2 &&
+               (moved || std::any_of(relays.begin(), relays.end(),
+                                     [this](const auto& r) {
+                                       return readable(*r);
+                                     })));
+      // Round-robin, so that the first relays do not take all the room
+      if (relays.size() > 1)
+        relays.splice(relays.end(), relays, relays.begin());
+    }
+    io_batch::after_flush([self = shared_from_this()] { self->arm(); });
+  }
+
+  // Wait for the session socket, as needed by libssh2 or by what the
+  // transport holds
+  void arm() {
+    if (closed)
+      return;
+    if (congested && room()) {
+      boost::asio::post(s.get_executor(),
+                        [self = shared_from_this()] { self->pump(); });
+      return;
+    }
+    if (relays.empty() && opening.empty() && freeing.empty())
+      return;
+    if (!wait_read) {
+      wait_read = true;
+      s.async_wait(tcp::socket::wait_read,
+                   [self = shared_from_this()]
+                   (const boost::system::error_code& ec) {
+                     self->wait_read = false;
+                     if (ec != boost::asio::error::operation_aborted)
+                       self->pump();
+                   });
+    }
+    if (!wait_write && ssh2_wait_type(session) == tcp::socket::wait_write) {
+      wait_write = true;
+      s.async_wait(tcp::socket::wait_write,
+                   [self = shared_from_this()]
+                   (const boost::system::error_code& ec) {
+                     self->wait_write = false;
+                     if (ec != boost::asio::error::operation_aborted)
+                       self->pump();
+                   });
+    }
+  }
+
+  void close() {
+    if (closed)
+      return;
+    closed = true;
+    boost::system::error_code ec;
+    for (auto& t : tunnels)
+      t->acceptor.close(ec);
+    for (auto& r : opening)
+      r->local.close(ec);
+    io_batch::flush_all();
+    if (open_started) {
+      ssh2_retry(session, s, [this] { return open_channel(); });
+      if (opening.front()->channel)
+        freeing.push_back(opening.front()->channel);
+    }
+    opening.clear();
+    for (auto& r : relays) {
+      r->local.close(ec);
+      freeing.push_back(r->channel);
+    }
+    relays.clear();
+    for (auto c : freeing)
+      ssh2_retry(session, s, [c] { return libssh2_channel_free(c); });
+    freeing.clear();
+    if (wait_read || wait_write)
+      s.cancel(ec);
+  }
+};
+
+ssh_forwarder::ssh_forwarder(LIBSSH2_SESSION *session, tcp::socket& s)
+  : ssh_forwarder(session, s, options()) {}
+
+ssh_forwarder::ssh_forwarder(LIBSSH2_SESSION *session, tcp::socket& s,
+                             const options& opts)
+  : st(std::make_shared<state>(session, s, opts)) {}
+
+ssh_forwarder::~ssh_forwarder() {
+  close();
+}
+
+size_t ssh_forwarder::forward(const tcp::endpoint& local,
+                              const std::string& host, unsigned short port) {
+  auto& io = static_cast<boost::asio::io_context&>(
+    st->s.get_executor().context());
+  auto t = std::make_unique<state::tunnel>(io, host, port);
+  t->acceptor.open(local.protocol());
+  t->acceptor.set_option(tcp::acceptor::reuse_address(true));
+  t->acceptor.bind(local);
+  t->acceptor.listen();
+  LOG(debug) << "Forwarding " << t->acceptor.local_endpoint() << " to "
+             << host << ':' << port;
+  std::lock_guard<std::mutex> l(st->m);
+  st->tunnels.push_back(std::move(t));
+  st->accept(*st->tunnels.back());
+  return st->tunnels.size() - 1;
+}
+
+tcp::endpoint ssh_forwarder::local_endpoint(size_t i) const {
+  std::lock_guard<std::mutex> l(st->m);
+  return st->tunnels.at(i)->acceptor.local_endpoint();
+}
+
+tunnel_stats ssh_forwarder::stats(size_t i) const {
+  std::lock_guard<std::mutex> l(st->m);
+  const auto& t = *st->tunnels.at(i);
+  tunnel_stats r;
+  r.accepted = t.accepted;
+  r.open = t.open;
+  r.failed = t.failed;
+  r.bytes_out = t.bytes_out;
+  r.bytes_in = t.bytes_in;
+  r.elapsed = clock_type::now() - t.start;
+  return r;
+}
+
+size_t ssh_forwarder::ports() const {
+  std::lock_guard<std::mutex> l(st->m);
+  return st->tunnels.size();
+}
+
+void ssh_forwarder::close() {
+  st->close();
+}
@@ -0,0 +1,76 @@
+#if !defined TEST_TUNNEL_HPP_INCLUDED
+#define TEST_TUNNEL_HPP_INCLUDED
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <boost/asio.hpp>
+#include <libssh2.h>
+
+#include "net.hpp"
+
+// Counters of one forwarded port, see ssh_forwarder::stats()
+struct tunnel_stats {
+  // connections accepted, open now, and refused or failed to open
+  uint64_t accepted = 0, open = 0, failed = 0;
+  // bytes sent to the target, and received from it
+  uint64_t bytes_out = 0, bytes_in = 0;
+  // since the port was forwarded
+  std::chrono::steady_clock::duration elapsed{ 0 };
+
+  // Throughput in bytes per second, since the port was forwarded
+  double out_rate() const;
+  double in_rate() const;
+};
+
+// Local to remote TCP forwarding (direct-tcpip, as ssh -L) over one
+// authenticated session. Connections to each forwarded local port are
+// relayed to a target reached from the server, each over a channel of
+// its own, all driven by the io_context of the session socket: run it
+// to forward, from one thread at a time. The session is not to be used
+// otherwise while forwarding.
+class ssh_forwarder {
+public:
+  struct options {
+    // relay buffer size, for each direction of each connection
+    size_t buffer_size = 64 << 10;
+    // connections open at once, over all forwarded ports; more are
+    // refused
+    size_t max_connections = 256;
+    // SSH window of each channel: data the server may send ahead. With
+    // at least bandwidth * round-trip time the pipe stays full.
+    unsigned window = 4 << 20;
+    // applied to accepted connections
+    socket_tuning tuning;
+  };
+
+  ssh_forwarder(LIBSSH2_SESSION *session, boost::asio::ip::tcp::socket& s);
+  ssh_forwarder(LIBSSH2_SESSION *session, boost::asio::ip::tcp::socket& s,
+                const options& opts);
+  ssh_forwarder(const ssh_forwarder&) = delete;
+  // close()
+  ~ssh_forwarder();
+
+  // Listen on local and forward its connections to host:port, as seen
+  // from the server. Returns the index of the forwarded port. From the
+  // thread running the io_context, or while none does.
+  size_t forward(const boost::asio::ip::tcp::endpoint& local,
+                 const std::string& host, unsigned short port);
+  // Endpoint actually listened on, with the port picked by the system if
+  // forward() was given 0
+  boost::asio::ip::tcp::endpoint local_endpoint(size_t i) const;
+  // Counters of port i; safe from any thread
+  tunnel_stats stats(size_t i) const;
+  size_t ports() const;
+
+  // Stop listening, close all connections and their channels. From the
+  // thread running the io_context, or while none does.
+  void close();
+
+private:
+  struct state;
+  std::shared_ptr<state> st;
+};
+
+#endif// TEST_TUNNEL_HPP_INCLUDED
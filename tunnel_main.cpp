@@ -0,0 +1,131 @@
+// Forward local ports through one SSH session, as ssh -L:
+//   Tunnel [-u user] [-p port] [-t seconds] -L [bind:]port:host:hostport...
+//          pubkey_file privkey_file [user@]host[:port]
+// The key passphrase, if any, is read from KEY_PASS. Runs until SIGINT or
+// SIGTERM, then prints the counters of each forwarded port.
+#include <csignal>
+#include <iostream>
+#include <sstream>
+
+#include "batch.hpp"
+#include "log.hpp"
+#include "transport.hpp"
+#include "tunnel.hpp"
+
+using boost::asio::ip::tcp;
+
+static int usage(const char* argv0) {
+  std::cerr << "usage: " << argv0 << " [-u user] [-p port] [-t seconds]"
+            << " -L [bind:]port:host:hostport... pubkey_file privkey_file"
+            << " [user@]host[:port]" << std::endl;
+  return 2;
+}
+
+struct forward_spec {
+  tcp::endpoint local;
+  std::string host;
+  unsigned short port;
+};
+
+// [bind:]port:host:hostport, host and bind possibly in brackets
+static forward_spec parse_forward(const std::string& spec) {
+  std::vector<std::string> parts;
+  for (size_t i = 0; i < spec.size();) {
+    size_t end;
+    if (spec[i] == '[') {
+      end = spec.find(']', i);
+      if (end == std::string::npos)
+        break;
+      parts.push_back(spec.substr(i + 1, end - i - 1));
+      ++end;
+    } else {
+      end = std::min(spec.find(':', i), spec.size());
+      parts.push_back(spec.substr(i, end - i));
+    }
+    i = end + 1;
+  }
+  if (parts.size() == 3)
+    parts.insert(parts.begin(), "127.0.0.1");
+  if (parts.size() != 4)
+    throw std::runtime_error("Invalid forwarding: " + spec);
+  forward_spec f;
+  f.local = tcp::endpoint(boost::asio::ip::make_address(parts[0]),
+                          std::stoul(parts[1]));
+  f.host = parts[2];
+  f.port = std::stoul(parts[3]);
+  return f;
+}
+
+int main(int argc, char** argv) {
+  log_set_level(getenv("TRACE") ? log_level::trace :
+                getenv("DEBUG") ? log_level::debug : log_level::warning);
+
+  remote_t defaults(nullptr, nullptr, getenv("USER"));
+  defaults.check_host = !getenv("NO_HOST_CHECK");
+  std::vector<forward_spec> forwards;
+  std::vector<const char*> args;
+  try {
+    for (int i = 1; i < argc; ++i) {
+      std::string a = argv[i];
+      if (a.size() == 2 && a[0] == '-' && i + 1 < argc) {
+        switch (a[1]) {
+          case 'u': defaults.username = argv[++i]; continue;
+          case 'p': defaults.port = argv[++i]; continue;
+          case 't':
+            defaults.timeouts.total =
+              std::chrono::seconds(std::stoul(argv[++i]));
+            continue;
+          case 'L': forwards.push_back(parse_forward(argv[++i])); continue;
+          default: return usage(argv[0]);
+        }
+      }
+      args.push_back(argv[i]);
+    }
+    if (args.size() != 3 || forwards.empty())
+      return usage(argv[0]);
+
+    std::istringstream in(args[2]);
+    auto hosts = read_hosts(in, defaults);
+    if (hosts.size() != 1)
+      return usage(argv[0]);
+    auto key = key_pair::from_files(args[0], args[1]);
+
+    signal(SIGPIPE, SIG_IGN);
+    boost::asio::io_context io;
+    ssh_conn c(io);
+    ssh_connect(c.session, c.s, hosts[0]);
+    int rc = auth_pukey_mem(c.session, c.s, hosts[0].username, key,
+                            getenv("KEY_PASS"));
+    if (rc) {
+      std::cerr << "Authentication failed: " << known_retvals(rc)
+                << std::endl;
+      return 1;
+    }
+
+    ssh_forwarder fwd(c.session, c.s);
+    std::vector<tcp::endpoint> bound;
+    for (const auto& f : forwards)
+      bound.push_back(fwd.local_endpoint(fwd.forward(f.local, f.host,
+                                                     f.port)));
+    boost::asio::signal_set signals(io, SIGINT, SIGTERM);
+    signals.async_wait([&](const boost::system::error_code& ec, int) {
+      if (!ec)
+        fwd.close();
+    });
+    run_batched(io);
+
+    for (size_t i = 0; i < fwd.ports(); ++i) {
+      auto st = fwd.stats(i);
+      std::cout << bound[i] << " -> " << forwards[i].host << ':'
+                << forwards[i].port << '\t' << st.accepted << " accepted, "
+                << st.failed << " failed, " << st.bytes_out << " bytes out ("
+                << st.out_rate() / 1e6 << " MB/s), " << st.bytes_in
+                << " bytes in (" << st.in_rate() / 1e6 << " MB/s)"
+                << std::endl;
+    }
+    return 0;
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 2;
+  }
+}
@@ -1,11 +1,17 @@
-#include <boost/log/trivial.hpp>
-#include <boost/archive/iterators/base64_from_binary.hpp>
-#include <boost/archive/iterators/transform_width.hpp>
+#include "log.hpp"
 #include "utils.hpp"
 #include "test.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
 #if defined HAVE_UNISTD
 #include <unistd.h>
 #endif
+#if defined HAVE_MEMFD_CREATE
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+#include <boost/interprocess/file_mapping.hpp>
 
 boost::filesystem::path home() {
 #if defined _WIN32 || defined _WIN64
@@ -32,14 +38,74 @@ boost::filesystem::path home() {
 #if defined _MSC_VER
 # pragma warning(pop)
 #endif
-  BOOST_LOG_TRIVIAL(info) << "Cannot find home directory";
+  LOG(info) << "Cannot find home directory";
   return boost::filesystem::path{ "." };
 }
 
+void write_all(int fd, const char* data, size_t len) {
+  while (len) {
+    ssize_t rc = ::write(fd, data, len);
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      THROW(std::string("Cannot write into file: ") + strerror(errno));
+    }
+    data += rc;
+    len -= rc;
+  }
+}
+
+memfile::memfile(const char* name,
+                 std::initializer_list<std::string_view> parts) {
+#if defined HAVE_MEMFD_CREATE
+  fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0)
+    THROW(std::string("memfd_create failed: ") + strerror(errno));
+  // The destructor does not run if the constructor throws
+  autofn _close([this] { ::close(fd); fd = -1; });
+  filename = "/proc/self/fd/" + std::to_string(fd);
+  for (auto p : parts)
+    write_all(fd, p.data(), p.size());
+  // Content is final: readers get exactly what was written
+  fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE |
+        F_SEAL_SEAL);
+  _close.done = true;
+#else
+  THROW("In-memory files are not supported");
+#endif
+}
+
+memfile::~memfile() {
+  if (fd >= 0)
+    ::close(fd);
+}
+
+mapped_file::mapped_file(const boost::filesystem::path& fn) {
+  namespace ipc = boost::interprocess;
+  try {
+    ipc::file_mapping file(fn.string().c_str(), ipc::read_only);
+    // Mapping zero bytes is an error
+    if (boost::filesystem::file_size(fn))
+      region = ipc::mapped_region(file, ipc::read_only);
+  } catch (const ipc::interprocess_exception& e) {
+    THROW("Cannot map " + fn.string() + ": " + e.what());
+  } catch (const boost::filesystem::filesystem_error& e) {
+    THROW("Cannot map " + fn.string() + ": " + e.what());
+  }
+}
+
+void mapped_file::sequential() {
+  if (region.get_size())
+    region.advise(boost::interprocess::mapped_region::advice_sequential);
+}
+
 std::ostream& operator<< (std::ostream& stream, const base64dump& v) {
-  using namespace boost::archive::iterators;
-  using It = base64_from_binary<transform_width
-                                <std::string::const_iterator, 6, 8>>;
-  auto tmp = std::string(It(std::begin(v.ref)), It(std::end(v.ref)));
-  return stream << tmp.append((3 - v.ref.size() % 3) % 3, '=');
+  // Encoded by chunks on the stack, no allocation
+  char buf[1024];
+  const size_t chunk = sizeof(buf) / 4 * 3;
+  for (size_t i = 0; i < v.v.size(); i += chunk) {
+    size_t n = std::min(chunk, v.v.size() - i);
+    stream.write(buf, base64_encode(v.v.data() + i, n, buf));
+  }
+  return stream;
 }
@@ -1,19 +1,24 @@
 #if !defined LIBLAUNCH_UTILS_HPP_INCLUDED
 #define LIBLAUNCH_UTILS_HPP_INCLUDED 1
 
+#include <initializer_list>
 #include <ostream>
 #include <string>
+#include <string_view>
 #if defined HAVE_UNISTD
 #include <unistd.h>
 #endif
 #include <boost/asio.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 
+#include "base64.hpp"
+
+// Streams its data base64-encoded; the data must outlive it
 struct base64dump {
-  std::string s;
-  const std::string& ref;
-  explicit base64dump(const std::string& a) : ref(a) {}
-  explicit base64dump(const char* a, size_t len) : s(a, len), ref(s) {}
+  std::string_view v;
+  explicit base64dump(std::string_view a) : v(a) {}
+  explicit base64dump(const char* a, size_t len) : v(a, len) {}
 };
 std::ostream& operator<< (std::ostream& stream, const base64dump& v);
 
@@ -23,6 +28,10 @@ public:
   unlinkable(const std::string &fname) : filename(fname) {}
   unlinkable(const unlinkable&) = delete;
   unlinkable(unlinkable&& from) { std::swap(filename, from.filename); }
+  unlinkable& operator=(unlinkable&& from) {
+    std::swap(filename, from.filename);
+    return *this;
+  }
   ~unlinkable() {
     if (!filename.empty())
 #if defined _MSC_VER
@@ -36,6 +45,47 @@ public:
   const std::string& fn() const { return filename; }
 };
 
+// Write the whole buffer into fd, retrying on short writes; throws on error
+void write_all(int fd, const char* data, size_t len);
+
+// Anonymous in-memory file (memfd) holding parts one after the other,
+// reachable by path while the instance lives. Throws if such files are not
+// supported.
+class memfile {
+  int fd = -1;
+  std::string filename;
+public:
+  memfile() = default;
+  memfile(const char* name, std::initializer_list<std::string_view> parts);
+  memfile(const memfile&) = delete;
+  memfile(memfile&& from) {
+    std::swap(fd, from.fd);
+    std::swap(filename, from.filename);
+  }
+  memfile& operator=(memfile&& from) {
+    std::swap(fd, from.fd);
+    std::swap(filename, from.filename);
+    return *this;
+  }
+  ~memfile();
+  operator const std::string&() const { return filename; }
+  const std::string& fn() const { return filename; }
+};
+
+// Read-only mapping of a whole file, throws if it cannot be mapped. An
+// empty file has an empty view.
+class mapped_file {
+  boost::interprocess::mapped_region region;
+public:
+  explicit mapped_file(const boost::filesystem::path& fn);
+  std::string_view view() const {
+    return std::string_view(static_cast<const char*>(region.get_address()),
+                            region.get_size());
+  }
+  // The mapping is read once, front to back: read ahead aggressively
+  void sequential();
+};
+
 template <typename T> void my_delete(T* a) { delete a; }
 template <typename T, typename R = void, R Deleter(T*) = my_delete<T> >
 struct auto_del {
@@ -62,11 +112,11 @@ struct autofn {
 };
 
 struct sview {
-  const std::string& s;
+  std::string_view s;
   const size_t len;
-  sview(const std::string& s_, size_t len_ = 72) : s(s_), len(len_) {}
+  sview(std::string_view s_, size_t len_ = 72) : s(s_), len(len_) {}
 };
-static std::ostream& operator<< (std::ostream& stream, const sview& v) {
+inline std::ostream& operator<< (std::ostream& stream, const sview& v) {
   return stream << v.s.substr(0, std::min(v.len, v.s.size()));
 }
 